@@ -376,6 +376,46 @@ HashTable* apc_flip_hash(HashTable *hash) {
 }
 /* }}} */
 
+/* {{{ apc_page_size */
+PHP_APCU_API size_t apc_page_size(zend_bool huge)
+{
+#ifdef PHP_WIN32
+    SYSTEM_INFO si;
+
+    if (huge) {
+        return 0;
+    }
+
+    GetSystemInfo(&si);
+    return si.dwPageSize;
+#else
+    if (huge) {
+        size_t size = 0;
+#ifdef __linux__
+        FILE* meminfo;
+        char line[128];
+
+        /* the size of the huge pages the administrator can reserve with vm.nr_hugepages */
+        if ((meminfo = fopen("/proc/meminfo", "r"))) {
+            while (fgets(line, sizeof(line), meminfo)) {
+                unsigned long kb;
+
+                if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+                    size = kb * 1024;
+                    break;
+                }
+            }
+            fclose(meminfo);
+        }
+#endif
+        return size;
+    }
+
+    return (size_t) sysconf(_SC_PAGESIZE);
+#endif
+}
+/* }}} */
+
 /*
 * Serializer API
 */
@@ -100,6 +100,9 @@ PHP_APCU_API unsigned int apc_crc32(const unsigned char* buf, unsigned int len);
 /* apc_flip_hash flips keys and values for faster searching */
 PHP_APCU_API HashTable* apc_flip_hash(HashTable *hash);
 
+/* apc_page_size: returns the size of the pages the system maps memory with, or of its huge pages, 0 if it has none */
+PHP_APCU_API size_t apc_page_size(zend_bool huge);
+
 #define APC_NEGATIVE_MATCH 1
 #define APC_POSITIVE_MATCH 2
 
@@ -110,6 +113,7 @@ PHP_APCU_API HashTable* apc_flip_hash(HashTable *hash);
 # define APC_UNUSED __attribute__((unused))
 # define APC_USED __attribute__((used))
 # define APC_ALLOC __attribute__((malloc))
+# define APC_PREFETCH(p) __builtin_prefetch(p)
 # if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__  > 2)
 #  define APC_HOTSPOT __attribute__((hot))
 # else 
@@ -119,9 +123,28 @@ PHP_APCU_API HashTable* apc_flip_hash(HashTable *hash);
 # define APC_UNUSED
 # define APC_USED
 # define APC_ALLOC 
+# define APC_PREFETCH(p)
 # define APC_HOTSPOT 
 #endif
 
+/* structures in shared memory that are written by many processes are padded to this */
+#ifndef APC_CACHE_LINE_SIZE
+# define APC_CACHE_LINE_SIZE 64
+#endif
+
+/* bytes that round size up to a whole number of lines, 0 when it already is one */
+#define APC_CACHE_LINE_PAD(size) \
+	((APC_CACHE_LINE_SIZE - ((size) % APC_CACHE_LINE_SIZE)) % APC_CACHE_LINE_SIZE)
+
+/* the pad member of a structure of size bytes; an array of no elements is only allowed by GNU C,
+   elsewhere members that fill their lines exactly are given a whole line more */
+#ifdef __GNUC__
+# define APC_CACHE_LINE_PADDING(size) char pad[APC_CACHE_LINE_PAD(size)]
+#else
+# define APC_CACHE_LINE_PADDING(size) \
+	char pad[APC_CACHE_LINE_PAD(size) ? APC_CACHE_LINE_PAD(size) : APC_CACHE_LINE_SIZE]
+#endif
+
 /*
 * Serializer API
 */
@@ -391,11 +391,13 @@ PHP_APCU_API apc_bd_t* apc_bin_dump(apc_cache_t* cache, HashTable *user_vars TSR
     /* flip the hash for faster filter checking */
     user_vars = apc_flip_hash(user_vars);
 
-    APC_RLOCK(cache->header);
+    apc_cache_lock_stripes(cache, 0 TSRMLS_CC);
 
     /* get size and entry counts */
-    for(i=0; i < cache->nslots; i++) {
-        sp = cache->slots[i];
+    for(i=0; i < apc_cache_nchains(cache); i++) {
+        apc_cache_slot_t** chain = apc_cache_chain(cache, i);
+
+        sp = chain ? *chain : NULL;
         for(; sp != NULL; sp = sp->next) {
             if(apc_bin_checkfilter(user_vars, sp->key.str, sp->key.len)) {
                 size += sizeof(apc_bd_entry_t*) + sizeof(apc_bd_entry_t);
@@ -426,8 +428,10 @@ PHP_APCU_API apc_bd_t* apc_bin_dump(apc_cache_t* cache, HashTable *user_vars TSR
     /* User entries */
     zend_hash_init(&ctxt.copied, 0, NULL, NULL, 0);
     count = 0;
-    for(i=0; i < cache->nslots; i++) {
-        sp = cache->slots[i];
+    for(i=0; i < apc_cache_nchains(cache); i++) {
+        apc_cache_slot_t** chain = apc_cache_chain(cache, i);
+
+        sp = chain ? *chain : NULL;
         for(; sp != NULL; sp = sp->next) {
             if(apc_bin_checkfilter(user_vars, sp->key.str, sp->key.len)) {
                 ep = &bd->entries[count];
@@ -482,7 +486,7 @@ PHP_APCU_API apc_bd_t* apc_bin_dump(apc_cache_t* cache, HashTable *user_vars TSR
     zend_llist_destroy(&ll);
     zend_hash_destroy(&APCG(apc_bd_alloc_list));
 
-    APC_RUNLOCK(cache->header);
+    apc_cache_unlock_stripes(cache, 0 TSRMLS_CC);
 
     if(user_vars) {
         zend_hash_destroy(user_vars);
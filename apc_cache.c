@@ -40,14 +40,86 @@
 #include "ext/standard/md5.h"
 #include "ext/standard/php_var.h"
 #include "ext/standard/php_smart_str.h"
+#include "ext/standard/php_lcg.h"
+
+#include <math.h>
+
+#ifdef APC_CACHE_OPTIMISTIC
+# include <signal.h>
+#endif
+
+#ifdef PHP_WIN32
+# include "win32/time.h"
+#else
+# include <sys/time.h>
+#endif
 
 typedef void* (*ht_copy_fun_t)(void*, void*, apc_context_t* TSRMLS_DC);
 typedef int (*ht_check_copy_fun_t)(Bucket*, va_list);
 
 #define CHECK(p) { if ((p) == NULL) return NULL; }
 
+/* {{{ stripe of hash h
+   the number of slots in a table is always a multiple of the number of stripes, so the stripe of
+   a key is the same in every table, and the stripe of slot s is the stripe of every key in it */
+#define APC_CACHE_STRIPE(c, h) (&(c)->stripes[(h) % (c)->nstripes]) /* }}} */
+
+/* {{{ microseconds between looks at an in-flight marker */
+#define APC_CACHE_ENTRY_POLL 1000 /* }}} */
+
+/* {{{ seconds before another caller is elected to refresh a value whose refresh has not arrived */
+#define APC_CACHE_REFRESH_TIMEOUT 5 /* }}} */
+
+/* {{{ number of chains a sweep visits between looks at the clock */
+#define APC_CACHE_SWEEP_CHECK 16 /* }}} */
+
+/* {{{ fragmentation of shared memory above which entries are moved, see apc_cache_compact */
+#define APC_CACHE_COMPACT_RATIO 0.5 /* }}} */
+
+/* {{{ chains a compaction step looks at, and slots it pins at a time */
+#define APC_CACHE_COMPACT_CHAINS 256
+#define APC_CACHE_COMPACT_BATCH  8 /* }}} */
+
+/* {{{ the head of a slot of the old table which has been migrated */
+#define APC_CACHE_MOVED ((apc_cache_slot_t*) 1) /* }}} */
+
+/* {{{ the table grows when there are more entries than slots */
+#define APC_CACHE_MAX_LOAD 1 /* }}} */
+
+/* {{{ slots of the old table migrated by each insert while resizing */
+#define APC_CACHE_MIGRATE_STEP 4 /* }}} */
+
+/* {{{ write lock and unlock a stripe, the version of a stripe is odd while it is write locked */
+#define APC_CACHE_WLOCK(st)   { APC_LOCK(st); (st)->version++; MEMORY_BARRIER(); }
+#define APC_CACHE_WUNLOCK(st) { MEMORY_BARRIER(); (st)->version++; APC_UNLOCK(st); } /* }}} */
+
+/* {{{ number of counter i of the filter of table t for hash h, by double hashing */
+#define APC_CACHE_FILTER(t, h, i) \
+	(((h) + (i) * ((((h) * 0x9E3779B1UL) >> 16) | 1)) & ((t)->nfilter - 1)) /* }}} */
+
+/* {{{ word and bit position of counter c, four 8 bit counters are packed into each word */
+#define APC_CACHE_FILTER_WORD(t, c)  ((t)->filter[(c) >> 2])
+#define APC_CACHE_FILTER_SHIFT(c)    (((c) & 3) << 3) /* }}} */
+
+/* {{{ bumps the modification generation of hash h, after the change to the key is visible */
+#define APC_CACHE_TOUCH(c, h) ATOMIC_INC((c)->gens[(h) % APC_CACHE_GENERATIONS]) /* }}} */
+
+/* {{{ attempts a reader makes without locking before it takes the read lock */
+#define APC_CACHE_OPTIMISTIC_TRIES 3 /* }}} */
+
+/* {{{ owner of a reader that is being released, see apc_cache_reader_dead */
+#define APC_CACHE_READER_RESET ((pid_t) -1) /* }}} */
+
+/* {{{ statistics shard of the current context */
+#ifdef ZTS
+# define APC_CACHE_STATS(c) (&(c)->stats[(((zend_uintptr_t) TSRMLS_C) / sizeof(void*)) % APC_CACHE_STAT_SHARDS])
+#else
+# define APC_CACHE_STATS(c) (&(c)->stats[(c)->shard])
+#endif /* }}} */
+
 static APC_HOTSPOT zval* my_copy_zval(zval* dst, const zval* src, apc_context_t* ctxt TSRMLS_DC);
 static HashTable* my_copy_hashtable_ex(HashTable*, HashTable* TSRMLS_DC, ht_copy_fun_t, int, apc_context_t*, ht_check_copy_fun_t, ...);
+static apc_cache_slot_t* apc_cache_find_slot(apc_cache_t* cache, char *strkey, zend_uint keylen, zend_ulong h);
 #define my_copy_hashtable( dst, src, copy_fn, holds_ptr, ctxt) \
     my_copy_hashtable_ex(dst, src TSRMLS_CC, copy_fn, holds_ptr, ctxt, NULL)
 
@@ -124,11 +196,15 @@ apc_cache_slot_t* make_slot(apc_cache_t* cache, apc_cache_key_t *key, apc_cache_
 			
 			/* set slot relation */
 			p->next = next;
+			p->gc_next = NULL;
+			p->timer_next = NULL;
+			p->timer_prev = NULL;
 			
 			/* set slot defaults */
 			p->nhits = 0;
 			p->ctime = t;
 			p->atime = t;
+			p->referenced = 0;
 			p->dtime = 0;
 		}
 	}
@@ -146,88 +222,566 @@ static void free_slot(apc_cache_slot_t* slot TSRMLS_DC)
 }
 /* }}} */
 
+/* {{{ apc_cache_table_create */
+static apc_cache_table_t* apc_cache_table_create(apc_sma_t* sma, zend_ulong nslots, zend_bool indexed, zend_bool filtered TSRMLS_DC)
+{
+	apc_cache_table_t* table;
+	size_t size = sizeof(apc_cache_table_t) + nslots*sizeof(apc_cache_slot_t*);
+	zend_ulong nfilter = 0;
+
+	/* the index begins on the first line boundary after the slots */
+	if (indexed) {
+		size += APC_CACHE_LINE_SIZE + nslots*sizeof(apc_cache_bucket_t);
+	}
+
+	/* the filter follows, sized for the slots so that it does not fill up as the table grows */
+	if (filtered) {
+		for (nfilter = 1024; nfilter < nslots * APC_CACHE_FILTER_LOAD; nfilter <<= 1);
+
+		size += nfilter;
+	}
+
+	/* an index that does not fit is not worth entries */
+	if (!(table = (apc_cache_table_t*) sma->try_malloc(size TSRMLS_CC))) {
+		return NULL;
+	}
+
+	/* zero slots and index */
+	memset(table, 0, size);
+
+	table->nslots = nslots;
+	table->slots = (apc_cache_slot_t**) (table + 1);
+
+	if (indexed) {
+		table->buckets = (apc_cache_bucket_t*)
+			((((size_t) (table->slots + nslots)) + APC_CACHE_LINE_SIZE - 1) & ~(APC_CACHE_LINE_SIZE - 1));
+	} else {
+		table->buckets = NULL;
+	}
+
+	/* the filter takes the end of the allocation, a byte for each counter */
+	if (filtered) {
+		table->filter = (volatile zend_uint*) ((size - nfilter) + (char*) table);
+	} else {
+		table->filter = NULL;
+	}
+	table->nfilter = nfilter;
+
+	return table;
+} /* }}} */
+
+/* {{{ apc_cache_home
+ returns the table key h lives in, and sets the slot in that table
+ Note: the caller must hold the stripe lock, or check the stripe version after using the result */
+static apc_cache_table_t* apc_cache_home(apc_cache_t* cache, zend_ulong h, zend_ulong* s)
+{
+	apc_cache_table_t* table = cache->header->old;
+
+	/* slots that have not been migrated are still in the old table */
+	if (table) {
+		(*s) = h % table->nslots;
+
+		if (table->slots[(*s)] != APC_CACHE_MOVED) {
+			return table;
+		}
+	}
+
+	table = cache->header->table;
+	(*s) = h % table->nslots;
+
+	return table;
+} /* }}} */
+
+/* {{{ apc_cache_index_slot
+ rebuilds the bucket of slot s from its chain, whenever the chain has changed
+ Note: the caller must hold the stripe write lock */
+static void apc_cache_index_slot(apc_cache_table_t* table, zend_ulong s)
+{
+	if (table->buckets) {
+		apc_cache_bucket_t* bucket = &table->buckets[s];
+		apc_cache_slot_t* slot = table->slots[s];
+		zend_uint count = 0;
+
+		/* migrated */
+		if (slot == APC_CACHE_MOVED) {
+			slot = NULL;
+		}
+
+		while (slot) {
+			if (count < APC_CACHE_BUCKET_WAYS) {
+				bucket->h[count] = slot->key.h;
+				bucket->len[count] = slot->key.len;
+				bucket->slot[count] = slot;
+			}
+			count++;
+
+			/* next */
+			slot = slot->next;
+		}
+
+		bucket->count = count;
+	}
+} /* }}} */
+
+/* {{{ apc_cache_chain_table
+ returns the table chain i is in, and sets its slot in that table */
+static apc_cache_table_t* apc_cache_chain_table(apc_cache_t* cache, zend_ulong i, zend_ulong* s)
+{
+	apc_cache_table_t* old = cache->header->old;
+
+	/* the old table comes first */
+	if (old) {
+		if (i < old->nslots) {
+			(*s) = i;
+			return old;
+		}
+		i -= old->nslots;
+	}
+
+	(*s) = i;
+
+	return cache->header->table;
+} /* }}} */
+
+/* {{{ apc_cache_index_chain */
+static void apc_cache_index_chain(apc_cache_t* cache, zend_ulong i)
+{
+	zend_ulong s;
+	apc_cache_table_t* table = apc_cache_chain_table(cache, i, &s);
+
+	apc_cache_index_slot(table, s);
+} /* }}} */
+
+/* {{{ apc_cache_nchains */
+PHP_APCU_API zend_ulong apc_cache_nchains(apc_cache_t* cache)
+{
+	apc_cache_table_t* old = cache->header->old;
+
+	if (old) {
+		return old->nslots + cache->header->table->nslots;
+	}
+
+	return cache->header->table->nslots;
+} /* }}} */
+
+/* {{{ apc_cache_chain */
+PHP_APCU_API apc_cache_slot_t** apc_cache_chain(apc_cache_t* cache, zend_ulong i)
+{
+	zend_ulong s;
+	apc_cache_table_t* table = apc_cache_chain_table(cache, i, &s);
+
+	/* migrated chains are empty */
+	if (table->slots[s] == APC_CACHE_MOVED) {
+		return NULL;
+	}
+
+	return &table->slots[s];
+} /* }}} */
+
 /* {{{ apc_cache_hash_slot
- Note: These calculations can and should be done outside of a lock */
+ Note: These calculations can and should be done outside of a lock, the slot
+       is only known under the stripe lock, see apc_cache_home */
 static void apc_cache_hash_slot(apc_cache_t* cache, 
                                 char *str,
                                 zend_uint len, 
-                                zend_ulong* hash, 
-                                zend_ulong* slot) {
+                                zend_ulong* hash) {
 	(*hash) = zend_inline_hash_func(str, len);
-	(*slot) = (*hash) % (cache->nslots);
 } /* }}} */
 
+/* {{{ apc_cache_wheel_spoke
+ returns the spoke of the wheel a slot expiring at the start of second expires hangs on
+ Note: the caller must hold the wheel lock */
+static apc_cache_slot_t** apc_cache_wheel_spoke(apc_cache_wheel_t* wheel, time_t expires)
+{
+	zend_ulong delta;
+	zend_uint level;
+
+	/* already expired, expire with the next second */
+	if (expires < wheel->now) {
+		expires = wheel->now;
+	}
+
+	delta = (zend_ulong) (expires - wheel->now);
+
+	for (level = 0; level < APC_CACHE_WHEEL_LEVELS; level++) {
+		if (delta < (1UL << (APC_CACHE_WHEEL_BITS * (level + 1)))) {
+			return &wheel->spokes[level][((zend_ulong) expires >> (APC_CACHE_WHEEL_BITS * level)) & APC_CACHE_WHEEL_MASK];
+		}
+	}
+
+	return &wheel->overflow;
+} /* }}} */
+
+/* {{{ apc_cache_wheel_hang
+ hangs the slot on the spoke for the second after its ttl has passed
+ Note: the caller must hold the wheel lock */
+static void apc_cache_wheel_hang(apc_cache_wheel_t* wheel, apc_cache_slot_t* slot)
+{
+	apc_cache_slot_t** spoke = apc_cache_wheel_spoke(
+		wheel, slot->ctime + slot->value->ttl + 1);
+
+	slot->timer_next = *spoke;
+	if (*spoke) {
+		(*spoke)->timer_prev = &slot->timer_next;
+	}
+	slot->timer_prev = spoke;
+	*spoke = slot;
+} /* }}} */
+
+/* {{{ apc_cache_wheel_take
+ takes every slot off the spoke, and returns them linked through timer_next
+ Note: the caller must hold the wheel lock */
+static apc_cache_slot_t* apc_cache_wheel_take(apc_cache_wheel_t* wheel, apc_cache_slot_t** spoke)
+{
+	apc_cache_slot_t* list = *spoke;
+	apc_cache_slot_t* p;
+
+	for (p = list; p; p = p->timer_next) {
+		p->timer_prev = NULL;
+	}
+	*spoke = NULL;
+
+	return list;
+} /* }}} */
+
+/* {{{ apc_cache_timer_add
+ Note: the caller must hold the stripe lock for the slot */
+static void apc_cache_timer_add(apc_cache_t* cache, apc_cache_slot_t* slot TSRMLS_DC)
+{
+	APC_LOCK(&cache->header->wheel);
+	apc_cache_wheel_hang(&cache->header->wheel, slot);
+	cache->header->wheel.ntimers++;
+	APC_UNLOCK(&cache->header->wheel);
+} /* }}} */
+
+/* {{{ apc_cache_timer_remove
+ Note: the caller must hold the stripe lock for the slot */
+static void apc_cache_timer_remove(apc_cache_t* cache, apc_cache_slot_t* slot TSRMLS_DC)
+{
+	APC_LOCK(&cache->header->wheel);
+	if (slot->timer_prev) {
+		*slot->timer_prev = slot->timer_next;
+		if (slot->timer_next) {
+			slot->timer_next->timer_prev = slot->timer_prev;
+		}
+		slot->timer_prev = NULL;
+		cache->header->wheel.ntimers--;
+	}
+	APC_UNLOCK(&cache->header->wheel);
+} /* }}} */
+
+/* {{{ apc_cache_filter_count
+ counts key h in, or out of, the filter of table
+ Counters saturate at APC_CACHE_FILTER_MAX and are never counted down from there, a saturated
+ counter only costs the filter its answer for the keys that share it
+ Note: stripes share the words of the filter, so every change is made by compare and swap */
+static void apc_cache_filter_count(apc_cache_table_t* table, zend_ulong h, zend_bool in)
+{
+	zend_uint i;
+
+	if (!table->filter) {
+		return;
+	}
+
+	for (i = 0; i < APC_CACHE_FILTER_HASHES; i++) {
+		zend_ulong c = APC_CACHE_FILTER(table, h, i);
+		zend_uint shift = APC_CACHE_FILTER_SHIFT(c);
+		zend_uint word, count;
+
+		do {
+			word = APC_CACHE_FILTER_WORD(table, c);
+			count = (word >> shift) & APC_CACHE_FILTER_MAX;
+
+			if (count == APC_CACHE_FILTER_MAX || (!in && !count)) {
+				break;
+			}
+		} while (!ATOMIC_CAS(APC_CACHE_FILTER_WORD(table, c), word,
+				in ? word + (1U << shift) : word - (1U << shift)));
+	}
+} /* }}} */
+
+/* {{{ apc_cache_filter_update
+ counts key h in, or out of, the filters that count it
+ While resizing, the filter of the old table counts every key, and the filter of the new table
+ only the keys of the slots migrated so far, see apc_cache_migrate
+ Note: the caller must hold the stripe write lock */
+static void apc_cache_filter_update(apc_cache_t* cache, zend_ulong h, zend_bool in)
+{
+	apc_cache_table_t* old = cache->header->old;
+
+	if (old) {
+		apc_cache_filter_count(old, h, in);
+
+		/* counted by the new filter when its slot is migrated */
+		if (old->slots[h % old->nslots] != APC_CACHE_MOVED) {
+			return;
+		}
+	}
+
+	apc_cache_filter_count(cache->header->table, h, in);
+} /* }}} */
+
+/* {{{ apc_cache_filter_absent
+ tells whether key h is certainly not in the cache, the chain need not be searched
+ Keys are counted before they are linked, and uncounted after they are unlinked
+ Note: the caller must hold the stripe lock, or check the stripe version after */
+static zend_bool apc_cache_filter_absent(apc_cache_t* cache, zend_ulong h TSRMLS_DC)
+{
+	apc_cache_table_t* table = cache->header->old ? cache->header->old : cache->header->table;
+	zend_uint i;
+
+	if (!table->filter) {
+		return 0;
+	}
+
+	for (i = 0; i < APC_CACHE_FILTER_HASHES; i++) {
+		zend_ulong c = APC_CACHE_FILTER(table, h, i);
+
+		if (!((APC_CACHE_FILTER_WORD(table, c) >> APC_CACHE_FILTER_SHIFT(c)) & APC_CACHE_FILTER_MAX)) {
+			ATOMIC_INC(APC_CACHE_STATS(cache)->nfiltered);
+			return 1;
+		}
+	}
+
+	return 0;
+} /* }}} */
+
+/* {{{ apc_cache_retire_slot
+ frees a slot that has been unlinked, once nobody can be looking at it */
+static void apc_cache_retire_slot(apc_cache_t* cache, apc_cache_slot_t* dead TSRMLS_DC)
+{
+	/* remove if there are no references, and no reader can be looking at the slot */
+    if (dead->value->ref_count <= 0 && !cache->header->nreaders) {
+        free_slot(dead TSRMLS_CC);
+    } else {
+		/* retire in the current epoch, readers that announce after this cannot see the slot */
+		APC_LOCK(cache->header);
+        dead->gc_next = NULL;
+        dead->dtime = time(0);
+		dead->epoch = ATOMIC_INC(cache->header->epoch) - 1;
+
+		/* the gc list is kept in the order slots were retired */
+		if (cache->header->gc) {
+			cache->header->gc_tail->gc_next = dead;
+		} else {
+			cache->header->gc = dead;
+		}
+		cache->header->gc_tail = dead;
+		APC_UNLOCK(cache->header);
+    }
+}
+/* }}} */
+
 /* {{{ apc_cache_remove_slot  */
 PHP_APCU_API void apc_cache_remove_slot(apc_cache_t* cache, apc_cache_slot_t** slot TSRMLS_DC)
 {
     apc_cache_slot_t* dead = *slot;
     
-    /* think here is safer */
+    /* unlink, dead->next is left alone so that readers inside the chain can carry on */
 	*slot = (*slot)->next;
 
-	/* adjust header info */
+	/* copies held by processes are out of date, before the slot can be retired */
+	APC_CACHE_TOUCH(cache, dead->key.h);
+
+	/* no longer counted by the filter, once it cannot be found */
+	apc_cache_filter_update(cache, dead->key.h, 0);
+
+	/* take it off the expiry wheel */
+	if (dead->timer_prev) {
+		apc_cache_timer_remove(cache, dead TSRMLS_CC);
+	}
+
+	/* adjust header info, slots in other stripes may be removed at the same time */
 	if (cache->header->mem_size)
-    	cache->header->mem_size -= dead->value->mem_size;
+		ATOMIC_SUB(cache->header->mem_size, dead->value->mem_size);
 
     if (cache->header->nentries)
-		cache->header->nentries--;
+		ATOMIC_DEC(cache->header->nentries);
 	
-	/* remove if there are no references */
-    if (dead->value->ref_count <= 0) {
-        free_slot(dead TSRMLS_CC);
-    } else {
-		/* add to gc if there are still refs */
-        dead->next = cache->header->gc;
-        dead->dtime = time(0);
-        cache->header->gc = dead;
-    }
+	apc_cache_retire_slot(cache, dead TSRMLS_CC);
 }
 /* }}} */
 
+#ifdef APC_CACHE_OPTIMISTIC
+/* {{{ apc_cache_announce
+ announces the current epoch before this process walks chains without locking, slots retired from now on are not free'd
+ until it is quiescent again; returns false if the process is not registered, or an enclosing operation announced already */
+static inline zend_bool apc_cache_announce(apc_cache_t* cache)
+{
+	apc_cache_reader_t* reader = cache->reader;
+
+	if (!reader || reader->epoch) {
+		return 0;
+	}
+
+	reader->epoch = cache->header->epoch;
+	MEMORY_BARRIER();
+
+	return 1;
+} /* }}} */
+
+/* {{{ apc_cache_quiesce
+ announces that this process holds no slot it has not pinned, if it announced an epoch */
+static inline void apc_cache_quiesce(apc_cache_t* cache, zend_bool announced)
+{
+	if (announced) {
+		MEMORY_BARRIER();
+		cache->reader->epoch = 0;
+	}
+} /* }}} */
+
+/* {{{ apc_cache_reader_dead
+ releases the reader if its owner died during a request */
+static zend_bool apc_cache_reader_dead(apc_cache_t* cache, apc_cache_reader_t* reader TSRMLS_DC)
+{
+	pid_t owner = reader->owner;
+
+	if (!owner || owner == APC_CACHE_READER_RESET ||
+		kill(owner, 0) != -1 || errno != ESRCH) {
+		return 0;
+	}
+
+	/* nobody can claim the reader while it is reset */
+	if (ATOMIC_CAS(reader->owner, owner, APC_CACHE_READER_RESET)) {
+		reader->epoch = 0;
+		MEMORY_BARRIER();
+		reader->owner = 0;
+	}
+
+	return 1;
+} /* }}} */
+#endif
+
+/* {{{ apc_cache_safe_epoch
+ returns the epoch slots retired before can no longer be seen by any reader */
+static zend_ulong apc_cache_safe_epoch(apc_cache_t* cache TSRMLS_DC)
+{
+	zend_ulong safe = cache->header->epoch;
+#ifdef APC_CACHE_OPTIMISTIC
+	zend_uint i;
+	zend_bool probe = 0;
+	time_t now = time(0);
+
+	/* readers that hold back the oldest slot for more than a second are checked for life, once a second */
+	if (cache->header->gc && cache->header->gc->dtime < now && cache->probed < now) {
+		cache->probed = now;
+		probe = 1;
+	}
+
+	/* the epoch must be read before the announcements */
+	MEMORY_BARRIER();
+
+	for (i = 0; i < cache->header->nreaders; i++) {
+		apc_cache_reader_t* reader = &cache->readers[i];
+		zend_ulong epoch = reader->epoch;
+
+		/* quiescent, or this process, which is not inside a chain when it collects */
+		if (!epoch || reader == cache->reader) {
+			continue;
+		}
+
+		if (epoch < safe) {
+			if (probe && apc_cache_reader_dead(cache, reader TSRMLS_CC)) {
+				continue;
+			}
+			safe = epoch;
+		}
+	}
+#endif
+	return safe;
+} /* }}} */
+
 /* {{{ apc_cache_gc */
 PHP_APCU_API void apc_cache_gc(apc_cache_t* cache TSRMLS_DC)
 {
-    /* This function scans the list of removed cache entries and deletes any
-     * entry whose reference count is zero  or that has been on the gc 
-	 * list for more than cache->gc_ttl seconds 
+    /* This function frees the slots at the head of the list of removed cache entries
+     * that no reader can see anymore and whose reference count is zero, or that have
+	 * been on the gc list for more than cache->gc_ttl seconds 
 	 *   (we issue a warning in the latter case).
      */
-	if (!cache || !cache->header->gc) {
+	apc_cache_slot_t* dead = NULL;
+	apc_cache_slot_t* busy = NULL;
+	apc_cache_slot_t* busy_tail = NULL;
+	apc_cache_table_t* retired = NULL;
+	zend_ulong safe;
+	time_t now;
+
+	if (!cache || (!cache->header->gc && !cache->header->retired)) {
 		return;
 	}
 
-    {
-		apc_cache_slot_t** slot = &cache->header->gc;
+	/* slots retired before this epoch cannot be seen by any reader */
+	safe = apc_cache_safe_epoch(cache TSRMLS_CC);
 
-		while (*slot != NULL) {
-			time_t now = time(0);
-			time_t gc_sec = cache->gc_ttl ? (now - (*slot)->dtime) : 0;
+	now = time(0);
 
-			if (!(*slot)->value->ref_count || gc_sec > (time_t)cache->gc_ttl) {
-                apc_cache_slot_t* dead = *slot;
+	APC_LOCK(cache->header);
 
-				/* good ol' whining */
-			    if (dead->value->ref_count > 0) {
-			        apc_debug(
-						"GC cache entry '%s' was on gc-list for %d seconds" TSRMLS_CC, 
-						dead->key.str, gc_sec
-					);
-			    }
+	/* a table the cache has been migrated from */
+	if (cache->header->retired && cache->header->retired_epoch < safe) {
+		retired = cache->header->retired;
+		cache->header->retired = NULL;
+	}
 
-				/* set next slot */
-			    *slot = dead->next;
-			
-				/* free slot */
-			    free_slot(
-					dead TSRMLS_CC);
-			
-				/* next */
-				continue;
+	while (cache->header->gc) {
+		apc_cache_slot_t* slot = cache->header->gc;
+		time_t gc_sec = cache->gc_ttl ? (now - slot->dtime) : 0;
+
+		/* the list is in order of retirement, nothing after this slot is safe either */
+		if (slot->epoch >= safe && gc_sec <= (time_t)cache->gc_ttl) {
+			break;
+		}
+
+		/* detach slot */
+		cache->header->gc = slot->gc_next;
+
+		if (!slot->value->ref_count || gc_sec > (time_t)cache->gc_ttl) {
+			/* good ol' whining */
+		    if (slot->value->ref_count > 0) {
+		        apc_debug(
+					"GC cache entry '%s' was on gc-list for %d seconds" TSRMLS_CC, 
+					slot->key.str, gc_sec
+				);
+		    }
 
+			slot->gc_next = dead;
+			dead = slot;
+		} else {
+			/* still referenced, requeue */
+			slot->gc_next = NULL;
+			if (busy) {
+				busy_tail->gc_next = slot;
 			} else {
-				slot = &(*slot)->next;
+				busy = slot;
 			}
+			busy_tail = slot;
+		}
+	}
+
+	/* requeue referenced slots at the tail */
+	if (busy) {
+		if (cache->header->gc) {
+			cache->header->gc_tail->gc_next = busy;
+		} else {
+			cache->header->gc = busy;
 		}
+		cache->header->gc_tail = busy_tail;
+	}
+
+	APC_UNLOCK(cache->header);
+
+	if (retired) {
+		cache->sma->sfree(retired TSRMLS_CC);
+	}
+
+	/* free slots */
+	while (dead) {
+		apc_cache_slot_t* next = dead->gc_next;
+
+		free_slot(
+			dead TSRMLS_CC);
+
+		dead = next;
 	}
 }
 /* }}} */
@@ -267,19 +821,38 @@ PHP_APCU_API int APC_UNSERIALIZER_NAME(php) (APC_UNSERIALIZER_ARGS)
 } /* }}} */
 
 /* {{{ apc_cache_create */
-PHP_APCU_API apc_cache_t* apc_cache_create(apc_sma_t* sma, apc_serializer_t* serializer, int size_hint, int gc_ttl, int ttl, long smart, zend_bool defend TSRMLS_DC) {
+PHP_APCU_API apc_cache_t* apc_cache_create(apc_sma_t* sma, apc_serializer_t* serializer, int size_hint, int gc_ttl, int ttl, long smart, zend_bool defend, int stripes, zend_bool indexed, zend_bool filtered, int policy, zend_ulong headroom TSRMLS_DC) {
 	apc_cache_t* cache;
     int cache_size;
     int nslots;
+    int nstripes;
+    int nreaders = 0;
+    int i;
 
 	/* calculate number of slots */
     nslots = make_prime(size_hint > 0 ? size_hint : 2000);
 
+	/* calculate number of stripes, more stripes than slots would never be used */
+	nstripes = (stripes > 0) ? MIN(stripes, nslots) : 1;
+
+	/* every table has a multiple of the number of stripes slots, see APC_CACHE_STRIPE */
+	nslots = ((nslots + nstripes - 1) / nstripes) * nstripes;
+
+#ifdef APC_CACHE_OPTIMISTIC
+	/* room for the readers that do not lock */
+	nreaders = APC_CACHE_MAX_READERS;
+#endif
+
 	/* allocate pointer by normal means */
     cache = (apc_cache_t*) apc_emalloc(sizeof(apc_cache_t) TSRMLS_CC);
 	
 	/* calculate cache size for shm allocation */
-    cache_size = sizeof(apc_cache_header_t) + nslots*sizeof(apc_cache_slot_t*);
+    cache_size = sizeof(apc_cache_header_t) +
+		APC_CACHE_LINE_SIZE + nstripes*sizeof(apc_cache_stripe_t) +
+		nreaders*sizeof(apc_cache_reader_t) +
+		APC_CACHE_STAT_SHARDS*sizeof(apc_cache_stats_t) +
+		APC_CACHE_INFLIGHT*sizeof(apc_cache_inflight_t) +
+		APC_CACHE_GENERATIONS*sizeof(zend_ulong);
 
 	/* allocate shm */
     cache->shmaddr = sma->smalloc(cache_size TSRMLS_CC);
@@ -293,36 +866,88 @@ PHP_APCU_API apc_cache_t* apc_cache_create(apc_sma_t* sma, apc_serializer_t* ser
 
 	/* set default header */
     cache->header = (apc_cache_header_t*) cache->shmaddr;
+
+	/* the table is allocated on its own, so that it can be replaced as it grows */
+	cache->header->table = apc_cache_table_create(sma, nslots, indexed, filtered TSRMLS_CC);
+	if (!cache->header->table) {
+        apc_error("Unable to allocate shared memory for cache structures.  (Perhaps your shared memory size isn't large enough?). " TSRMLS_CC);
+        return NULL;
+	}
+	cache->header->old = NULL;
+	cache->header->retired = NULL;
+	cache->header->nresizes = 0;
+	cache->header->resize_failed = 0;
+	cache->header->hand = 0;
+	cache->header->nevictions = 0;
+	cache->header->wheel.now = time(0);
+	cache->header->wheel.ntimers = 0;
+	cache->header->sweeper = 0;
+	cache->header->compactor = 0;
+	cache->header->ncompactions = 0;
+	cache->header->compact_before = 0.0;
+	cache->header->compact_after = 0.0;
 	
-    cache->header->nhits = 0;
-    cache->header->nmisses = 0;
 	cache->header->nentries = 0;
     cache->header->nexpunges = 0;
     cache->header->gc = NULL;
+    cache->header->gc_tail = NULL;
+    cache->header->epoch = 1;
+    cache->header->nreaders = 0;
     cache->header->stime = time(NULL);
 	cache->header->state |= APC_CACHE_ST_NONE;
 	
+	/* stripes begin on the first line boundary after the header */
+	cache->stripes = (apc_cache_stripe_t*)
+		((((size_t) cache->shmaddr) + sizeof(apc_cache_header_t) + APC_CACHE_LINE_SIZE - 1) & ~(APC_CACHE_LINE_SIZE - 1));
+
+	/* readers follow the stripes */
+	cache->readers = (apc_cache_reader_t*) (cache->stripes + nstripes);
+	cache->reader = NULL;
+	cache->probed = 0;
+
+	/* statistics follow the readers */
+	cache->stats = (apc_cache_stats_t*) (cache->readers + nreaders);
+	cache->shard = 0;
+
+	/* in-flight markers follow the statistics */
+	cache->inflight = (apc_cache_inflight_t*) (cache->stats + APC_CACHE_STAT_SHARDS);
+
+	/* generations follow the in-flight markers */
+	cache->gens = (volatile zend_ulong*) (cache->inflight + APC_CACHE_INFLIGHT);
+	cache->l1 = NULL;
+
 	/* set cache options */
-    cache->slots = (apc_cache_slot_t**) (((char*) cache->shmaddr) + sizeof(apc_cache_header_t));
     cache->sma = sma;
 	cache->serializer = serializer;
-	cache->nslots = nslots;
+	cache->nstripes = nstripes;
     cache->gc_ttl = gc_ttl;
     cache->ttl = ttl;
 	cache->smart = smart;
 	cache->defend = defend;
+	cache->policy = policy;
+	cache->headroom = headroom;
 	
 	/* header lock */
 	CREATE_LOCK(&cache->header->lock);
 
-	/* zero slots */
-    memset(cache->slots, 0, sizeof(apc_cache_slot_t*)*nslots);
+	/* wheel lock */
+	CREATE_LOCK(&cache->header->wheel.lock);
+
+	/* stripe locks */
+	for (i = 0; i < nstripes; i++) {
+		CREATE_LOCK(&cache->stripes[i].lock);
+	}
 
     return cache;
 } /* }}} */
 
 /* {{{ apc_cache_store */
 PHP_APCU_API zend_bool apc_cache_store(apc_cache_t* cache, char *strkey, zend_uint keylen, const zval *val, const zend_uint ttl, const zend_bool exclusive TSRMLS_DC) {
+    return apc_cache_store_ex(cache, strkey, keylen, val, ttl, 0, 0, exclusive TSRMLS_CC);
+} /* }}} */
+
+/* {{{ apc_cache_store_ex */
+PHP_APCU_API zend_bool apc_cache_store_ex(apc_cache_t* cache, char *strkey, zend_uint keylen, const zval *val, const zend_uint ttl, const zend_uint soft_ttl, const zend_uint delta, const zend_bool exclusive TSRMLS_DC) {
     apc_cache_entry_t *entry;
     apc_cache_key_t key;
     time_t t;
@@ -342,6 +967,10 @@ PHP_APCU_API zend_bool apc_cache_store(apc_cache_t* cache, char *strkey, zend_ui
                 
                 /* initialize the entry for insertion */
                 if ((entry = apc_cache_make_entry(&ctxt, &key, val, ttl TSRMLS_CC))) {
+
+                    /* the entry goes stale before it expires */
+                    entry->soft_ttl = soft_ttl;
+                    entry->delta = delta;
                 
                     /* execute an insertion */
                     if (apc_cache_insert(cache, key, entry, &ctxt, t, exclusive TSRMLS_CC)) {
@@ -477,7 +1106,7 @@ PHP_APCU_API zend_bool apc_cache_preload(apc_cache_t* cache, const char *path TS
 /* {{{ apc_cache_release */
 PHP_APCU_API void apc_cache_release(apc_cache_t* cache, apc_cache_entry_t* entry TSRMLS_DC)
 {
-    entry->ref_count--;
+    ATOMIC_DEC(entry->ref_count);
 }
 /* }}} */
 
@@ -488,8 +1117,22 @@ PHP_APCU_API void apc_cache_destroy(apc_cache_t* cache TSRMLS_DC)
 		return;
 	}
 
-	/* destroy lock */
+	/* destroy locks */
+	{
+		zend_uint i;
+
+		for (i = 0; i < cache->nstripes; i++) {
+			DESTROY_LOCK(&cache->stripes[i].lock);
+		}
+	}
 	DESTROY_LOCK(&cache->header->lock);
+	DESTROY_LOCK(&cache->header->wheel.lock);
+
+	/* the cache local to this process */
+	if (cache->l1) {
+		zend_hash_destroy(&cache->l1->entries);
+		apc_efree(cache->l1 TSRMLS_CC);
+	}
 
 	/* XXX this is definitely a leak, but freeing this causes all the apache
 		children to freeze. It might be because the segment is shared between
@@ -508,12 +1151,23 @@ PHP_APCU_API void apc_cache_real_expunge(apc_cache_t* cache TSRMLS_DC) {
     {
 		zend_ulong i;
 
-		for (i = 0; i < cache->nslots; i++) {
-		    apc_cache_slot_t* p = cache->slots[i];
-		    while (p) {
+		for (i = 0; i < apc_cache_nchains(cache); i++) {
+		    apc_cache_slot_t** chain = apc_cache_chain(cache, i);
+		    apc_cache_slot_t* p;
+
+		    /* migrated */
+		    if (!chain) {
+		        continue;
+		    }
+
+		    p = *chain;
+		    while (p) {
 		        apc_cache_remove_slot(cache, &p TSRMLS_CC);
 		    }
-		    cache->slots[i] = NULL;
+		    *chain = NULL;
+
+		    /* reindex */
+		    apc_cache_index_chain(cache, i);
 		}
 	}
 	
@@ -521,15 +1175,187 @@ PHP_APCU_API void apc_cache_real_expunge(apc_cache_t* cache TSRMLS_DC) {
 	cache->header->stime = apc_time();
 
 	/* reset counters */
-	cache->header->ninserts = 0;
 	cache->header->nentries = 0;
-    cache->header->nhits = 0;
-    cache->header->nmisses = 0;
+	memset(cache->stats, 0, APC_CACHE_STAT_SHARDS * sizeof(apc_cache_stats_t));
 	
 	/* resets lastkey */
 	memset(&cache->header->lastkey, 0, sizeof(apc_cache_key_t));
 } /* }}} */
 
+/* {{{ apc_cache_evict */
+PHP_APCU_API void apc_cache_evict(apc_cache_t* cache, size_t size TSRMLS_DC) {
+	time_t t = apc_time();
+	zend_ulong nchains = apc_cache_nchains(cache);
+	zend_ulong visited;
+	size_t evicted = 0L;
+
+	/* in two revolutions every entry is passed over once at most */
+	for (visited = 0; visited < 2 * nchains; visited++) {
+		apc_cache_slot_t** slot;
+		zend_ulong i;
+
+		if (cache->header->hand >= nchains) {
+			cache->header->hand = 0;
+		}
+
+		i = cache->header->hand++;
+
+		/* migrated */
+		if (!(slot = apc_cache_chain(cache, i))) {
+			continue;
+		}
+
+		while (*slot) {
+			apc_cache_entry_t* value = (*slot)->value;
+
+			/* expired, not fetched since the clock last passed over it, or already passed over */
+			if ((value->ttl && (time_t) ((*slot)->ctime + value->ttl) < t) ||
+			    (cache->ttl && (time_t) ((*slot)->atime + cache->ttl) < t) ||
+			    !(*slot)->referenced || visited >= nchains) {
+				evicted += value->mem_size;
+				cache->header->nevictions++;
+				apc_cache_remove_slot(cache, slot TSRMLS_CC);
+				continue;
+			}
+
+			/* fetched since, passed over once more */
+			(*slot)->referenced = 0;
+
+			/* grab next slot */
+			slot = &(*slot)->next;
+		}
+
+		/* reindex */
+		apc_cache_index_chain(cache, i);
+
+		if (evicted >= size) {
+			/* free what was evicted */
+			apc_cache_gc(cache TSRMLS_CC);
+
+			if (cache->sma->get_avail_size(size)) {
+				break;
+			}
+
+			/* the memory free'd was not contiguous, or readers in the middle of a lookup still hold some of it */
+			evicted = 0L;
+		}
+	}
+} /* }}} */
+
+/* {{{ apc_cache_expire_slot
+ removes a slot taken off the wheel from its chain */
+static void apc_cache_expire_slot(apc_cache_t* cache, apc_cache_slot_t* p TSRMLS_DC)
+{
+	zend_ulong s;
+	apc_cache_table_t* table = apc_cache_home(cache, p->key.h, &s);
+	apc_cache_slot_t** slot = &table->slots[s];
+
+	while (*slot && *slot != p) {
+		slot = &(*slot)->next;
+	}
+
+	if (*slot) {
+		apc_cache_remove_slot(cache, slot TSRMLS_CC);
+
+		/* reindex */
+		apc_cache_index_slot(table, s);
+	}
+} /* }}} */
+
+/* {{{ apc_cache_expire */
+PHP_APCU_API void apc_cache_expire(apc_cache_t* cache, time_t t TSRMLS_DC) {
+	apc_cache_wheel_t* wheel = &cache->header->wheel;
+	apc_cache_slot_t* expired = NULL;
+	apc_cache_slot_t* p;
+
+	APC_LOCK(wheel);
+
+	if (!wheel->ntimers) {
+		/* nothing to turn */
+		if (wheel->now <= t) {
+			wheel->now = t + 1;
+		}
+	} else if (t - wheel->now >= (1L << (APC_CACHE_WHEEL_BITS * (APC_CACHE_WHEEL_LEVELS - 1)))) {
+		/* turning this far costs more than hanging every slot again */
+		apc_cache_slot_t* list = NULL;
+		zend_uint i;
+
+		/* the overflow is taken last */
+		for (i = 0; i <= APC_CACHE_WHEEL_LEVELS * APC_CACHE_WHEEL_SPOKES; i++) {
+			apc_cache_slot_t** spoke = (i < APC_CACHE_WHEEL_LEVELS * APC_CACHE_WHEEL_SPOKES) ?
+				&wheel->spokes[i >> APC_CACHE_WHEEL_BITS][i & APC_CACHE_WHEEL_MASK] : &wheel->overflow;
+
+			for (p = apc_cache_wheel_take(wheel, spoke); p;) {
+				apc_cache_slot_t* next = p->timer_next;
+
+				p->timer_next = list;
+				list = p;
+
+				p = next;
+			}
+		}
+
+		wheel->now = t + 1;
+
+		while ((p = list)) {
+			list = p->timer_next;
+
+			if ((time_t) (p->ctime + p->value->ttl) < t) {
+				p->timer_next = expired;
+				expired = p;
+				wheel->ntimers--;
+			} else {
+				apc_cache_wheel_hang(wheel, p);
+			}
+		}
+	} else {
+		while (wheel->now <= t) {
+			zend_ulong index = (zend_ulong) wheel->now & APC_CACHE_WHEEL_MASK;
+
+			/* the first level came round, cascade the spokes of the next levels that came round */
+			if (!index) {
+				zend_uint level;
+
+				for (level = 1; level <= APC_CACHE_WHEEL_LEVELS; level++) {
+					zend_ulong spoke = ((zend_ulong) wheel->now >> (APC_CACHE_WHEEL_BITS * level)) & APC_CACHE_WHEEL_MASK;
+					apc_cache_slot_t* list = apc_cache_wheel_take(wheel,
+						(level < APC_CACHE_WHEEL_LEVELS) ? &wheel->spokes[level][spoke] : &wheel->overflow);
+
+					while ((p = list)) {
+						list = p->timer_next;
+						apc_cache_wheel_hang(wheel, p);
+					}
+
+					if (spoke) {
+						break;
+					}
+				}
+			}
+
+			/* everything left on this spoke expires now */
+			for (p = apc_cache_wheel_take(wheel, &wheel->spokes[0][index]); p;) {
+				apc_cache_slot_t* next = p->timer_next;
+
+				p->timer_next = expired;
+				expired = p;
+				wheel->ntimers--;
+
+				p = next;
+			}
+
+			wheel->now++;
+		}
+	}
+
+	APC_UNLOCK(wheel);
+
+	/* nobody else can remove slots while every stripe is locked */
+	while ((p = expired)) {
+		expired = p->timer_next;
+		apc_cache_expire_slot(cache, p TSRMLS_CC);
+	}
+} /* }}} */
+
 /* {{{ apc_cache_clear */
 PHP_APCU_API void apc_cache_clear(apc_cache_t* cache TSRMLS_DC)
 {
@@ -538,8 +1364,8 @@ PHP_APCU_API void apc_cache_clear(apc_cache_t* cache TSRMLS_DC)
 		return;
 	}
 	
-	/* lock header */
-	APC_LOCK(cache->header);
+	/* lock all stripes */
+	apc_cache_lock_stripes(cache, 1 TSRMLS_CC);
 	
 	/* set busy */
 	cache->header->state |= APC_CACHE_ST_BUSY;
@@ -547,6 +1373,9 @@ PHP_APCU_API void apc_cache_clear(apc_cache_t* cache TSRMLS_DC)
 	/* expunge cache */
 	apc_cache_real_expunge(cache TSRMLS_CC);
 
+	/* free what the expunge trashed */
+	apc_cache_gc(cache TSRMLS_CC);
+
 	/* set info */
     cache->header->stime = apc_time();
     cache->header->nexpunges = 0;
@@ -554,8 +1383,8 @@ PHP_APCU_API void apc_cache_clear(apc_cache_t* cache TSRMLS_DC)
 	/* unset busy */
     cache->header->state &= ~APC_CACHE_ST_BUSY;
 	
-	/* unlock header */
-	APC_UNLOCK(cache->header);
+	/* unlock all stripes */
+	apc_cache_unlock_stripes(cache, 1 TSRMLS_CC);
 }
 /* }}} */
 
@@ -573,8 +1402,8 @@ PHP_APCU_API void apc_cache_default_expunge(apc_cache_t* cache, size_t size TSRM
 		return;
 	}
 	
-	/* get the lock for header */
-	APC_LOCK(cache->header);
+	/* get the lock for every stripe */
+	apc_cache_lock_stripes(cache, 1 TSRMLS_CC);
 
 	/* update state in header */
 	cache->header->state |= APC_CACHE_ST_BUSY;
@@ -582,6 +1411,9 @@ PHP_APCU_API void apc_cache_default_expunge(apc_cache_t* cache, size_t size TSRM
 	/* make suitable selection */
 	suitable = (cache->smart > 0L) ? (size_t) (cache->smart * size) : (size_t) (cache->sma->size/2);
 
+	/* expire what has to be */
+	apc_cache_expire(cache, t TSRMLS_CC);
+
 	/* gc */
     apc_cache_gc(cache TSRMLS_CC);
 
@@ -589,7 +1421,13 @@ PHP_APCU_API void apc_cache_default_expunge(apc_cache_t* cache, size_t size TSRM
 	available = cache->sma->get_avail_mem();
 
 	/* perform expunge processing */
-    if(!cache->ttl) {
+	if (cache->policy == APC_CACHE_EVICT_CLOCK) {
+
+		/* evict no more than the allocation needs */
+		if (!cache->sma->get_avail_size(size + cache->headroom)) {
+			apc_cache_evict(cache, size + cache->headroom TSRMLS_CC);
+		}
+	} else if(!cache->ttl) {
 
 		/* check it is necessary to expunge */
 		if (available < suitable) {
@@ -603,18 +1441,16 @@ PHP_APCU_API void apc_cache_default_expunge(apc_cache_t* cache, size_t size TSRM
 			zend_ulong i;
 
 			/* look for junk */
-		    for (i = 0; i < cache->nslots; i++) {
-		        slot = &cache->slots[i];
+		    for (i = 0; i < apc_cache_nchains(cache); i++) {
+		        if (!(slot = apc_cache_chain(cache, i))) {
+		            continue;
+		        }
 		        while (*slot) {
 		            /*
-		             * Entry TTL has precedence over cache TTL
+		             * Entry TTL has precedence over cache TTL, entries with a TTL
+		             * of their own were expired from the wheel already
 		             */
-		            if((*slot)->value->ttl) {
-		                if((time_t) ((*slot)->ctime + (*slot)->value->ttl) < t) {
-		                    apc_cache_remove_slot(cache, slot TSRMLS_CC);
-		                    continue;
-		                }
-		            } else if(cache->ttl) {
+		            if(!(*slot)->value->ttl && cache->ttl) {
 		                if((time_t) ((*slot)->ctime + cache->ttl) < t) {
 		                    apc_cache_remove_slot(cache, slot TSRMLS_CC);
 		                    continue;
@@ -624,6 +1460,9 @@ PHP_APCU_API void apc_cache_default_expunge(apc_cache_t* cache, size_t size TSRM
 					/* grab next slot */
 					slot = &(*slot)->next;	            
 		        }
+
+				/* reindex */
+				apc_cache_index_chain(cache, i);
 		    }
 
 			/* if the cache now has space, then reset last key */
@@ -637,11 +1476,14 @@ PHP_APCU_API void apc_cache_default_expunge(apc_cache_t* cache, size_t size TSRM
         }
     }
 
+	/* free what the expunge trashed, the memory is needed now */
+	apc_cache_gc(cache TSRMLS_CC);
+
 	/* we are done */
 	cache->header->state &= ~APC_CACHE_ST_BUSY;
 
-	/* unlock header */
-	APC_UNLOCK(cache->header);
+	/* unlock every stripe */
+	apc_cache_unlock_stripes(cache, 1 TSRMLS_CC);
 }
 /* }}} */
 
@@ -724,45 +1566,165 @@ PHP_APCU_API zend_bool apc_cache_destroy_context(apc_context_t* context TSRMLS_D
     return 1;
 } /* }}} */
 
-/* {{{ apc_cache_insert */
-PHP_APCU_API zend_bool apc_cache_insert(apc_cache_t* cache, 
-                                        apc_cache_key_t key, 
-                                        apc_cache_entry_t* value, 
-                                        apc_context_t* ctxt, 
-                                        time_t t, 
-                                        zend_bool exclusive TSRMLS_DC)
+/* {{{ apc_cache_resize_finish
+ switches over to the new table once every slot of the old table has been migrated */
+static void apc_cache_resize_finish(apc_cache_t* cache TSRMLS_DC)
 {
-    zend_bool result = 0;
+	apc_cache_table_t* dead = NULL;
 
-	/* at least */
-	if (!value) {
-		return result;
+	apc_cache_lock_stripes(cache, 1 TSRMLS_CC);
+
+	if (cache->header->old && cache->header->moved == cache->header->old->nslots) {
+		cache->header->nresizes++;
+
+		if (cache->header->nreaders) {
+			/* readers that do not lock may still be in the old table */
+			APC_LOCK(cache->header);
+			cache->header->retired = cache->header->old;
+			cache->header->retired_epoch = ATOMIC_INC(cache->header->epoch) - 1;
+			APC_UNLOCK(cache->header);
+		} else {
+			dead = cache->header->old;
+		}
+
+		cache->header->old = NULL;
 	}
-	
-	/* check we are able to deal with this request */
-	if (!cache || apc_cache_busy(cache TSRMLS_CC)) {
-		return result;
+
+	apc_cache_unlock_stripes(cache, 1 TSRMLS_CC);
+
+	if (dead) {
+		cache->sma->sfree(dead TSRMLS_CC);
 	}
+} /* }}} */
 
-	/* lock header */
-	APC_LOCK(cache->header);
-	
-	/* process deleted list  */
-    apc_cache_gc(cache TSRMLS_CC);
+/* {{{ apc_cache_migrate
+ migrates up to count slots of the old table to the new table */
+static void apc_cache_migrate(apc_cache_t* cache, zend_uint count TSRMLS_DC)
+{
+	while (count-- && cache->header->old) {
+		/* claim the next slot, which may belong to a resize started since we looked */
+		zend_ulong o = ATOMIC_INC(cache->header->cursor) - 1;
+		zend_bool finished = 0;
+		apc_cache_table_t* old;
+
+		/* the stripe of slot o is the stripe of both slots it is split into */
+		APC_CACHE_WLOCK(APC_CACHE_STRIPE(cache, o));
+
+		old = cache->header->old;
+
+		if (old && o < old->nslots && old->slots[o] != APC_CACHE_MOVED) {
+			apc_cache_table_t* table = cache->header->table;
+			apc_cache_slot_t* p = old->slots[o];
+
+			/* split the chain, the slots it is split into receive no other keys */
+			while (p) {
+				apc_cache_slot_t* next = p->next;
+				zend_ulong s = p->key.h % table->nslots;
+
+				p->next = table->slots[s];
+				table->slots[s] = p;
+
+				/* the new filter counts every key by the time the resize is finished */
+				apc_cache_filter_count(table, p->key.h, 1);
+
+				p = next;
+			}
+
+			old->slots[o] = APC_CACHE_MOVED;
+
+			/* reindex */
+			apc_cache_index_slot(old, o);
+			apc_cache_index_slot(table, o);
+			apc_cache_index_slot(table, o + old->nslots);
+
+			finished = (ATOMIC_INC(cache->header->moved) == old->nslots);
+		}
+
+		APC_CACHE_WUNLOCK(APC_CACHE_STRIPE(cache, o));
+
+		if (finished) {
+			apc_cache_resize_finish(cache TSRMLS_CC);
+		}
+	}
+} /* }}} */
+
+/* {{{ apc_cache_grow
+ starts doubling the table when the load is too high, and migrates some of the old table while resizing */
+static void apc_cache_grow(apc_cache_t* cache TSRMLS_DC)
+{
+	apc_cache_table_t* table = cache->header->table;
+	apc_cache_table_t* spare = NULL;
+	time_t t;
+
+	/* resizing */
+	if (cache->header->old) {
+		apc_cache_migrate(cache, APC_CACHE_MIGRATE_STEP TSRMLS_CC);
+		return;
+	}
+
+	/* wait until the last table migrated from has been free'd */
+	if (cache->header->retired || cache->header->nentries <= table->nslots * APC_CACHE_MAX_LOAD) {
+		return;
+	}
+
+	/* the larger table did not fit a moment ago, it is not worth trying on every insert */
+	t = apc_time();
+	if (cache->header->resize_failed == t) {
+		return;
+	}
+
+	/* never expunges, chains only grow longer when there is no room for a larger table */
+	if (!(spare = apc_cache_table_create(cache->sma, table->nslots * 2, table->buckets != NULL, table->filter != NULL TSRMLS_CC))) {
+		cache->header->resize_failed = t;
+		return;
+	}
+
+	apc_cache_lock_stripes(cache, 1 TSRMLS_CC);
+
+	/* another process may have started first */
+	if (cache->header->table == table && !cache->header->old && !cache->header->retired) {
+		cache->header->old = table;
+		cache->header->cursor = 0;
+		cache->header->moved = 0;
+
+		/* the table must be complete before readers can see it */
+		MEMORY_BARRIER();
+		cache->header->table = spare;
+		spare = NULL;
+	}
+
+	apc_cache_unlock_stripes(cache, 1 TSRMLS_CC);
+
+	if (spare) {
+		cache->sma->sfree(spare TSRMLS_CC);
+	}
+} /* }}} */
+
+/* {{{ apc_cache_link
+ links slot p into its chain in place of the slot of the same key, unless the insert is exclusive
+ and that slot has not expired
+ Note: the caller must hold the stripe write lock */
+static zend_bool apc_cache_link(apc_cache_t* cache, apc_cache_slot_t* p, time_t t, zend_bool exclusive TSRMLS_DC)
+{
+	apc_cache_key_t key = p->key;
+	apc_cache_entry_t* value = p->value;
+	apc_cache_table_t* table;
+	zend_ulong s;
+
+	/* select appropriate slot ... */
+	table = apc_cache_home(cache, key.h, &s);
 
 	/* make the insertion */	
 	{
 		apc_cache_slot_t** slot;
 
-		/*
-		* select appropriate slot ...
-		*/
-		slot = &cache->slots[key.h % cache->nslots];
+		slot = &table->slots[s];
 
 		while (*slot) {
 			
 			/* check for a match by hash and string */
-		    if (((*slot)->key.h == key.h) && (!memcmp((*slot)->key.str, key.str, key.len))) {
+		    if (((*slot)->key.h == key.h) && ((*slot)->key.len == key.len) &&
+				(!memcmp((*slot)->key.str, key.str, key.len))) {
 
 		        /* 
 		         * At this point we have found the user cache entry.  If we are doing 
@@ -796,200 +1758,1087 @@ PHP_APCU_API zend_bool apc_cache_insert(apc_cache_t* cache,
             slot = &(*slot)->next;      
 		}
 
-		if ((*slot = make_slot(cache, &key, value, *slot, t TSRMLS_CC)) != NULL) {
-            /* set value size from pool size */
-            value->mem_size = ctxt->pool->size;
+		/* counted by the filter before it can be found */
+		apc_cache_filter_update(cache, key.h, 1);
 
-            cache->header->mem_size += ctxt->pool->size;
-            cache->header->nentries++;
-            cache->header->ninserts++;
-		} else {
-			goto nothing;
+		/* link the new slot, readers must not see it before it is complete */
+		p->next = *slot;
+		MEMORY_BARRIER();
+		*slot = p;
+
+		/* hang it on the expiry wheel */
+		if (value->ttl) {
+			apc_cache_timer_add(cache, p TSRMLS_CC);
 		}
+
+		ATOMIC_ADD(cache->header->mem_size, value->mem_size);
+		ATOMIC_INC(cache->header->nentries);
+		ATOMIC_INC(APC_CACHE_STATS(cache)->ninserts);
 	}
 
-    /* unlock and return succesfull */	
-    APC_UNLOCK(cache->header);
+	/* reindex */
+	apc_cache_index_slot(table, s);
 
     return 1;
 
     /* bail */
 nothing:
-    APC_UNLOCK(cache->header);
+	/* stale slots may have been removed */
+	apc_cache_index_slot(table, s);
 
     return 0;
-}
-/* }}} */
+} /* }}} */
 
-/* {{{ apc_cache_find */
-PHP_APCU_API apc_cache_entry_t* apc_cache_find(apc_cache_t* cache, char *strkey, zend_uint keylen, time_t t TSRMLS_DC)
+/* {{{ apc_cache_insert */
+PHP_APCU_API zend_bool apc_cache_insert(apc_cache_t* cache, 
+                                        apc_cache_key_t key, 
+                                        apc_cache_entry_t* value, 
+                                        apc_context_t* ctxt, 
+                                        time_t t, 
+                                        zend_bool exclusive TSRMLS_DC)
 {
-	/* check we are able to deal with the request */
-    if(!cache || apc_cache_busy(cache TSRMLS_CC)) {
-        return NULL;
-    }
+    zend_bool result = 0;
+	apc_cache_slot_t* p = NULL;
 
-	/* we only declare a volatile we need */
-    {
-        apc_cache_slot_t** slot;
-		zend_ulong h, s;
+	/* at least */
+	if (!value) {
+		return result;
+	}
+	
+	/* check we are able to deal with this request */
+	if (!cache || apc_cache_busy(cache TSRMLS_CC)) {
+		return result;
+	}
 
-        volatile apc_cache_entry_t* value = NULL;
-        
-		/* calculate hash and slot */
-		apc_cache_hash_slot(cache, strkey, keylen, &h, &s);
+	/* process deleted list */
+	if (cache->header->gc || cache->header->retired) {
+		apc_cache_gc(cache TSRMLS_CC);
+	}
 
-        /* read lock header */
-		APC_RLOCK(cache->header);
+	/*
+	* make the slot before locking, allocation may fail and invoke expunge which
+	* requires the stripe locks
+	*/
+	if (!(p = make_slot(cache, &key, value, NULL, t TSRMLS_CC))) {
+		return result;
+	}
 
-		/* find head */
-		slot = &cache->slots[s];
+	/* set value size from pool size */
+	value->mem_size = ctxt->pool->size;
 
-		while (*slot) {
-			/* check for a matching key by has and identifier */
-		    if ((h == (*slot)->key.h) && !memcmp((*slot)->key.str, strkey, keylen)) {
-
-		        /* Check to make sure this entry isn't expired by a hard TTL */
-		        if((*slot)->value->ttl && (time_t) ((*slot)->ctime + (*slot)->value->ttl) < t) {
-					/* increment misses on cache */
-					cache->header->nmisses++;
-
-					/* unlock header */			
-					APC_RUNLOCK(cache->header);
-		            
-		            return NULL;
-		        }
+	/* lock stripe */
+	APC_CACHE_WLOCK(APC_CACHE_STRIPE(cache, key.h));
 
-		        /* Otherwise we are fine, increase counters and return the cache entry */
-		        (*slot)->nhits++;
-		        (*slot)->value->ref_count++;
-		        (*slot)->atime = t;
-			
-				/* set cache num hits */
-				cache->header->nhits++;
-		        
-				/* grab value */
-		        value = (*slot)->value;
-
-				/* unlock header */			
-				APC_RUNLOCK(cache->header);
-			
-		        return (apc_cache_entry_t*)value;
-		    }
+	/* make the insertion */
+	result = apc_cache_link(cache, p, t, exclusive TSRMLS_CC);
 
-			/* next */
-		    slot = &(*slot)->next;		
-		}
-	 	
-		/* not found, so increment misses */
-		cache->header->nmisses++;
+    /* unlock */	
+    APC_CACHE_WUNLOCK(APC_CACHE_STRIPE(cache, key.h));
 
-		/* unlock header */
-		APC_RUNLOCK(cache->header);
-    }
+	/* keep chains short */
+	if (result) {
+		apc_cache_grow(cache TSRMLS_CC);
+	}
 
-    return NULL;
+    return result;
 }
 /* }}} */
 
-/* {{{ apc_cache_fetch */
-PHP_APCU_API zend_bool apc_cache_fetch(apc_cache_t* cache, char* strkey, zend_uint keylen, time_t t, zval **dst TSRMLS_DC) 
+/* {{{ apc_cache_wlock_some
+ write locks the stripes marked in which, in ascending order like apc_cache_lock_stripes */
+static void apc_cache_wlock_some(apc_cache_t* cache, zend_bool* which TSRMLS_DC)
 {
-	apc_cache_entry_t *entry;
-	zend_bool ret = 0;
-	
-	/* find the entry */
-	if ((entry = apc_cache_find(cache, strkey, keylen, t TSRMLS_CC))) {
-        /* context for copying out */
-		apc_context_t ctxt = {0, };
-
-		/* create unpool context */
-		if (apc_cache_make_context(cache, &ctxt, APC_CONTEXT_NOSHARE, APC_UNPOOL, APC_COPY_OUT, 0 TSRMLS_CC)) {
-
-			/* copy to destination */
-			apc_cache_fetch_zval(&ctxt, *dst, entry->val TSRMLS_CC);
+	zend_uint i;
 
-			/* release entry */
-			apc_cache_release(
-				cache, entry TSRMLS_CC);
+	for (i = 0; i < cache->nstripes; i++) {
+		if (which[i]) {
+			APC_CACHE_WLOCK(&cache->stripes[i]);
+		}
+	}
+} /* }}} */
 
-			/* destroy context */
-			apc_cache_destroy_context(&ctxt TSRMLS_CC );
+/* {{{ apc_cache_wunlock_some */
+static void apc_cache_wunlock_some(apc_cache_t* cache, zend_bool* which TSRMLS_DC)
+{
+	zend_uint i = cache->nstripes;
 
-			/* set result */
-			ret = 1;
+	while (i--) {
+		if (which[i]) {
+			APC_CACHE_WUNLOCK(&cache->stripes[i]);
 		}
 	}
-	
-	return ret;
 } /* }}} */
 
-/* {{{ apc_cache_exists */
-PHP_APCU_API apc_cache_entry_t* apc_cache_exists(apc_cache_t* cache, char *strkey, zend_uint keylen, time_t t TSRMLS_DC)
+/* {{{ apc_cache_make_item
+ makes the entry and slot for an item of a batched store, outside of any lock, running cache defense if defend is set */
+static apc_cache_slot_t* apc_cache_make_item(apc_cache_t* cache, apc_cache_batch_t* item, const zend_uint ttl, const zend_uint soft_ttl, time_t t, zend_bool defend TSRMLS_DC)
 {
-    if(apc_cache_busy(cache TSRMLS_CC))
-    {
-        /* cache cleanup in progress */ 
-        return NULL;
-    }
+	apc_cache_entry_t* entry;
+	apc_cache_key_t key;
 
-	/* we only declare volatiles we need */
-	{
-		apc_cache_slot_t** slot;
-	
-		volatile apc_cache_entry_t* value = NULL;
-		zend_ulong h, s;
+	memset(&item->ctxt, 0, sizeof(apc_context_t));
 
-        /* get hash and slot */
-		apc_cache_hash_slot(cache, strkey, keylen, &h, &s);
+	/* initialize a context suitable for making an insert */
+	if (!apc_cache_make_context(cache, &item->ctxt, APC_CONTEXT_SHARE, APC_SMALL_POOL, APC_COPY_IN, 0 TSRMLS_CC)) {
+		return NULL;
+	}
 
-        /* read lock header */
-		APC_RLOCK(cache->header);	
+	/* initialize the key, run cache defense, and make the entry */
+	if (apc_cache_make_key(&key, item->str, item->len TSRMLS_CC) &&
+		!(defend && apc_cache_defense(cache, &key TSRMLS_CC)) &&
+		(entry = apc_cache_make_entry(&item->ctxt, &key, item->val, ttl TSRMLS_CC))) {
 
-		/* find head */
-		slot = &cache->slots[s];
+		/* the entry goes stale before it expires */
+		entry->soft_ttl = soft_ttl;
 
-		while (*slot) {
-			/* check for match by hash and identifier */
-		    if ((h == (*slot)->key.h) &&
-		        !memcmp((*slot)->key.str, strkey, keylen)) {
+		if ((item->slot = make_slot(cache, &key, entry, NULL, t TSRMLS_CC))) {
+			/* set value size from pool size */
+			entry->mem_size = item->ctxt.pool->size;
 
-		        /* Check to make sure this entry isn't expired by a hard TTL */
-		        if((*slot)->value->ttl && (time_t) ((*slot)->ctime + (*slot)->value->ttl) < t) {
-                    /* marked as a miss */
-                    cache->header->nmisses++;
+			return item->slot;
+		}
+	}
 
-					/* unlock header */
-					APC_RUNLOCK(cache->header);
+	apc_cache_destroy_context(&item->ctxt TSRMLS_CC);
 
-		            return NULL;
-		        }
+	return NULL;
+} /* }}} */
 
-		        /* Return the cache entry ptr */
-		        value = (*slot)->value;
-			
-				/* unlock header */
-				APC_RUNLOCK(cache->header);
-					
-		        return (apc_cache_entry_t*)value;
-		    }
+/* {{{ apc_cache_store_many */
+PHP_APCU_API zend_uint apc_cache_store_many(apc_cache_t* cache, apc_cache_batch_t* items, zend_uint nitems, const zend_uint ttl, const zend_uint soft_ttl, const zend_bool exclusive, const zend_bool atomic TSRMLS_DC)
+{
+	zend_bool* stripes;
+	zend_uint i, made = 0, stored = 0;
+	time_t t;
 
-			slot = &(*slot)->next;  
-		}
+	for (i = 0; i < nitems; i++) {
+		items[i].slot = NULL;
+		items[i].result = 0;
+	}
 
-		/* unlock header */
-		APC_RUNLOCK(cache->header);
+	/* check we are able to deal with this request */
+	if (!cache || !nitems || apc_cache_busy(cache TSRMLS_CC)) {
+		return 0;
 	}
 
-    return NULL;
-}
-/* }}} */
+	t = apc_time();
 
-/* {{{ apc_cache_update */
-PHP_APCU_API zend_bool apc_cache_update(apc_cache_t* cache, char *strkey, zend_uint keylen, apc_cache_updater_t updater, void* data TSRMLS_DC)
-{
-    apc_cache_slot_t** slot;
-	
+	/* process deleted list, once for the batch */
+	if (cache->header->gc || cache->header->retired) {
+		apc_cache_gc(cache TSRMLS_CC);
+	}
+
+	/*
+	* make every slot before locking, allocation may fail and invoke expunge which
+	* requires the stripe locks; an atomic batch has no slam defense, one defended key would
+	* fail all of them, and racing batches are resolved under the locks
+	*/
+	for (i = 0; i < nitems; i++) {
+		if (apc_cache_make_item(cache, &items[i], ttl, soft_ttl, t, !atomic TSRMLS_CC)) {
+			made++;
+		} else if (atomic) {
+			break;
+		}
+	}
+
+	stripes = ecalloc(cache->nstripes, sizeof(zend_bool));
+
+	if (!atomic || made == nitems) {
+		for (i = 0; i < nitems; i++) {
+			if (items[i].slot) {
+				stripes[items[i].slot->key.h % cache->nstripes] = 1;
+			}
+		}
+
+		/* lock every stripe the batch touches at once, so that the batch becomes visible at once */
+		apc_cache_wlock_some(cache, stripes TSRMLS_CC);
+
+		/* an exclusive batch that is all or nothing fails on the first key that has not expired */
+		if (atomic && exclusive) {
+			for (i = 0; i < nitems; i++) {
+				apc_cache_slot_t* slot = items[i].slot;
+				apc_cache_slot_t* found = apc_cache_find_slot(cache, (char*) slot->key.str, slot->key.len, slot->key.h);
+
+				if (found && (!found->value->ttl || (time_t) (found->ctime + found->value->ttl) >= t)) {
+					break;
+				}
+			}
+		}
+
+		if (!atomic || !exclusive || i == nitems) {
+			for (i = 0; i < nitems; i++) {
+				if (items[i].slot && (items[i].result = apc_cache_link(cache, items[i].slot, t, exclusive TSRMLS_CC))) {
+					stored++;
+				}
+			}
+		}
+
+		apc_cache_wunlock_some(cache, stripes TSRMLS_CC);
+	}
+
+	efree(stripes);
+
+	for (i = 0; i < nitems; i++) {
+		if (items[i].result) {
+			/* keep chains short */
+			apc_cache_grow(cache TSRMLS_CC);
+		} else if (items[i].slot) {
+			/* in any case of failure the context should be destroyed */
+			apc_cache_destroy_context(&items[i].ctxt TSRMLS_CC);
+			items[i].slot = NULL;
+		}
+	}
+
+	return stored;
+} /* }}} */
+
+/* {{{ apc_cache_find_slot
+ Note: the caller must hold the stripe lock, or have announced an epoch */
+static apc_cache_slot_t* apc_cache_find_slot(apc_cache_t* cache, char *strkey, zend_uint keylen, zend_ulong h)
+{
+	apc_cache_slot_t* slot;
+	zend_ulong s;
+	apc_cache_table_t* table = apc_cache_home(cache, h, &s);
+
+	if (table->buckets) {
+		apc_cache_bucket_t* bucket = &table->buckets[s];
+		zend_uint count = bucket->count;
+		zend_uint i;
+
+		for (i = 0; i < count && i < APC_CACHE_BUCKET_WAYS; i++) {
+			/* check for a matching key by hash and length, the slot is only touched on a likely match */
+			if (bucket->h[i] == h && bucket->len[i] == keylen) {
+				slot = bucket->slot[i];
+
+				/* without a lock, the slot may not be the one the hash was read for */
+				if (slot && (slot->key.h == h) && (slot->key.len == keylen) &&
+					!memcmp(slot->key.str, strkey, keylen)) {
+					return slot;
+				}
+			}
+		}
+
+		/* the bucket describes the whole chain */
+		if (count <= APC_CACHE_BUCKET_WAYS) {
+			return NULL;
+		}
+	}
+
+	slot = table->slots[s];
+
+	/* without a lock, the slot may have been migrated since apc_cache_home looked */
+	if (slot == APC_CACHE_MOVED) {
+		return NULL;
+	}
+
+	while (slot) {
+		/* check for a matching key by hash and identifier */
+		if ((h == slot->key.h) && (slot->key.len == keylen) &&
+			!memcmp(slot->key.str, strkey, keylen)) {
+			return slot;
+		}
+
+		/* next */
+		slot = slot->next;
+	}
+
+	return NULL;
+} /* }}} */
+
+/* {{{ apc_cache_pin_slot
+ finds the slot for key and pins its value, without locking if possible */
+static apc_cache_slot_t* apc_cache_pin_slot(apc_cache_t* cache, char *strkey, zend_uint keylen, zend_ulong h TSRMLS_DC)
+{
+	apc_cache_stripe_t* stripe = APC_CACHE_STRIPE(cache, h);
+	apc_cache_slot_t* slot = NULL;
+
+#ifdef APC_CACHE_OPTIMISTIC
+	apc_cache_reader_t* reader = cache->reader;
+	zend_bool announced;
+#endif
+
+#ifdef APC_CACHE_OPTIMISTIC
+	/* only for the length of the lookup, the slot found is pinned before the announcement ends */
+	announced = apc_cache_announce(cache);
+
+	if (reader && reader->epoch) {
+		int tries;
+
+		for (tries = 0; tries < APC_CACHE_OPTIMISTIC_TRIES; tries++) {
+			/* an odd version means a writer is changing the chains */
+			zend_ulong version = stripe->version;
+
+			if (version & 1) {
+				continue;
+			}
+
+			MEMORY_BARRIER();
+
+			/* a key the filter rules out has no chain to search */
+			if (!apc_cache_filter_absent(cache, h TSRMLS_CC) &&
+				(slot = apc_cache_find_slot(cache, strkey, keylen, h))) {
+				ATOMIC_INC(slot->value->ref_count);
+			}
+
+			MEMORY_BARRIER();
+
+			/* no writer interleaved, the result is good */
+			if (stripe->version == version) {
+				apc_cache_quiesce(cache, announced);
+				return slot;
+			}
+
+			if (slot) {
+				ATOMIC_DEC(slot->value->ref_count);
+			}
+		}
+	}
+
+	apc_cache_quiesce(cache, announced);
+#endif
+
+	/* writers keep interleaving, or this process is not registered */
+	APC_RLOCK(stripe);
+
+	if (!apc_cache_filter_absent(cache, h TSRMLS_CC) &&
+		(slot = apc_cache_find_slot(cache, strkey, keylen, h))) {
+		ATOMIC_INC(slot->value->ref_count);
+	}
+
+	APC_RUNLOCK(stripe);
+
+	return slot;
+} /* }}} */
+
+/* {{{ apc_cache_find */
+PHP_APCU_API apc_cache_entry_t* apc_cache_find(apc_cache_t* cache, char *strkey, zend_uint keylen, time_t t TSRMLS_DC)
+{
+	return apc_cache_find_ex(cache, strkey, keylen, t, 0.0, NULL TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ apc_cache_elect
+ elects the caller to refresh the value of the slot, once it is stale, or early as it nears expiry
+ Only one caller is elected for a value, unless its refresh does not arrive in time */
+static zend_bool apc_cache_elect(apc_cache_t* cache, apc_cache_slot_t* slot, time_t t, double beta TSRMLS_DC)
+{
+	apc_cache_entry_t* value = slot->value;
+	zend_ulong elected = value->elected;
+	time_t expiry;
+
+	if (value->soft_ttl) {
+		expiry = slot->ctime + value->soft_ttl;
+	} else if (value->ttl) {
+		expiry = slot->ctime + value->ttl;
+	} else {
+		return 0;
+	}
+
+	/* fresh, but refresh early with a probability that rises as expiry nears and with the time the value took to generate */
+	if (expiry >= t) {
+		if (!value->delta || beta <= 0.0 ||
+			(t - ((double) value->delta / 1000.0) * beta * log(php_combined_lcg(TSRMLS_C))) < (double) expiry) {
+			return 0;
+		}
+	}
+
+	/* someone is refreshing already */
+	if (elected && (time_t) elected + APC_CACHE_REFRESH_TIMEOUT > t) {
+		return 0;
+	}
+
+	return ATOMIC_CAS(value->elected, elected, (zend_ulong) t);
+} /* }}} */
+
+/* {{{ apc_cache_find_live
+ finds and pins the slot for key if it has not expired, counting the hit or miss */
+static apc_cache_slot_t* apc_cache_find_live(apc_cache_t* cache, char *strkey, zend_uint keylen, zend_ulong h, time_t t TSRMLS_DC)
+{
+	apc_cache_slot_t* slot;
+
+	/* find and pin the slot */
+	slot = apc_cache_pin_slot(cache, strkey, keylen, h TSRMLS_CC);
+
+	if (!slot) {
+		/* not found, so increment misses */
+		ATOMIC_INC(APC_CACHE_STATS(cache)->nmisses);
+
+		return NULL;
+	}
+
+	/* Check to make sure this entry isn't expired by a hard TTL */
+	if (slot->value->ttl && (time_t) (slot->ctime + slot->value->ttl) < t) {
+		/* release entry */
+		apc_cache_release(cache, slot->value TSRMLS_CC);
+
+		/* increment misses on cache */
+		ATOMIC_INC(APC_CACHE_STATS(cache)->nmisses);
+
+		return NULL;
+	}
+
+	/* Otherwise we are fine, increase counters and return the cache entry */
+	slot->nhits++;
+
+	/* readers of a hot entry would all write the same second, and the same reference */
+	if (slot->atime != t) {
+		slot->atime = t;
+	}
+	if (!slot->referenced) {
+		slot->referenced = 1;
+	}
+
+	/* set cache num hits */
+	ATOMIC_INC(APC_CACHE_STATS(cache)->nhits);
+
+	return slot;
+} /* }}} */
+
+/* {{{ apc_cache_find_ex */
+PHP_APCU_API apc_cache_entry_t* apc_cache_find_ex(apc_cache_t* cache, char *strkey, zend_uint keylen, time_t t, double beta, zend_bool* refresh TSRMLS_DC)
+{
+	apc_cache_slot_t* slot;
+	zend_ulong h;
+
+	if (refresh) {
+		(*refresh) = 0;
+	}
+
+	/* check we are able to deal with the request */
+    if(!cache || apc_cache_busy(cache TSRMLS_CC)) {
+        return NULL;
+    }
+
+	/* calculate hash and slot */
+	apc_cache_hash_slot(cache, strkey, keylen, &h);
+
+	if (!(slot = apc_cache_find_live(cache, strkey, keylen, h, t TSRMLS_CC))) {
+		return NULL;
+	}
+
+	/* stale while revalidating */
+	if (refresh) {
+		(*refresh) = apc_cache_elect(cache, slot, t, beta TSRMLS_CC);
+	}
+
+	return slot->value;
+}
+/* }}} */
+
+/* {{{ apc_cache_prefetch
+ starts loading the chain key h lives in, so that it is there by the time the key is searched for */
+static void apc_cache_prefetch(apc_cache_t* cache, zend_ulong h)
+{
+	zend_ulong s;
+	apc_cache_table_t* table = apc_cache_home(cache, h, &s);
+
+	if (table->buckets) {
+		APC_PREFETCH(&table->buckets[s]);
+	} else {
+		APC_PREFETCH(&table->slots[s]);
+	}
+} /* }}} */
+
+/* {{{ apc_cache_pin_group
+ finds and pins the slot of every key from first on that lives in stripe
+ Note: the caller must hold the stripe lock, or check the stripe version after */
+static void apc_cache_pin_group(apc_cache_t* cache, apc_cache_stripe_t* stripe, apc_cache_lookup_t* keys, zend_uint first, zend_uint nkeys TSRMLS_DC)
+{
+	zend_uint i;
+
+	for (i = first; i < nkeys; i++) {
+		/* a key the filter rules out has no chain to search */
+		if (APC_CACHE_STRIPE(cache, keys[i].h) == stripe && !apc_cache_filter_absent(cache, keys[i].h TSRMLS_CC)) {
+			if ((keys[i].slot = apc_cache_find_slot(cache, keys[i].str, keys[i].len, keys[i].h))) {
+				ATOMIC_INC(keys[i].slot->value->ref_count);
+			}
+		}
+	}
+} /* }}} */
+
+#ifdef APC_CACHE_OPTIMISTIC
+/* {{{ apc_cache_unpin_group
+ undoes apc_cache_pin_group, after a writer interleaved with it */
+static void apc_cache_unpin_group(apc_cache_t* cache, apc_cache_stripe_t* stripe, apc_cache_lookup_t* keys, zend_uint first, zend_uint nkeys)
+{
+	zend_uint i;
+
+	for (i = first; i < nkeys; i++) {
+		if (APC_CACHE_STRIPE(cache, keys[i].h) == stripe && keys[i].slot) {
+			ATOMIC_DEC(keys[i].slot->value->ref_count);
+			keys[i].slot = NULL;
+		}
+	}
+} /* }}} */
+#endif
+
+/* {{{ apc_cache_pin_many
+ finds and pins the slots of keys, visiting every stripe once, without locking if possible */
+static void apc_cache_pin_many(apc_cache_t* cache, apc_cache_lookup_t* keys, zend_uint nkeys TSRMLS_DC)
+{
+	zend_bool* visited = ecalloc(nkeys, sizeof(zend_bool));
+	zend_bool optimistic = 0;
+	zend_uint i, j;
+
+#ifdef APC_CACHE_OPTIMISTIC
+	apc_cache_reader_t* reader = cache->reader;
+
+	/* only for the length of the lookups, the slots found are pinned before the announcement ends */
+	zend_bool announced = apc_cache_announce(cache);
+
+	optimistic = reader && reader->epoch;
+#endif
+
+	for (i = 0; i < nkeys; i++) {
+		apc_cache_stripe_t* stripe;
+		zend_bool pinned = 0;
+
+		/* searched along with an earlier key of the same stripe */
+		if (visited[i]) {
+			continue;
+		}
+
+		stripe = APC_CACHE_STRIPE(cache, keys[i].h);
+
+		for (j = i; j < nkeys; j++) {
+			if (APC_CACHE_STRIPE(cache, keys[j].h) == stripe) {
+				visited[j] = 1;
+			}
+		}
+
+#ifdef APC_CACHE_OPTIMISTIC
+		if (optimistic) {
+			int tries;
+
+			for (tries = 0; tries < APC_CACHE_OPTIMISTIC_TRIES; tries++) {
+				/* an odd version means a writer is changing the chains */
+				zend_ulong version = stripe->version;
+
+				if (version & 1) {
+					continue;
+				}
+
+				MEMORY_BARRIER();
+
+				apc_cache_pin_group(cache, stripe, keys, i, nkeys TSRMLS_CC);
+
+				MEMORY_BARRIER();
+
+				/* no writer interleaved, the results are good */
+				if (stripe->version == version) {
+					pinned = 1;
+					break;
+				}
+
+				apc_cache_unpin_group(cache, stripe, keys, i, nkeys);
+			}
+		}
+#endif
+
+		/* writers keep interleaving, or this process is not registered */
+		if (!pinned) {
+			APC_RLOCK(stripe);
+			apc_cache_pin_group(cache, stripe, keys, i, nkeys TSRMLS_CC);
+			APC_RUNLOCK(stripe);
+		}
+	}
+
+#ifdef APC_CACHE_OPTIMISTIC
+	apc_cache_quiesce(cache, announced);
+#endif
+
+	efree(visited);
+} /* }}} */
+
+/* {{{ apc_cache_find_many */
+PHP_APCU_API zend_uint apc_cache_find_many(apc_cache_t* cache, apc_cache_lookup_t* keys, zend_uint nkeys, time_t t, double beta, int flags TSRMLS_DC)
+{
+	zend_uint i, nfound = 0, nhits = 0, nmisses = 0;
+
+	for (i = 0; i < nkeys; i++) {
+		keys[i].slot = NULL;
+		keys[i].value = NULL;
+		keys[i].refresh = 0;
+	}
+
+	/* check we are able to deal with the request */
+	if (!cache || !nkeys || apc_cache_busy(cache TSRMLS_CC)) {
+		return 0;
+	}
+
+	/* hash every key, and start loading its chain */
+	for (i = 0; i < nkeys; i++) {
+		apc_cache_hash_slot(cache, keys[i].str, keys[i].len, &keys[i].h);
+		apc_cache_prefetch(cache, keys[i].h);
+	}
+
+	/* find and pin the slots */
+	apc_cache_pin_many(cache, keys, nkeys TSRMLS_CC);
+
+	for (i = 0; i < nkeys; i++) {
+		apc_cache_slot_t* slot = keys[i].slot;
+
+		if (!slot) {
+			if (!(flags & APC_CACHE_FIND_PEEK)) {
+				nmisses++;
+			}
+			continue;
+		}
+
+		/* Check to make sure this entry isn't expired by a hard TTL */
+		if (slot->value->ttl && (time_t) (slot->ctime + slot->value->ttl) < t) {
+			apc_cache_release(cache, slot->value TSRMLS_CC);
+
+			keys[i].slot = NULL;
+			nmisses++;
+			continue;
+		}
+
+		keys[i].value = slot->value;
+		nfound++;
+
+		if (!(flags & APC_CACHE_FIND_PEEK)) {
+			slot->nhits++;
+
+			/* readers of a hot entry would all write the same second, and the same reference */
+			if (slot->atime != t) {
+				slot->atime = t;
+			}
+			if (!slot->referenced) {
+				slot->referenced = 1;
+			}
+
+			nhits++;
+		}
+
+		/* stale while revalidating */
+		if (flags & APC_CACHE_FIND_ELECT) {
+			keys[i].refresh = apc_cache_elect(cache, slot, t, beta TSRMLS_CC);
+		}
+	}
+
+	/* counted once for the whole batch */
+	if (nhits) {
+		ATOMIC_ADD(APC_CACHE_STATS(cache)->nhits, nhits);
+	}
+
+	if (nmisses) {
+		ATOMIC_ADD(APC_CACHE_STATS(cache)->nmisses, nmisses);
+	}
+
+	return nfound;
+}
+/* }}} */
+
+/* {{{ apc_cache_fetch */
+PHP_APCU_API zend_bool apc_cache_fetch(apc_cache_t* cache, char* strkey, zend_uint keylen, time_t t, zval **dst TSRMLS_DC) 
+{
+	return apc_cache_fetch_ex(cache, strkey, keylen, t, 0.0, NULL, dst TSRMLS_CC);
+} /* }}} */
+
+/* {{{ apc_cache_fetch_ex */
+PHP_APCU_API zend_bool apc_cache_fetch_ex(apc_cache_t* cache, char* strkey, zend_uint keylen, time_t t, double beta, zend_bool* refresh, zval **dst TSRMLS_DC) 
+{
+	apc_cache_entry_t *entry;
+	zend_bool ret = 0;
+	
+	/* find the entry */
+	if ((entry = apc_cache_find_ex(cache, strkey, keylen, t, beta, refresh TSRMLS_CC))) {
+        /* context for copying out */
+		apc_context_t ctxt = {0, };
+
+		/* create unpool context */
+		if (apc_cache_make_context(cache, &ctxt, APC_CONTEXT_NOSHARE, APC_UNPOOL, APC_COPY_OUT, 0 TSRMLS_CC)) {
+
+			/* copy to destination */
+			apc_cache_fetch_zval(&ctxt, *dst, entry->val TSRMLS_CC);
+
+			/* release entry */
+			apc_cache_release(
+				cache, entry TSRMLS_CC);
+
+			/* destroy context */
+			apc_cache_destroy_context(&ctxt TSRMLS_CC );
+
+			/* set result */
+			ret = 1;
+		}
+	}
+	
+	return ret;
+} /* }}} */
+
+/* {{{ apc_cache_l1_free
+ destructor of the entries of the local cache */
+static void apc_cache_l1_free(void* pDest)
+{
+	apc_cache_l1_entry_t* held = (apc_cache_l1_entry_t*) pDest;
+	TSRMLS_FETCH();
+
+	apc_pool_destroy(held->pool TSRMLS_CC);
+} /* }}} */
+
+/* {{{ apc_cache_l1 */
+PHP_APCU_API void apc_cache_l1(apc_cache_t* cache, zend_ulong entries, size_t size TSRMLS_DC)
+{
+#ifdef APC_CACHE_OPTIMISTIC
+	if (!cache || cache->l1 || !entries || !size) {
+		return;
+	}
+
+	cache->l1 = (apc_cache_l1_t*) apc_emalloc(sizeof(apc_cache_l1_t) TSRMLS_CC);
+	cache->l1->max_entries = entries;
+	cache->l1->max_size = size;
+	cache->l1->size = 0;
+
+	/* persistent, the local cache outlives requests */
+	zend_hash_init(&cache->l1->entries, entries, NULL, apc_cache_l1_free, 1);
+#endif
+} /* }}} */
+
+#ifdef APC_CACHE_OPTIMISTIC
+/* {{{ apc_cache_l1_drop
+ drops the entry of the local cache for key */
+static void apc_cache_l1_drop(apc_cache_l1_t* l1, char* strkey, zend_uint keylen, zend_ulong h, apc_cache_l1_entry_t* held)
+{
+	l1->size -= held->pool->size;
+
+	zend_hash_quick_del(&l1->entries, strkey, keylen, h);
+} /* }}} */
+
+/* {{{ apc_cache_l1_hold
+ copies the value fetched from slot into the local cache, making room for it by dropping the oldest entries */
+static void apc_cache_l1_hold(apc_cache_t* cache, char* strkey, zend_uint keylen, zend_ulong h, zend_ulong gen, apc_cache_slot_t* slot, const zval* val TSRMLS_DC)
+{
+	apc_cache_l1_t* l1 = cache->l1;
+	apc_cache_l1_entry_t held;
+	apc_context_t ctxt = {0, };
+
+	/* copied in like a value going into shared memory, only into process memory */
+	if (!apc_cache_make_context_ex(&ctxt, cache->serializer, apc_emalloc, apc_efree, NULL, NULL, APC_SMALL_POOL, APC_COPY_IN, 0 TSRMLS_CC)) {
+		return;
+	}
+
+	if (!(held.val = apc_cache_store_zval(NULL, val, &ctxt TSRMLS_CC)) || ctxt.pool->size > l1->max_size) {
+		apc_cache_destroy_context(&ctxt TSRMLS_CC);
+		return;
+	}
+
+	held.gen = gen;
+	held.slot = slot;
+	held.pool = ctxt.pool;
+
+	/* oldest first */
+	while (zend_hash_num_elements(&l1->entries) &&
+		   (zend_hash_num_elements(&l1->entries) >= l1->max_entries || l1->size + held.pool->size > l1->max_size)) {
+		apc_cache_l1_entry_t* oldest;
+		HashPosition position;
+		char* okey;
+		uint okeylen;
+		ulong oindex;
+
+		zend_hash_internal_pointer_reset_ex(&l1->entries, &position);
+		zend_hash_get_current_data_ex(&l1->entries, (void**) &oldest, &position);
+		zend_hash_get_current_key_ex(&l1->entries, &okey, &okeylen, &oindex, 0, &position);
+
+		apc_cache_l1_drop(l1, okey, okeylen, zend_inline_hash_func(okey, okeylen), oldest);
+	}
+
+	zend_hash_quick_update(&l1->entries, strkey, keylen, h, &held, sizeof(apc_cache_l1_entry_t), NULL);
+
+	l1->size += held.pool->size;
+} /* }}} */
+
+/* {{{ apc_cache_fetch_held
+ fetches key from the copy this process holds, or from the cache to hold a copy
+ Note: the caller must have announced an epoch */
+static zend_bool apc_cache_fetch_held(apc_cache_t* cache, char* strkey, zend_uint keylen, zend_ulong h, time_t t, zval *dst TSRMLS_DC)
+{
+	apc_cache_l1_entry_t* held;
+	apc_cache_slot_t* slot;
+	apc_context_t ctxt = {0, };
+	zend_ulong gen;
+
+	gen = cache->gens[h % APC_CACHE_GENERATIONS];
+
+	if (zend_hash_quick_find(&cache->l1->entries, strkey, keylen, h, (void**) &held) == SUCCESS) {
+		if (held->gen == gen) {
+			/* the slot is still linked, keep it from looking unused to eviction */
+			if (held->slot->atime != t) {
+				held->slot->atime = t;
+			}
+			if (!held->slot->referenced) {
+				held->slot->referenced = 1;
+			}
+
+			ATOMIC_INC(APC_CACHE_STATS(cache)->nhits);
+
+			if (!apc_cache_make_context(cache, &ctxt, APC_CONTEXT_NOSHARE, APC_UNPOOL, APC_COPY_OUT, 0 TSRMLS_CC)) {
+				return 0;
+			}
+
+			apc_cache_fetch_zval(&ctxt, dst, held->val TSRMLS_CC);
+			apc_cache_destroy_context(&ctxt TSRMLS_CC);
+
+			return 1;
+		}
+
+		/* changed since it was copied */
+		apc_cache_l1_drop(cache->l1, strkey, keylen, h, held);
+	}
+
+	if (!(slot = apc_cache_find_live(cache, strkey, keylen, h, t TSRMLS_CC))) {
+		return 0;
+	}
+
+	if (apc_cache_make_context(cache, &ctxt, APC_CONTEXT_NOSHARE, APC_UNPOOL, APC_COPY_OUT, 0 TSRMLS_CC)) {
+		apc_cache_fetch_zval(&ctxt, dst, slot->value->val TSRMLS_CC);
+		apc_cache_destroy_context(&ctxt TSRMLS_CC);
+
+		/* values that expire do not bump the generation as they do */
+		if (!slot->value->ttl && !slot->value->soft_ttl) {
+			apc_cache_l1_hold(cache, strkey, keylen, h, gen, slot, dst TSRMLS_CC);
+		}
+
+		apc_cache_release(cache, slot->value TSRMLS_CC);
+
+		return 1;
+	}
+
+	apc_cache_release(cache, slot->value TSRMLS_CC);
+
+	return 0;
+} /* }}} */
+#endif
+
+/* {{{ apc_cache_fetch_l1 */
+PHP_APCU_API zend_bool apc_cache_fetch_l1(apc_cache_t* cache, char* strkey, zend_uint keylen, time_t t, zval *dst TSRMLS_DC)
+{
+#ifdef APC_CACHE_OPTIMISTIC
+	apc_cache_reader_t* reader = cache ? cache->reader : NULL;
+	zend_ulong h;
+	zend_bool announced, fetched;
+
+	/* the slot of an entry may only be looked at by a registered process */
+	if (!cache || !cache->l1 || !reader || apc_cache_busy(cache TSRMLS_CC)) {
+		return apc_cache_fetch(cache, strkey, keylen, t, &dst TSRMLS_CC);
+	}
+
+	/* calculate hash */
+	apc_cache_hash_slot(cache, strkey, keylen, &h);
+
+	/* slots retired from now on cannot be free'd, and slots retired before bumped the generation, see apc_cache_remove_slot */
+	announced = apc_cache_announce(cache);
+
+	fetched = apc_cache_fetch_held(cache, strkey, keylen, h, t, dst TSRMLS_CC);
+
+	apc_cache_quiesce(cache, announced);
+
+	return fetched;
+#else
+	return apc_cache_fetch(cache, strkey, keylen, t, &dst TSRMLS_CC);
+#endif
+} /* }}} */
+
+/* {{{ apc_cache_owner_dead
+ tells whether the owner of the marker died while generating */
+static zend_bool apc_cache_owner_dead(apc_cache_inflight_t* flight)
+{
+#ifdef APC_CACHE_OPTIMISTIC
+	apc_cache_owner_t owner;
+
+	/* the owner is written after the state it was read with */
+	MEMORY_BARRIER();
+	owner = ATOMIC_ADD(flight->owner, 0);
+
+	return owner && kill(owner, 0) == -1 && errno == ESRCH;
+#else
+	return 0;
+#endif
+} /* }}} */
+
+/* {{{ apc_cache_entry_release
+ releases the marker, unless another process took it over */
+static void apc_cache_entry_release(apc_cache_inflight_t* flight, zend_ulong ticket)
+{
+	ATOMIC_CAS(flight->state, ticket, APC_CACHE_INFLIGHT_NEXT(ticket, 0));
+} /* }}} */
+
+/* {{{ apc_cache_entry */
+PHP_APCU_API void apc_cache_entry(apc_cache_t* cache, char* strkey, zend_uint keylen, zend_fcall_info* fci, zend_fcall_info_cache* fcc, zend_uint ttl, zend_uint soft_ttl, double beta, zend_ulong wait, zval* return_value TSRMLS_DC)
+{
+	apc_cache_inflight_t* flight = NULL;
+	zend_ulong h, tag, ticket = 0, seen = 0, waited = 0;
+	zend_bool marked = 0, refresh = 0;
+	zval* retval = NULL;
+	zval* key = NULL;
+	zval** args[1];
+	struct timeval start, end;
+	zend_uint delta;
+	time_t t;
+#ifdef ZTS
+	apc_cache_owner_t owner = TSRMLS_C;
+#else
+	apc_cache_owner_t owner = getpid();
+#endif
+
+	if (!cache) {
+		return;
+	}
+
+	t = apc_time();
+
+	/* hit, unless this caller was elected to refresh the value, in which case the stale value is kept should generation fail */
+	if (apc_cache_fetch_ex(cache, strkey, keylen, t, beta, &refresh, &return_value TSRMLS_CC) && !refresh) {
+		return;
+	}
+
+	/* an elected caller is the only one to refresh, a miss marks the key */
+	if (!refresh) {
+		apc_cache_hash_slot(cache, strkey, keylen, &h);
+
+		tag = APC_CACHE_INFLIGHT_TAG(h);
+		flight = &cache->inflight[h % APC_CACHE_INFLIGHT];
+
+		while (!marked) {
+			zend_ulong state = flight->state;
+			zend_ulong busy = state & ~APC_CACHE_TICKET_MASK;
+
+			/* nothing is being generated here, mark the key, the ticket is published with the tag */
+			if (!busy) {
+				ticket = APC_CACHE_INFLIGHT_NEXT(state, tag);
+				if (ATOMIC_CAS(flight->state, state, ticket)) {
+					flight->owner = owner;
+					marked = 1;
+				}
+				continue;
+			}
+
+			/* another key is marked here, generate without waiting */
+			if (busy != tag) {
+				break;
+			}
+
+			/* a new owner gets as long as the last */
+			if (state != seen) {
+				seen = state;
+				waited = 0;
+			}
+
+			/* the owner is taking too long, or died, take the marker over from the owner that was seen */
+			if (waited >= wait || (waited && apc_cache_owner_dead(flight))) {
+				ticket = APC_CACHE_INFLIGHT_NEXT(seen, tag);
+				if (ATOMIC_CAS(flight->state, seen, ticket)) {
+					flight->owner = owner;
+					marked = 1;
+				}
+				continue;
+			}
+
+			usleep(APC_CACHE_ENTRY_POLL);
+			waited += APC_CACHE_ENTRY_POLL;
+
+			/* the marker was released, the value should be there */
+			if ((flight->state & ~APC_CACHE_TICKET_MASK) != tag) {
+				t = apc_time();
+
+				if (apc_cache_fetch(cache, strkey, keylen, t, &return_value TSRMLS_CC)) {
+					return;
+				}
+			}
+		}
+
+		/* the value may have been stored between the miss and the mark */
+		if (marked && apc_cache_fetch(cache, strkey, keylen, t, &return_value TSRMLS_CC)) {
+			apc_cache_entry_release(flight, ticket);
+			return;
+		}
+	}
+
+	MAKE_STD_ZVAL(key);
+	ZVAL_STRINGL(key, strkey, keylen - 1, 1);
+	args[0] = &key;
+
+	fci->retval_ptr_ptr = &retval;
+	fci->params = args;
+	fci->param_count = 1;
+
+	zend_try {
+		gettimeofday(&start, NULL);
+
+		/* generate */
+		if (zend_call_function(fci, fcc TSRMLS_CC) == SUCCESS && retval) {
+			gettimeofday(&end, NULL);
+
+			/* remember how long it took, so that it can be refreshed early enough */
+			delta = (zend_uint) (((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)) / 1000L) + 1;
+
+			if (!EG(exception)) {
+				apc_cache_store_ex(cache, strkey, keylen, retval, ttl, soft_ttl, delta, 0 TSRMLS_CC);
+			}
+
+			/* replace what may have been stale */
+			zval_dtor(return_value);
+			RETVAL_ZVAL(retval, 1, 1);
+		}
+	} zend_catch {
+		/* the waiting processes must not wait for a value that is not coming */
+		if (marked) {
+			apc_cache_entry_release(flight, ticket);
+		}
+		zend_bailout();
+	} zend_end_try();
+
+	zval_ptr_dtor(&key);
+
+	if (marked) {
+		apc_cache_entry_release(flight, ticket);
+	}
+} /* }}} */
+
+/* {{{ apc_cache_exists */
+PHP_APCU_API apc_cache_entry_t* apc_cache_exists(apc_cache_t* cache, char *strkey, zend_uint keylen, time_t t TSRMLS_DC)
+{
+	apc_cache_slot_t* slot;
+	apc_cache_entry_t* value = NULL;
+	zend_ulong h, s;
+
+    if(apc_cache_busy(cache TSRMLS_CC))
+    {
+        /* cache cleanup in progress */ 
+        return NULL;
+    }
+
+	/* get hash and slot */
+	apc_cache_hash_slot(cache, strkey, keylen, &h);
+
+	/* find and pin the slot */
+	slot = apc_cache_pin_slot(cache, strkey, keylen, h TSRMLS_CC);
+
+	if (slot) {
+		/* Check to make sure this entry isn't expired by a hard TTL */
+		if (slot->value->ttl && (time_t) (slot->ctime + slot->value->ttl) < t) {
+			/* marked as a miss */
+			ATOMIC_INC(APC_CACHE_STATS(cache)->nmisses);
+		} else {
+			/* Return the cache entry ptr */
+			value = slot->value;
+		}
+
+		/* the caller does not hold a reference */
+		apc_cache_release(cache, slot->value TSRMLS_CC);
+	}
+
+    return value;
+}
+/* }}} */
+
+/* {{{ apc_cache_update */
+PHP_APCU_API zend_bool apc_cache_update(apc_cache_t* cache, char *strkey, zend_uint keylen, apc_cache_updater_t updater, void* data TSRMLS_DC)
+{
+    apc_cache_slot_t** slot;
+    apc_cache_table_t* table;
+	
     zend_bool retval = 0;
     zend_ulong h, s;
 
@@ -1000,17 +2849,18 @@ PHP_APCU_API zend_bool apc_cache_update(apc_cache_t* cache, char *strkey, zend_u
     }
 
     /* calculate hash */
-    apc_cache_hash_slot(cache, strkey, keylen, &h, &s);
+    apc_cache_hash_slot(cache, strkey, keylen, &h);
 	
-	/* lock header */
-	APC_LOCK(cache->header);
+	/* lock stripe, the value is changed in place and readers that do not lock must try again */
+	APC_CACHE_WLOCK(APC_CACHE_STRIPE(cache, h));
 
 	/* find head */
-    slot = &cache->slots[s];
+    table = apc_cache_home(cache, h, &s);
+    slot = &table->slots[s];
 
     while (*slot) {
 		/* check for a match by hash and identifier */
-        if ((h == (*slot)->key.h) &&
+        if ((h == (*slot)->key.h) && ((*slot)->key.len == keylen) &&
             !memcmp((*slot)->key.str, strkey, keylen)) {
 			/* attempt to perform update */
             switch(Z_TYPE_P((*slot)->value->val) & ~IS_CONSTANT_TYPE_MASK) {
@@ -1031,72 +2881,262 @@ PHP_APCU_API zend_bool apc_cache_update(apc_cache_t* cache, char *strkey, zend_u
                     retval = updater(
 						cache, (*slot)->value, data);
 
-					/* set modified time */
-                    (*slot)->key.mtime = apc_time();
-                }
-                break;
-            }
-			/* unlock header */
-			APC_UNLOCK(cache->header);
+					/* set modified time */
+                    (*slot)->key.mtime = apc_time();
+
+					/* copies held by processes are out of date */
+					APC_CACHE_TOUCH(cache, h);
+                }
+                break;
+            }
+			/* unlock stripe */
+			APC_CACHE_WUNLOCK(APC_CACHE_STRIPE(cache, h));
+
+            return retval;
+        }
+
+		/* set next slot */
+        slot = &(*slot)->next;
+	}
+	
+	/* unlock stripe */
+	APC_CACHE_WUNLOCK(APC_CACHE_STRIPE(cache, h));
+
+    return 0;
+}
+/* }}} */
+
+/* {{{ apc_cache_upsert
+ creates the entry for key from init, updated before it is linked in, or updates the entry another
+ process linked in first */
+static zend_bool apc_cache_upsert(apc_cache_t* cache, char *strkey, zend_uint keylen, zend_ulong h, apc_cache_updater_t updater, void* data, const zval* init, const zend_uint ttl TSRMLS_DC)
+{
+	apc_context_t ctxt = {0, };
+	apc_cache_entry_t* entry;
+	apc_cache_slot_t* p;
+	apc_cache_key_t key;
+	zend_bool retval = 0, linked = 0;
+	time_t t;
+
+	t = apc_time();
+
+	/* process deleted list */
+	if (cache->header->gc || cache->header->retired) {
+		apc_cache_gc(cache TSRMLS_CC);
+	}
+
+	/*
+	* make the slot before locking, allocation may fail and invoke expunge which
+	* requires the stripe locks; there is no slam defense, racing creators are resolved under the lock
+	*/
+	if (!apc_cache_make_context(cache, &ctxt, APC_CONTEXT_SHARE, APC_SMALL_POOL, APC_COPY_IN, 0 TSRMLS_CC)) {
+		return 0;
+	}
+
+	if (!apc_cache_make_key(&key, strkey, keylen TSRMLS_CC) ||
+		!(entry = apc_cache_make_entry(&ctxt, &key, init, ttl TSRMLS_CC)) ||
+		!(p = make_slot(cache, &key, entry, NULL, t TSRMLS_CC))) {
+		apc_cache_destroy_context(&ctxt TSRMLS_CC);
+		return 0;
+	}
+
+	/* set value size from pool size */
+	entry->mem_size = ctxt.pool->size;
+
+	/* nobody else can see the entry yet */
+	retval = updater(cache, entry, data);
+
+	APC_CACHE_WLOCK(APC_CACHE_STRIPE(cache, h));
+
+	if (retval) {
+		/* replaces an expired entry, but not one another process created meanwhile */
+		if (!(linked = apc_cache_link(cache, p, t, 1 TSRMLS_CC))) {
+			apc_cache_slot_t* slot = apc_cache_find_slot(cache, strkey, keylen, h);
+
+			retval = slot && updater(cache, slot->value, data);
+
+			/* copies held by processes are out of date */
+			APC_CACHE_TOUCH(cache, h);
+		}
+	}
+
+	APC_CACHE_WUNLOCK(APC_CACHE_STRIPE(cache, h));
+
+	if (linked) {
+		/* keep chains short */
+		apc_cache_grow(cache TSRMLS_CC);
+	} else {
+		apc_cache_destroy_context(&ctxt TSRMLS_CC);
+	}
+
+	return retval;
+} /* }}} */
+
+/* {{{ apc_cache_update_atomic */
+PHP_APCU_API zend_bool apc_cache_update_atomic(apc_cache_t* cache, char *strkey, zend_uint keylen, apc_cache_updater_t updater, void* data, const zval* init, const zend_uint ttl TSRMLS_DC)
+{
+    apc_cache_slot_t* slot;
+    zend_bool retval = 0;
+    zend_ulong h;
+    time_t t;
+
+    if(apc_cache_busy(cache TSRMLS_CC))
+    {
+        /* cannot service request right now */ 
+        return 0;
+    }
+
+    /* calculate hash */
+    apc_cache_hash_slot(cache, strkey, keylen, &h);
+
+	/* find and pin the slot, the value cannot be free'd while it is pinned */
+	slot = apc_cache_pin_slot(cache, strkey, keylen, h TSRMLS_CC);
 
-            return retval;
-        }
+	if (init) {
+		t = apc_time();
 
-		/* set next slot */
-        slot = &(*slot)->next;
+		/* an expired counter starts over */
+		if (slot && slot->value->ttl && (time_t) (slot->ctime + slot->value->ttl) < t) {
+			apc_cache_release(cache, slot->value TSRMLS_CC);
+			slot = NULL;
+		}
+
+		if (!slot) {
+			return apc_cache_upsert(cache, strkey, keylen, h, updater, data, init, ttl TSRMLS_CC);
+		}
 	}
-	
-	/* unlock header */
-	APC_UNLOCK(cache->header);
 
-    return 0;
+	if (!slot) {
+		return 0;
+	}
+
+	switch(Z_TYPE_P(slot->value->val) & ~IS_CONSTANT_TYPE_MASK) {
+		case IS_ARRAY:
+		case IS_OBJECT:
+			/* serialized values are opaque, and nothing else can be changed atomically */
+			break;
+
+		default:
+		{
+			/* executing update */
+			retval = updater(
+				cache, slot->value, data);
+
+			/* set modified time */
+			slot->key.mtime = apc_time();
+
+			/* copies held by processes are out of date */
+			APC_CACHE_TOUCH(cache, h);
+		}
+		break;
+	}
+
+	/* release entry */
+	apc_cache_release(cache, slot->value TSRMLS_CC);
+
+    return retval;
 }
 /* }}} */
 
-/* {{{ apc_cache_delete */
-PHP_APCU_API zend_bool apc_cache_delete(apc_cache_t* cache, char *strkey, zend_uint keylen TSRMLS_DC)
+/* {{{ apc_cache_unlink
+ removes the slot of the key from its chain
+ Note: the caller must hold the stripe write lock */
+static zend_bool apc_cache_unlink(apc_cache_t* cache, char *strkey, zend_uint keylen, zend_ulong h TSRMLS_DC)
 {
     apc_cache_slot_t** slot;
-	
-    zend_ulong h, s;
-
-	if (!cache) {
-		return 1;
-	}
-
-    /* calculate hash and slot */
-    apc_cache_hash_slot(cache, strkey, keylen, &h, &s);
+    apc_cache_table_t* table;
+    zend_ulong s;
 
-	/* lock cache */
-	APC_LOCK(cache->header);	
-	
 	/* find head */
-    slot = &cache->slots[s];
+    table = apc_cache_home(cache, h, &s);
+    slot = &table->slots[s];
 
     while (*slot) {
 		/* check for a match by hash and identifier */
-        if ((h == (*slot)->key.h) && 
+        if ((h == (*slot)->key.h) && ((*slot)->key.len == keylen) &&
             !memcmp((*slot)->key.str, strkey, keylen)) {
 			/* executing removal */
             apc_cache_remove_slot(
 				cache, slot TSRMLS_CC);
-			goto deleted;
+
+			/* reindex */
+			apc_cache_index_slot(table, s);
+
+			return 1;
         }
 		
 		/* continue locking */
 		slot = &(*slot)->next;      
     }
-	
-	/* unlock header */
-	APC_UNLOCK(cache->header);
-	
+
 	return 0;
+} /* }}} */
 
-deleted:
-	/* unlock deleted */
-	APC_UNLOCK(cache->header);
+/* {{{ apc_cache_delete */
+PHP_APCU_API zend_bool apc_cache_delete(apc_cache_t* cache, char *strkey, zend_uint keylen TSRMLS_DC)
+{
+    zend_bool result;
+    zend_ulong h;
 
-	return 1;
+	if (!cache) {
+		return 1;
+	}
+
+    /* calculate hash and slot */
+    apc_cache_hash_slot(cache, strkey, keylen, &h);
+
+	/* lock stripe */
+	APC_CACHE_WLOCK(APC_CACHE_STRIPE(cache, h));
+
+	result = apc_cache_unlink(cache, strkey, keylen, h TSRMLS_CC);
+
+	/* unlock stripe */
+	APC_CACHE_WUNLOCK(APC_CACHE_STRIPE(cache, h));
+
+	return result;
+}
+/* }}} */
+
+/* {{{ apc_cache_delete_many */
+PHP_APCU_API zend_uint apc_cache_delete_many(apc_cache_t* cache, apc_cache_batch_t* items, zend_uint nitems TSRMLS_DC)
+{
+	zend_bool* stripes;
+	zend_ulong* hashes;
+	zend_uint i, deleted = 0;
+
+	for (i = 0; i < nitems; i++) {
+		items[i].result = 0;
+	}
+
+	if (!cache || !nitems) {
+		return 0;
+	}
+
+	stripes = ecalloc(cache->nstripes, sizeof(zend_bool));
+	hashes = safe_emalloc(nitems, sizeof(zend_ulong), 0);
+
+	/* calculate hashes outside of the locks */
+	for (i = 0; i < nitems; i++) {
+		apc_cache_hash_slot(cache, items[i].str, items[i].len, &hashes[i]);
+
+		stripes[hashes[i] % cache->nstripes] = 1;
+	}
+
+	/* lock every stripe the batch touches at once */
+	apc_cache_wlock_some(cache, stripes TSRMLS_CC);
+
+	for (i = 0; i < nitems; i++) {
+		if ((items[i].result = apc_cache_unlink(cache, items[i].str, items[i].len, hashes[i] TSRMLS_CC))) {
+			deleted++;
+		}
+	}
+
+	apc_cache_wunlock_some(cache, stripes TSRMLS_CC);
+
+	efree(hashes);
+	efree(stripes);
+
+	return deleted;
 }
 /* }}} */
 
@@ -1339,7 +3379,7 @@ static APC_HOTSPOT zval* my_copy_zval(zval* dst, const zval* src, apc_context_t*
         zend_hash_index_update(&ctxt->copied, (ulong)src, (void**)&dst, sizeof(zval*), NULL);
     }
 
-    if(ctxt->copy == APC_COPY_OUT || ctxt->copy == APC_COPY_IN) {
+    if(ctxt->copy == APC_COPY_OUT || ctxt->copy == APC_COPY_IN || ctxt->copy == APC_COPY_MOVE) {
         /* deep copies are refcount(1), but moved up for recursive 
          * arrays,  which end up being add_ref'd during its copy. */
         Z_SET_REFCOUNT_P(dst, 1);
@@ -1388,6 +3428,12 @@ static APC_HOTSPOT zval* my_copy_zval(zval* dst, const zval* src, apc_context_t*
             dst = my_serialize_object(dst, src, ctxt TSRMLS_CC);
         } else if(ctxt->copy == APC_COPY_OUT) {
             dst = my_unserialize_object(dst, src, ctxt TSRMLS_CC);
+        } else if(ctxt->copy == APC_COPY_MOVE) {
+            /* already serialized */
+            dst->type = src->type;
+            CHECK(dst->value.str.val = apc_pmemcpy(src->value.str.val,
+                                                   src->value.str.len+1,
+                                                   pool TSRMLS_CC));
         }
         break;
 #ifdef ZEND_ENGINE_2_4
@@ -1483,6 +3529,9 @@ PHP_APCU_API apc_cache_entry_t* apc_cache_make_entry(apc_context_t* ctxt, apc_ca
 
     INIT_PZVAL(entry->val);
     entry->ttl = ttl;
+    entry->soft_ttl = 0;
+    entry->delta = 0;
+    entry->elected = 0;
     entry->ref_count = 0;
     entry->mem_size = 0;
     entry->pool = pool;
@@ -1518,6 +3567,22 @@ static zval* apc_cache_link_info(apc_cache_t *cache, apc_cache_slot_t* p TSRMLS_
 }
 /* }}} */
 
+/* {{{ apc_cache_sum_stats */
+static void apc_cache_sum_stats(apc_cache_t* cache, apc_cache_stats_t* stats)
+{
+	zend_uint i;
+
+	memset(stats, 0, sizeof(apc_cache_stats_t));
+
+	for (i = 0; i < APC_CACHE_STAT_SHARDS; i++) {
+		stats->nhits += cache->stats[i].nhits;
+		stats->nmisses += cache->stats[i].nmisses;
+		stats->ninserts += cache->stats[i].ninserts;
+		stats->nfiltered += cache->stats[i].nfiltered;
+	}
+}
+/* }}} */
+
 /* {{{ apc_cache_info */
 PHP_APCU_API zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_DC)
 {
@@ -1526,6 +3591,8 @@ PHP_APCU_API zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_D
     zval *gc = NULL;
     zval *slots = NULL;
     apc_cache_slot_t* p;
+    apc_cache_stats_t stats;
+    apc_cache_table_t* filter;
     zend_ulong i, j;
 
     if (!cache) {
@@ -1534,17 +3601,35 @@ PHP_APCU_API zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_D
 
     ALLOC_INIT_ZVAL(info);
 
-    /* read lock header */
-    APC_RLOCK(cache->header);
+    /* sum up the statistics */
+    apc_cache_sum_stats(cache, &stats);
+
+    /* read lock every stripe */
+    apc_cache_lock_stripes(cache, 0 TSRMLS_CC);
 
     array_init(info);
-    add_assoc_long(info, "num_slots", cache->nslots);
+    add_assoc_long(info, "num_slots", cache->header->table->nslots);
+    add_assoc_long(info, "num_stripes", cache->nstripes);
+    add_assoc_double(info, "num_resizes", (double)cache->header->nresizes);
+    add_assoc_bool(info, "inline_index", cache->header->table->buckets != NULL);
     add_assoc_long(info, "ttl", cache->ttl);
-    add_assoc_double(info, "num_hits", (double)cache->header->nhits);
-    add_assoc_double(info, "num_misses", (double)cache->header->nmisses);
-    add_assoc_double(info, "num_inserts", (double)cache->header->ninserts);
+    add_assoc_double(info, "num_hits", (double)stats.nhits);
+    add_assoc_double(info, "num_misses", (double)stats.nmisses);
+    add_assoc_double(info, "num_inserts", (double)stats.ninserts);
     add_assoc_long(info,   "num_entries", cache->header->nentries);
     add_assoc_double(info, "num_expunges", (double)cache->header->nexpunges);
+    add_assoc_double(info, "num_evictions", (double)cache->header->nevictions);
+    add_assoc_double(info, "num_compactions", (double)cache->header->ncompactions);
+    add_assoc_double(info, "compact_before", cache->header->compact_before);
+    add_assoc_double(info, "compact_after", cache->header->compact_after);
+    add_assoc_double(info, "num_filtered", (double)stats.nfiltered);
+    /* the filter that answers lookups, that of the old table until a resize is finished */
+    filter = cache->header->old ? cache->header->old : cache->header->table;
+    add_assoc_bool(info, "lookup_filter", filter->filter != NULL);
+    add_assoc_long(info, "filter_size", filter->nfilter);
+    /* every miss searches a chain without a filter */
+    add_assoc_double(info, "filter_fp_rate", filter->filter ?
+        pow(1.0 - exp(-(double) APC_CACHE_FILTER_HASHES * cache->header->nentries / filter->nfilter), APC_CACHE_FILTER_HASHES) : 1.0);
     add_assoc_long(info, "start_time", cache->header->stime);
     add_assoc_double(info, "mem_size", (double)cache->header->mem_size);
 
@@ -1567,8 +3652,14 @@ PHP_APCU_API zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_D
         ALLOC_INIT_ZVAL(slots);
         array_init(slots);
 
-        for (i = 0; i < cache->nslots; i++) {
-            p = cache->slots[i];
+        for (i = 0; i < apc_cache_nchains(cache); i++) {
+            apc_cache_slot_t** chain = apc_cache_chain(cache, i);
+
+            if (!chain) {
+                continue;
+            }
+
+            p = *chain;
             j = 0;
             for (; p != NULL; p = p->next) {
                 zval *link = apc_cache_link_info(cache, p TSRMLS_CC);
@@ -1584,18 +3675,20 @@ PHP_APCU_API zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_D
         ALLOC_INIT_ZVAL(gc);
         array_init(gc);
 
-        for (p = cache->header->gc; p != NULL; p = p->next) {
+        APC_RLOCK(cache->header);
+        for (p = cache->header->gc; p != NULL; p = p->gc_next) {
             zval *link = apc_cache_link_info(cache, p TSRMLS_CC);
             add_next_index_zval(gc, link);
         }
+        APC_RUNLOCK(cache->header);
         
         add_assoc_zval(info, "cache_list", list);
         add_assoc_zval(info, "deleted_list", gc);
         add_assoc_zval(info, "slot_distribution", slots);
     }
 	
-	/* unlock header */
-	APC_RUNLOCK(cache->header);
+	/* unlock every stripe */
+	apc_cache_unlock_stripes(cache, 0 TSRMLS_CC);
 
     return info;
 }
@@ -1609,23 +3702,26 @@ PHP_APCU_API zval* apc_cache_stat(apc_cache_t* cache,
                                   zend_uint keylen TSRMLS_DC) {
     zval *stat;
     apc_cache_slot_t** slot;
+    apc_cache_table_t* table;
 	zend_ulong h, s;
     
 	/* calculate hash and slot */
-	apc_cache_hash_slot(cache, strkey, keylen, &h, &s);
+	apc_cache_hash_slot(cache, strkey, keylen, &h);
 	
 	/* allocate stat buffer */
 	ALLOC_INIT_ZVAL(stat);
 
-    /* read lock header */
-	APC_RLOCK(cache->header);
+    /* read lock stripe */
+	APC_RLOCK(APC_CACHE_STRIPE(cache, h));
 
 	/* find head */
-	slot = &cache->slots[s];
+	table = apc_cache_home(cache, h, &s);
+	slot = &table->slots[s];
 
 	while (*slot) {
 		/* check for a matching key by has and identifier */
-	    if ((h == (*slot)->key.h) && !memcmp((*slot)->key.str, strkey, keylen)) {
+	    if ((h == (*slot)->key.h) && ((*slot)->key.len == keylen) &&
+			!memcmp((*slot)->key.str, strkey, keylen)) {
             array_init(stat);
             
             add_assoc_long(stat, "hits",  (*slot)->nhits);
@@ -1643,11 +3739,416 @@ PHP_APCU_API zval* apc_cache_stat(apc_cache_t* cache,
 	    slot = &(*slot)->next;		
 	}
     
-    APC_RUNLOCK(cache->header);
+    APC_RUNLOCK(APC_CACHE_STRIPE(cache, h));
     
     return stat;
 }
 
+/* {{{ apc_cache_lock_stripes */
+PHP_APCU_API void apc_cache_lock_stripes(apc_cache_t* cache, zend_bool exclusive TSRMLS_DC)
+{
+	zend_uint i;
+
+	/* always in ascending order, so that two callers cannot deadlock */
+	for (i = 0; i < cache->nstripes; i++) {
+		if (exclusive) {
+			APC_CACHE_WLOCK(&cache->stripes[i]);
+		} else {
+			APC_RLOCK(&cache->stripes[i]);
+		}
+	}
+}
+/* }}} */
+
+/* {{{ apc_cache_unlock_stripes */
+PHP_APCU_API void apc_cache_unlock_stripes(apc_cache_t* cache, zend_bool exclusive TSRMLS_DC)
+{
+	zend_uint i = cache->nstripes;
+
+	while (i--) {
+		if (exclusive) {
+			APC_CACHE_WUNLOCK(&cache->stripes[i]);
+		} else {
+			APC_RUNLOCK(&cache->stripes[i]);
+		}
+	}
+}
+/* }}} */
+
+/* {{{ apc_cache_enter */
+PHP_APCU_API void apc_cache_enter(apc_cache_t* cache TSRMLS_DC)
+{
+#ifndef ZTS
+	pid_t pid = getpid();
+#endif
+#ifdef APC_CACHE_OPTIMISTIC
+	zend_uint i;
+#endif
+
+	if (!cache) {
+		return;
+	}
+
+#ifdef APC_CACHE_OPTIMISTIC
+	/* register, unless already registered; the pointer may also have been inherited from the parent */
+	if (!cache->reader || cache->reader->owner != pid) {
+		cache->reader = NULL;
+
+		for (i = 0; i < APC_CACHE_MAX_READERS; i++) {
+			apc_cache_reader_t* reader = &cache->readers[i];
+			pid_t owner = reader->owner;
+
+			/* claim a free reader, or one whose owner has died */
+			if ((!owner || (owner != APC_CACHE_READER_RESET && kill(owner, 0) == -1 && errno == ESRCH)) &&
+				ATOMIC_CAS(reader->owner, owner, pid)) {
+				zend_uint nreaders;
+
+				/* raise the high water mark gc looks at */
+				while ((nreaders = cache->header->nreaders) <= i) {
+					if (ATOMIC_CAS(cache->header->nreaders, nreaders, i + 1)) {
+						break;
+					}
+				}
+
+				cache->reader = reader;
+				cache->shard = i % APC_CACHE_STAT_SHARDS;
+				break;
+			}
+		}
+	}
+
+	/* lookups announce an epoch for as long as they walk a chain, see apc_cache_announce */
+	if (cache->reader) {
+		return;
+	}
+
+	/* every reader is taken, this process takes the read lock */
+#endif
+
+#ifndef ZTS
+	/* threads select their shard as they count, processes select it here */
+	cache->shard = pid % APC_CACHE_STAT_SHARDS;
+#endif
+}
+/* }}} */
+
+/* {{{ apc_cache_leave */
+PHP_APCU_API void apc_cache_leave(apc_cache_t* cache TSRMLS_DC)
+{
+#ifdef APC_CACHE_OPTIMISTIC
+	if (!cache || !cache->reader) {
+		return;
+	}
+
+	/* free what lookups of this and other processes held back */
+	if (cache->header->gc || cache->header->retired) {
+		apc_cache_gc(cache TSRMLS_CC);
+	}
+#endif
+}
+/* }}} */
+
+/* {{{ apc_cache_stale
+ Note: the caller must hold the stripe lock for the slot */
+static zend_bool apc_cache_stale(apc_cache_t* cache, apc_cache_slot_t* slot, time_t t)
+{
+	return (slot->value->ttl && (time_t) (slot->ctime + slot->value->ttl) < t) ||
+	       (cache->ttl && (time_t) slot->atime < (t - (time_t) cache->ttl));
+} /* }}} */
+
+/* {{{ apc_cache_sweep */
+PHP_APCU_API void apc_cache_sweep(apc_cache_t* cache, zend_uint budget, zend_ulong usec TSRMLS_DC)
+{
+	struct timeval start, now;
+	zend_ulong visited;
+	zend_uint swept = 0;
+	time_t t;
+
+	if (!cache || !budget || apc_cache_busy(cache TSRMLS_CC)) {
+		return;
+	}
+
+	t = apc_time();
+	gettimeofday(&start, NULL);
+
+	/* no more than a revolution */
+	for (visited = 0; swept < budget && visited < apc_cache_nchains(cache); visited++) {
+		zend_ulong i;
+		apc_cache_slot_t** slot;
+		zend_bool stale = 0;
+
+		/* look at the clock every so often */
+		if (usec && visited && !(visited % APC_CACHE_SWEEP_CHECK)) {
+			gettimeofday(&now, NULL);
+
+			if ((zend_ulong) ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_usec - start.tv_usec)) >= usec) {
+				break;
+			}
+		}
+
+		/* claim the next chain, processes sweeping at the same time take turns */
+		i = (ATOMIC_INC(cache->header->sweeper) - 1) % apc_cache_nchains(cache);
+
+		/* look for stale slots under the read lock, the stripe of a chain is the same in every table */
+		APC_RLOCK(APC_CACHE_STRIPE(cache, i));
+		if (i < apc_cache_nchains(cache) && (slot = apc_cache_chain(cache, i))) {
+			for (; *slot && !stale; slot = &(*slot)->next) {
+				stale = apc_cache_stale(cache, *slot, t);
+			}
+		}
+		APC_RUNLOCK(APC_CACHE_STRIPE(cache, i));
+
+		if (!stale) {
+			continue;
+		}
+
+		/* remove them under the write lock */
+		APC_CACHE_WLOCK(APC_CACHE_STRIPE(cache, i));
+		if (i < apc_cache_nchains(cache) && (slot = apc_cache_chain(cache, i))) {
+			while (*slot && swept < budget) {
+				if (apc_cache_stale(cache, *slot, t)) {
+					apc_cache_remove_slot(cache, slot TSRMLS_CC);
+					swept++;
+					continue;
+				}
+
+				/* next */
+				slot = &(*slot)->next;
+			}
+
+			/* reindex */
+			apc_cache_index_chain(cache, i);
+		}
+		APC_CACHE_WUNLOCK(APC_CACHE_STRIPE(cache, i));
+	}
+}
+/* }}} */
+
+/* {{{ apc_cache_movable
+ returns true if a slot has a value that is only changed in place under the stripe lock, and memory that would coalesce with free memory if moved
+ Note: the caller must hold the stripe lock */
+static zend_bool apc_cache_movable(apc_cache_t* cache, apc_cache_slot_t* slot TSRMLS_DC)
+{
+	apc_cache_entry_t* entry = slot->value;
+	unsigned long i;
+	void* block;
+
+	/* scalars are updated atomically without the lock, a copy could miss an update; apc_cache_update moves the stripe version */
+	switch (Z_TYPE_P(entry->val)) {
+		case IS_STRING:
+		case IS_ARRAY:
+		case IS_OBJECT:
+			break;
+
+		default:
+			return 0;
+	}
+
+	for (i = 0; (block = apc_pool_block(entry->pool, i)); i++) {
+		if (apc_sma_api_movable(cache->sma, block TSRMLS_CC)) {
+			return 1;
+		}
+	}
+
+	return 0;
+} /* }}} */
+
+/* {{{ apc_cache_highest
+ returns the block of a pool that comes last in shared memory */
+static void* apc_cache_highest(apc_cache_t* cache, apc_pool* pool)
+{
+	void* highest = NULL;
+	void* block;
+	unsigned long i;
+
+	for (i = 0; (block = apc_pool_block(pool, i)); i++) {
+		if (!highest || apc_sma_api_lower(cache->sma, highest, block)) {
+			highest = block;
+		}
+	}
+
+	return highest;
+} /* }}} */
+
+/* {{{ apc_cache_copy_slot
+ makes a copy of a pinned slot in the lowest free memory that fits it, outside of any lock */
+static apc_cache_slot_t* apc_cache_copy_slot(apc_cache_t* cache, apc_cache_slot_t* p TSRMLS_DC)
+{
+	apc_context_t ctxt;
+	apc_cache_entry_t* entry;
+	apc_cache_slot_t* copy;
+	apc_cache_key_t key = p->key;
+
+	memset(&ctxt, 0, sizeof(apc_context_t));
+
+	/* the value is copied as it is stored, without serializing it again; the allocation never expunges */
+	if (!apc_cache_make_context_ex(&ctxt, cache->serializer,
+			(apc_malloc_t) cache->sma->malloc_low, cache->sma->sfree, cache->sma->protect, cache->sma->unprotect,
+			APC_SMALL_POOL, APC_COPY_MOVE, 0 TSRMLS_CC)) {
+		return NULL;
+	}
+
+	if ((entry = apc_cache_make_entry(&ctxt, &key, p->value->val, p->value->ttl TSRMLS_CC))) {
+		entry->soft_ttl = p->value->soft_ttl;
+		entry->delta = p->value->delta;
+		entry->elected = p->value->elected;
+
+		if ((copy = make_slot(cache, &key, entry, NULL, p->ctime TSRMLS_CC))) {
+			copy->nhits = p->nhits;
+			copy->atime = p->atime;
+			copy->referenced = p->referenced;
+
+			/* set value size from pool size */
+			entry->mem_size = ctxt.pool->size;
+
+			/* whatever the value needs later comes from wherever memory is free */
+			ctxt.pool->allocate = (apc_malloc_t) cache->sma->smalloc;
+
+			return copy;
+		}
+	}
+
+	apc_cache_destroy_context(&ctxt TSRMLS_CC);
+
+	return NULL;
+} /* }}} */
+
+/* {{{ apc_cache_move_slot
+ replaces a pinned slot with a copy further down in memory, returns false if the copy did not land further down,
+ or the stripe changed since it was at version
+ Note: version is moved on past the change this makes */
+static zend_bool apc_cache_move_slot(apc_cache_t* cache, apc_cache_slot_t* old, zend_ulong* version TSRMLS_DC)
+{
+	apc_cache_stripe_t* stripe = APC_CACHE_STRIPE(cache, old->key.h);
+	apc_cache_slot_t* copy;
+	apc_cache_slot_t** slot;
+	apc_cache_table_t* table;
+	zend_ulong s;
+	zend_bool moved = 0;
+
+	/* copy before locking, the copy is as large as the value */
+	if (!(copy = apc_cache_copy_slot(cache, old TSRMLS_CC))) {
+		return 0;
+	}
+
+	APC_CACHE_WLOCK(stripe);
+
+	/* the slot may have gone, or its value been changed in place by apc_cache_update, while it was copied;
+	   and a copy that does not end before the value does would only move the hole it leaves */
+	if (stripe->version != *version + 1 ||
+		!apc_sma_api_lower(cache->sma,
+			apc_cache_highest(cache, copy->value->pool), apc_cache_highest(cache, old->value->pool))) {
+		slot = NULL;
+	} else {
+		table = apc_cache_home(cache, old->key.h, &s);
+
+		for (slot = &table->slots[s]; *slot && *slot != old; slot = &(*slot)->next);
+	}
+
+	if (slot && *slot) {
+		/* link the copy in place, old->next is left alone so that readers inside the chain can carry on */
+		copy->next = old->next;
+		MEMORY_BARRIER();
+		*slot = copy;
+
+		/* copies held by processes name the old slot */
+		APC_CACHE_TOUCH(cache, old->key.h);
+
+		/* the copy expires when the slot would have */
+		if (old->timer_prev) {
+			apc_cache_timer_remove(cache, old TSRMLS_CC);
+			apc_cache_timer_add(cache, copy TSRMLS_CC);
+		}
+
+		ATOMIC_ADD(cache->header->mem_size, copy->value->mem_size);
+		ATOMIC_SUB(cache->header->mem_size, old->value->mem_size);
+
+		/* reindex */
+		apc_cache_index_slot(table, s);
+
+		apc_cache_retire_slot(cache, old TSRMLS_CC);
+
+		moved = 1;
+	}
+
+	APC_CACHE_WUNLOCK(stripe);
+
+	if (moved) {
+		*version += 2;
+	} else {
+		free_slot(copy TSRMLS_CC);
+	}
+
+	return moved;
+} /* }}} */
+
+/* {{{ apc_cache_compact */
+PHP_APCU_API zend_uint apc_cache_compact(apc_cache_t* cache, zend_uint budget TSRMLS_DC)
+{
+	apc_cache_slot_t* pinned[APC_CACHE_COMPACT_BATCH];
+	zend_ulong visited;
+	zend_uint moved = 0;
+	double before;
+	time_t t;
+
+	if (!cache || !budget || apc_cache_busy(cache TSRMLS_CC)) {
+		return 0;
+	}
+
+	/* nothing to gain while free memory is mostly in one piece */
+	before = apc_sma_api_fragmentation(cache->sma TSRMLS_CC);
+	if (before < APC_CACHE_COMPACT_RATIO) {
+		return 0;
+	}
+
+	t = apc_time();
+
+	for (visited = 0; moved < budget && visited < apc_cache_nchains(cache) && visited < APC_CACHE_COMPACT_CHAINS; visited++) {
+		zend_ulong i;
+		apc_cache_slot_t** slot;
+		zend_uint npinned = 0;
+		zend_uint n;
+		zend_ulong version;
+
+		/* claim the next chain, processes compacting at the same time take turns */
+		i = (ATOMIC_INC(cache->header->compactor) - 1) % apc_cache_nchains(cache);
+
+		/* pin the slots worth moving under the read lock, the stripe of a chain is the same in every table */
+		APC_RLOCK(APC_CACHE_STRIPE(cache, i));
+		version = APC_CACHE_STRIPE(cache, i)->version;
+		if (i < apc_cache_nchains(cache) && (slot = apc_cache_chain(cache, i))) {
+			for (; *slot && npinned < APC_CACHE_COMPACT_BATCH && (moved + npinned) < budget; slot = &(*slot)->next) {
+				if (!apc_cache_stale(cache, *slot, t) && apc_cache_movable(cache, *slot TSRMLS_CC)) {
+					ATOMIC_INC((*slot)->value->ref_count);
+					pinned[npinned++] = *slot;
+				}
+			}
+		}
+		APC_RUNLOCK(APC_CACHE_STRIPE(cache, i));
+
+		for (n = 0; n < npinned; n++) {
+			if (apc_cache_move_slot(cache, pinned[n], &version TSRMLS_CC)) {
+				moved++;
+			}
+
+			/* a moved slot is on the gc list, and goes once nobody holds it */
+			ATOMIC_DEC(pinned[n]->value->ref_count);
+		}
+	}
+
+	if (moved) {
+		/* the memory moved from is only free once the slots that held it go */
+		apc_cache_gc(cache TSRMLS_CC);
+
+		cache->header->compact_before = before;
+		cache->header->compact_after = apc_sma_api_fragmentation(cache->sma TSRMLS_CC);
+		ATOMIC_ADD(cache->header->ncompactions, moved);
+	}
+
+	return moved;
+}
+/* }}} */
+
 /* {{{ apc_cache_busy */
 PHP_APCU_API zend_bool apc_cache_busy(apc_cache_t* cache TSRMLS_DC)
 {	
@@ -38,6 +38,47 @@ typedef void*** apc_cache_owner_t;
 typedef pid_t apc_cache_owner_t;
 #endif /* }}} */
 
+/* {{{ readers that do not lock are only supported where processes can be told apart by pid */
+#if !defined(ZTS) && !defined(PHP_WIN32)
+# define APC_CACHE_OPTIMISTIC 1
+#endif
+#define APC_CACHE_MAX_READERS 256 /* }}} */
+
+/* {{{ number of slots a bucket of the inline index describes */
+#define APC_CACHE_BUCKET_WAYS 3 /* }}} */
+
+/* {{{ number of shards the statistics counters are spread over */
+#define APC_CACHE_STAT_SHARDS 32 /* }}} */
+
+/* {{{ number of keys whose values can be generated at the same time, see apc_cache_entry */
+#define APC_CACHE_INFLIGHT 64 /* }}} */
+
+/* {{{ state of an in-flight marker, one word so that it is claimed, taken over and released by a single
+   compare and swap: the high bits hold a tag of the marked key, 0 while the marker is free, and the low
+   APC_CACHE_TICKET_BITS a ticket advanced on every change */
+#define APC_CACHE_TICKET_BITS   (sizeof(zend_ulong) * 2)
+#define APC_CACHE_TICKET_MASK   ((((zend_ulong) 1) << APC_CACHE_TICKET_BITS) - 1)
+#define APC_CACHE_INFLIGHT_TAG(h) \
+	(((h) & ~APC_CACHE_TICKET_MASK) ? ((h) & ~APC_CACHE_TICKET_MASK) : (APC_CACHE_TICKET_MASK + 1))
+#define APC_CACHE_INFLIGHT_NEXT(state, tag) \
+	((tag) | (((state) + 1) & APC_CACHE_TICKET_MASK)) /* }}} */
+
+/* {{{ shape of the negative lookup filter, a counting bloom filter of APC_CACHE_FILTER_LOAD counters
+   for each slot of the table it belongs to, each key counted in APC_CACHE_FILTER_HASHES of them;
+   counters are a byte each and saturate at APC_CACHE_FILTER_MAX */
+#define APC_CACHE_FILTER_LOAD   8
+#define APC_CACHE_FILTER_HASHES 3
+#define APC_CACHE_FILTER_MAX    0xFF /* }}} */
+
+/* {{{ number of modification generations, keys share them by hash, see apc_cache_fetch_l1 */
+#define APC_CACHE_GENERATIONS 4096 /* }}} */
+
+/* {{{ shape of the expiry wheel, each level has 2^BITS spokes of 2^(BITS*level) seconds */
+#define APC_CACHE_WHEEL_LEVELS 4
+#define APC_CACHE_WHEEL_BITS   6
+#define APC_CACHE_WHEEL_SPOKES (1 << APC_CACHE_WHEEL_BITS)
+#define APC_CACHE_WHEEL_MASK   (APC_CACHE_WHEEL_SPOKES - 1) /* }}} */
+
 /* {{{ struct definition: apc_cache_key_t */
 typedef struct apc_cache_key_t apc_cache_key_t;
 struct apc_cache_key_t {
@@ -53,6 +94,9 @@ typedef struct apc_cache_entry_t apc_cache_entry_t;
 struct apc_cache_entry_t {
     zval *val;                    /* the zval copied at store time */
     zend_uint ttl;                /* the ttl on this specific entry */
+    zend_uint soft_ttl;           /* the time after which the entry is stale, but still served */
+    zend_uint delta;              /* milliseconds it took to generate the value, 0 if unknown */
+    volatile zend_ulong elected;  /* time a caller was elected to refresh the value */
     int ref_count;                /* the reference count of this entry */
     size_t mem_size;              /* memory used */
     apc_pool *pool;               /* pool which allocated the value */
@@ -65,45 +109,206 @@ struct apc_cache_slot_t {
     apc_cache_key_t key;        /* slot key */
     apc_cache_entry_t* value;   /* slot value */
     apc_cache_slot_t* next;     /* next slot in linked list */
+    apc_cache_slot_t* gc_next;  /* next slot in gc list, next is left intact for readers */
+    zend_ulong epoch;           /* epoch slot was removed in */
     zend_ulong nhits;           /* number of hits to this slot */
     time_t ctime;               /* time slot was initialized */
     time_t dtime;               /* time slot was removed from cache */
     time_t atime;               /* time slot was last accessed */
+    volatile zend_bool referenced; /* fetched since the eviction clock last passed over the slot */
+    apc_cache_slot_t* timer_next;  /* next slot on the same spoke of the expiry wheel */
+    apc_cache_slot_t** timer_prev; /* the link to this slot on its spoke, NULL when not on the wheel */
+};
+/* }}} */
+
+/* {{{ struct definition: apc_cache_lookup_t
+   a key of a batched lookup, see apc_cache_find_many */
+typedef struct apc_cache_lookup_t apc_cache_lookup_t;
+struct apc_cache_lookup_t {
+    char* str;                  /* the key */
+    zend_uint len;              /* length of the key, including the terminating null */
+    zend_ulong h;               /* hash of the key, set by apc_cache_find_many */
+    apc_cache_slot_t* slot;     /* the slot found, used by apc_cache_find_many */
+    apc_cache_entry_t* value;   /* the entry found, NULL on a miss */
+    zend_bool refresh;          /* the caller is elected to refresh the entry */
+};
+/* }}} */
+
+/* {{{ struct definition: apc_cache_batch_t
+   an item of a batched store or delete, see apc_cache_store_many and apc_cache_delete_many */
+typedef struct apc_cache_batch_t apc_cache_batch_t;
+struct apc_cache_batch_t {
+    char* str;                  /* the key */
+    zend_uint len;              /* length of the key, including the terminating null */
+    const zval* val;            /* the value to store, unused by apc_cache_delete_many */
+    zend_bool result;           /* the item was stored or deleted */
+    apc_cache_slot_t* slot;     /* the slot made for the item, used by apc_cache_store_many */
+    apc_context_t ctxt;         /* the context the slot was made in, used by apc_cache_store_many */
 };
 /* }}} */
 
+/* {{{ flags for apc_cache_find_many */
+#define APC_CACHE_FIND_ELECT 0x00000001 /* elect callers to refresh entries, as apc_cache_find_ex */
+#define APC_CACHE_FIND_PEEK  0x00000002 /* do not count hits or touch entries, as apc_cache_exists */ /* }}} */
+
 /* {{{ state constants */
 #define APC_CACHE_ST_NONE  0
 #define APC_CACHE_ST_BUSY  0x00000001 /* }}} */
 
+/* {{{ eviction policies, see apc_cache_default_expunge */
+#define APC_CACHE_EVICT_EXPUNGE 0
+#define APC_CACHE_EVICT_CLOCK   1 /* }}} */
+
+/* {{{ struct definition: apc_cache_stripe_t
+   A stripe lock protects the chains of every slot s where (s % nstripes) is the index of the stripe.
+   The version is odd while a writer is changing the chains, readers that do not lock use it to
+   detect that they interleaved with a writer.
+   Stripes are padded so that processes working in different stripes do not share a line */
+typedef struct _apc_cache_stripe_t {
+    volatile zend_ulong version;     /* stripe version */
+    apc_lock_t lock;                 /* stripe lock */
+    APC_CACHE_LINE_PADDING(sizeof(zend_ulong) + sizeof(apc_lock_t));
+} apc_cache_stripe_t; /* }}} */
+
+/* {{{ struct definition: apc_cache_reader_t
+   A process registered to walk chains without locking, see apc_cache_enter.
+   While the owner walks a chain it announces the epoch it started in, a removed slot
+   is not free'd until every reader has announced a later epoch or finished, see apc_cache_gc */
+typedef struct _apc_cache_reader_t {
+    volatile zend_ulong epoch;       /* announced epoch, 0 between lookups */
+    apc_cache_owner_t owner;         /* the registered context */
+    APC_CACHE_LINE_PADDING(sizeof(zend_ulong) + sizeof(apc_cache_owner_t));
+} apc_cache_reader_t; /* }}} */
+
+/* {{{ struct definition: apc_cache_bucket_t
+   The inline index keeps a bucket for every chain, holding the hash, key length and address
+   of the first slots in the chain, so that a lookup compares keys in one line instead of chasing
+   a pointer for each slot; a miss on a chain of no more than APC_CACHE_BUCKET_WAYS slots costs
+   nothing else. On LP64 a bucket is exactly one line */
+typedef struct _apc_cache_bucket_t {
+    zend_ulong h[APC_CACHE_BUCKET_WAYS];             /* hash of each key */
+    apc_cache_slot_t* slot[APC_CACHE_BUCKET_WAYS];   /* the slot of each key */
+    zend_uint len[APC_CACHE_BUCKET_WAYS];            /* length of each key */
+    zend_uint count;                                 /* number of slots in the chain */
+} apc_cache_bucket_t; /* }}} */
+
+/* {{{ struct definition: apc_cache_table_t
+   The slots of the cache, and their inline index. Tables are allocated from the cache's
+   shared memory and grow by doubling, see apc_cache_chain */
+typedef struct _apc_cache_table_t {
+    zend_ulong nslots;               /* number of slots */
+    apc_cache_slot_t** slots;        /* array of slots */
+    apc_cache_bucket_t* buckets;     /* inline index over the slots, if any */
+    volatile zend_uint* filter;      /* counters of the negative lookup filter, four to a word, if any */
+    zend_ulong nfilter;              /* number of counters in the filter, a power of two */
+} apc_cache_table_t; /* }}} */
+
+/* {{{ struct definition: apc_cache_stats_t
+   A shard of the statistics counters, processes count in their own shard so that
+   a fetch does not write to a line every other process writes to.
+   The shards are only summed up when the statistics are read, see apc_cache_info */
+typedef struct _apc_cache_stats_t {
+    volatile zend_ulong nhits;       /* hit count */
+    volatile zend_ulong nmisses;     /* miss count */
+    volatile zend_ulong ninserts;    /* insert count */
+    volatile zend_ulong nfiltered;   /* misses the filter answered without searching */
+    APC_CACHE_LINE_PADDING(4 * sizeof(zend_ulong));
+} apc_cache_stats_t; /* }}} */
+
+/* {{{ struct definition: apc_cache_inflight_t
+   Marks a key whose value is being generated by apc_cache_entry, so that other processes missing
+   the same key wait for the value instead of generating it again. Keys are marked at hash modulo
+   APC_CACHE_INFLIGHT, a key that finds another key marked there generates without waiting */
+typedef struct _apc_cache_inflight_t {
+    volatile zend_ulong state;          /* tag of the marked key and ticket, see APC_CACHE_INFLIGHT_TAG */
+    volatile apc_cache_owner_t owner;   /* the context generating the value, written once the marker is claimed */
+} apc_cache_inflight_t; /* }}} */
+
+/* {{{ struct definition: apc_cache_wheel_t
+   Slots with a ttl are hung on the spoke of a hierarchical timer wheel for the second they expire in,
+   so that expiring entries costs in proportion to the number of entries that expire rather than the
+   size of the cache. The first level has a spoke per second, the spokes of each following level
+   span all of the previous level, and are cascaded down as the wheel turns, see apc_cache_expire */
+typedef struct _apc_cache_wheel_t {
+    apc_lock_t lock;                 /* wheel lock, taken after a stripe lock */
+    time_t now;                      /* the next second to expire */
+    zend_ulong ntimers;              /* number of slots on the wheel */
+    apc_cache_slot_t* spokes[APC_CACHE_WHEEL_LEVELS][APC_CACHE_WHEEL_SPOKES];
+    apc_cache_slot_t* overflow;      /* slots expiring beyond the last level */
+} apc_cache_wheel_t; /* }}} */
+
 /* {{{ struct definition: apc_cache_header_t
    Any values that must be shared among processes should go in here. */
 typedef struct _apc_cache_header_t {
-    apc_lock_t lock;                 /* header lock */
-    zend_ulong nhits;                /* hit count */
-    zend_ulong nmisses;              /* miss count */
-    zend_ulong ninserts;             /* insert count */
+    apc_lock_t lock;                 /* header lock (protects gc list) */
     zend_ulong nexpunges;            /* expunge count */
     zend_ulong nentries;             /* entry count */
     zend_ulong mem_size;             /* used */
     time_t stime;                    /* start time */
     zend_ushort state;               /* cache state */
     apc_cache_key_t lastkey;         /* last key inserted (not necessarily without error) */
-    apc_cache_slot_t* gc;            /* gc list */
+    apc_cache_slot_t* gc;            /* gc list, in order of removal */
+    apc_cache_slot_t* gc_tail;       /* last slot in gc list */
+    volatile zend_ulong epoch;       /* current epoch, advanced whenever a slot is removed */
+    zend_uint nreaders;              /* highest registered reader + 1 */
+    apc_cache_table_t* table;        /* the table */
+    apc_cache_table_t* old;          /* the table being migrated from, while resizing */
+    volatile zend_ulong cursor;      /* next slot of the old table to migrate */
+    volatile zend_ulong moved;       /* number of slots of the old table migrated */
+    apc_cache_table_t* retired;      /* a table migrated from, waiting to be free'd */
+    zend_ulong retired_epoch;        /* epoch the table was retired in */
+    zend_ulong nresizes;             /* resize count */
+    time_t resize_failed;            /* last time a larger table did not fit, resizes wait a second after */
+    zend_ulong hand;                 /* next chain the eviction clock visits */
+    zend_ulong nevictions;           /* eviction count */
+    apc_cache_wheel_t wheel;         /* expiry wheel */
+    volatile zend_ulong sweeper;     /* next chain to sweep, see apc_cache_sweep */
+    volatile zend_ulong compactor;   /* next chain to compact, see apc_cache_compact */
+    volatile zend_ulong ncompactions; /* entries moved by compaction */
+    double compact_before;           /* fragmentation of shared memory before the last compaction */
+    double compact_after;            /* fragmentation of shared memory after it */
 } apc_cache_header_t; /* }}} */
 
+/* {{{ struct definition: apc_cache_l1_entry_t
+   a value copied into the memory of this process, valid while the generation of its key holds */
+typedef struct _apc_cache_l1_entry_t {
+    zend_ulong gen;               /* generation of the key when the value was copied */
+    apc_cache_slot_t* slot;       /* the slot the value was copied from, linked while the generation holds */
+    apc_pool* pool;               /* process memory the value was copied into */
+    zval* val;                    /* the copied value */
+} apc_cache_l1_entry_t; /* }}} */
+
+/* {{{ struct definition: apc_cache_l1_t
+   the cache in front of shared memory local to this process, see apc_cache_fetch_l1 */
+typedef struct _apc_cache_l1_t {
+    HashTable entries;            /* apc_cache_l1_entry_t by key, oldest first */
+    zend_ulong max_entries;       /* most entries held */
+    size_t max_size;              /* most memory held */
+    size_t size;                  /* memory held */
+} apc_cache_l1_t; /* }}} */
+
 /* {{{ struct definition: apc_cache_t */
 typedef struct _apc_cache_t {
     void* shmaddr;                /* process (local) address of shared cache */
     apc_cache_header_t* header;   /* cache header (stored in SHM) */
-    apc_cache_slot_t** slots;     /* array of cache slots (stored in SHM) */
+    apc_cache_stripe_t* stripes;  /* array of stripe locks (stored in SHM) */
+    apc_cache_reader_t* readers;  /* array of registered readers (stored in SHM) */
+    apc_cache_reader_t* reader;   /* the registration of this process, if any */
+    apc_cache_stats_t* stats;     /* array of statistics shards (stored in SHM) */
+    apc_cache_inflight_t* inflight; /* array of in-flight markers (stored in SHM) */
+    volatile zend_ulong* gens;    /* modification generations of keys by hash (stored in SHM) */
+    apc_cache_l1_t* l1;           /* the cache local to this process, NULL if disabled */
+    zend_uint shard;              /* the statistics shard of this process */
+    time_t probed;                /* last time gc checked that readers holding it back are alive */
     apc_sma_t* sma;               /* shared memory allocator */
     apc_serializer_t* serializer; /* serializer */
-    zend_ulong nslots;            /* number of slots in cache */
+    zend_uint nstripes;           /* number of stripe locks over the slots */
     zend_ulong gc_ttl;            /* maximum time on GC list for a slot */
     zend_ulong ttl;               /* if slot is needed and entry's access time is older than this ttl, remove it */
     zend_ulong smart;             /* smart parameter for gc */
     zend_bool defend;             /* defense parameter for runtime */
+    zend_uint policy;             /* eviction policy */
+    zend_ulong headroom;          /* memory evicted beyond what an allocation needs */
 } apc_cache_t; /* }}} */
 
 /* {{{ typedef: apc_cache_updater_t */
@@ -120,8 +325,8 @@ typedef zend_bool (*apc_cache_updater_t)(apc_cache_t*, apc_cache_entry_t*, void*
  * PHP serializers, or search the list of serializers for the preferred serializer
  *
  * size_hint is a "hint" at the total number entries that will be expected. 
- * It determines the physical size of the hash table. Passing 0 for
- * this argument will use a reasonable default value
+ * It determines the initial size of the hash table, which grows as entries
+ * are added. Passing 0 for this argument will use a reasonable default value
  * 
  * gc_ttl is the maximum time a cache entry may speed on the garbage
  * collection list. This is basically a work around for the inherent
@@ -134,6 +339,20 @@ typedef zend_bool (*apc_cache_updater_t)(apc_cache_t*, apc_cache_entry_t*, void*
  * for an explanation of smart, see apc_cache_default_expunge
  *
  * defend enables/disables slam defense for this particular cache
+ *
+ * stripes is the number of locks the slots are divided between, operations on
+ * keys in different stripes do not contend with one another. Passing 0 for
+ * this argument will use a single lock
+ *
+ * indexed enables the inline index, which makes lookups cheaper at the cost of
+ * a line of shared memory per slot
+ *
+ * filtered enables the negative lookup filter, which answers most misses without
+ * searching a chain at the cost of APC_CACHE_FILTER_LOAD bytes of shared memory per slot
+ *
+ * policy is the eviction policy applied when memory runs out, APC_CACHE_EVICT_CLOCK
+ * evicts the entries least recently used until the allocation and headroom more bytes fit,
+ * APC_CACHE_EVICT_EXPUNGE keeps the old behaviour of trashing the whole cache
  */
 PHP_APCU_API apc_cache_t* apc_cache_create(apc_sma_t* sma,
                                            apc_serializer_t* serializer,
@@ -141,7 +360,49 @@ PHP_APCU_API apc_cache_t* apc_cache_create(apc_sma_t* sma,
                                            int gc_ttl,
                                            int ttl,
                                            long smart,
-                                           zend_bool defend TSRMLS_DC);
+                                           zend_bool defend,
+                                           int stripes,
+                                           zend_bool indexed,
+                                           zend_bool filtered,
+                                           int policy,
+                                           zend_ulong headroom TSRMLS_DC);
+/*
+* apc_cache_enter registers the current process as a reader of the cache which does not lock,
+* lookups announce an epoch only while they walk a chain
+*
+* This function should be called by each process before it makes requests of the cache, for
+* APCu this happens on RINIT; processes that are not registered take the read lock
+*/
+PHP_APCU_API void apc_cache_enter(apc_cache_t* cache TSRMLS_DC);
+
+/*
+* apc_cache_leave frees the removed slots that no lookup holds anymore
+*
+* This function should be called by each process after it made its requests of the cache, for
+* APCu this happens on RSHUTDOWN
+*/
+PHP_APCU_API void apc_cache_leave(apc_cache_t* cache TSRMLS_DC);
+
+/*
+* apc_cache_sweep removes up to budget expired entries, spending no more than usec microseconds
+* looking for them (0 for no limit)
+*
+* Processes sweep from a cursor shared in the header, each picking up where the last stopped, so
+* that memory is returned steadily rather than by expunge. APCu sweeps on RSHUTDOWN
+*/
+PHP_APCU_API void apc_cache_sweep(apc_cache_t* cache, zend_uint budget, zend_ulong usec TSRMLS_DC);
+
+/*
+* apc_cache_compact moves up to budget entries whose memory separates free blocks into the lowest free
+* memory that fits them, so that the free blocks coalesce and free memory gathers at the end of the
+* segments; it does nothing while shared memory is not fragmented, and returns the number of entries moved
+*
+* Entries are copied as they are stored, the old copy is retired like a removed slot; a copy that does
+* not land before the entry is dropped. Processes compact from a cursor shared in the header, APCu
+* compacts on RSHUTDOWN and in apcu_compact
+*/
+PHP_APCU_API zend_uint apc_cache_compact(apc_cache_t* cache, zend_uint budget TSRMLS_DC);
+
 /*
 * apc_cache_preload preloads the data at path into the specified cache
 */
@@ -220,8 +481,39 @@ PHP_APCU_API zend_bool apc_cache_store(apc_cache_t* cache,
                                        const zval *val,
                                        const zend_uint ttl,
                                        const zend_bool exclusive TSRMLS_DC);
+
+/*
+ * apc_cache_store_ex stores val like apc_cache_store, the entry goes stale soft_ttl seconds
+ * after it is stored (0 for never), delta is the number of milliseconds it took to generate
+ * val (0 if unknown), see apc_cache_find_ex
+ */
+PHP_APCU_API zend_bool apc_cache_store_ex(apc_cache_t* cache,
+                                          char *strkey,
+                                          zend_uint keylen,
+                                          const zval *val,
+                                          const zend_uint ttl,
+                                          const zend_uint soft_ttl,
+                                          const zend_uint delta,
+                                          const zend_bool exclusive TSRMLS_DC);
+
+/*
+ * apc_cache_store_many stores every item of a batch like apc_cache_store_ex, and returns the
+ * number of items stored, setting the result of each. Entries are made before any lock is taken,
+ * then every stripe the batch touches is write locked at once to link them in, so the batch
+ * becomes visible at once, and deleted entries are collected once for the batch.
+ *
+ * An atomic batch is stored entirely or not at all: if any entry cannot be made, or an exclusive
+ * batch finds any key that has not expired, nothing is stored.
+ */
+PHP_APCU_API zend_uint apc_cache_store_many(apc_cache_t* cache,
+                                            apc_cache_batch_t* items,
+                                            zend_uint nitems,
+                                            const zend_uint ttl,
+                                            const zend_uint soft_ttl,
+                                            const zend_bool exclusive,
+                                            const zend_bool atomic TSRMLS_DC);
 /*
-* apc_cache_update updates an entry in place, this is used for rfc1867 and inc/dec/cas
+* apc_cache_update updates an entry in place, this is used for rfc1867
 */
 PHP_APCU_API zend_bool apc_cache_update(apc_cache_t* cache,
                                         char *strkey,
@@ -229,16 +521,64 @@ PHP_APCU_API zend_bool apc_cache_update(apc_cache_t* cache,
                                         apc_cache_updater_t updater,
                                         void* data TSRMLS_DC);
 
+/*
+* apc_cache_update_atomic updates an entry in place like apc_cache_update, without the write lock:
+* the entry is only pinned, as apc_cache_find does, so other processes may be reading or updating
+* it at the same time, and the updater must change the value with atomic operations alone.
+* This is used for inc/dec/cas on IS_LONG values
+*
+* When init is set, a missing or expired entry is created from init with the given ttl, and
+* updated before it is linked in, so that creating and updating it is a single operation
+*/
+PHP_APCU_API zend_bool apc_cache_update_atomic(apc_cache_t* cache,
+                                               char *strkey,
+                                               zend_uint keylen,
+                                               apc_cache_updater_t updater,
+                                               void* data,
+                                               const zval* init,
+                                               const zend_uint ttl TSRMLS_DC);
+
 /*
  * apc_cache_find searches for a cache entry by its hashed identifier,
  * and returns a pointer to the entry if found, NULL otherwise.
  *
+ * Registered processes find entries without locking, the stripe is only
+ * read locked if writers keep interleaving with the search.
  */
 PHP_APCU_API apc_cache_entry_t* apc_cache_find(apc_cache_t* cache,
                                                char* strkey,
                                                zend_uint keylen,
                                                time_t t TSRMLS_DC);
 
+/*
+ * apc_cache_find_ex searches like apc_cache_find, and sets refresh when the caller is elected
+ * to refresh the entry: once it is stale, a single caller is elected while every caller is
+ * still served the stale entry. Where the time it took to generate the entry is known, a caller
+ * may be elected before then, with a probability that rises as expiry nears, scaled by beta
+ * (0 disables early refresh)
+ */
+PHP_APCU_API apc_cache_entry_t* apc_cache_find_ex(apc_cache_t* cache,
+                                                  char* strkey,
+                                                  zend_uint keylen,
+                                                  time_t t,
+                                                  double beta,
+                                                  zend_bool* refresh TSRMLS_DC);
+
+/*
+ * apc_cache_find_many searches for every key in keys like apc_cache_find, and returns the number of
+ * keys found. The keys are hashed and their chains prefetched before any stripe is visited, and
+ * every stripe is visited once for all of its keys.
+ *
+ * The entry of every key found is set in its value, and the caller must release each one with
+ * apc_cache_release; copying values out should be left until after this returns.
+ */
+PHP_APCU_API zend_uint apc_cache_find_many(apc_cache_t* cache,
+                                           apc_cache_lookup_t* keys,
+                                           zend_uint nkeys,
+                                           time_t t,
+                                           double beta,
+                                           int flags TSRMLS_DC);
+
 /*
  * apc_cache_fetch fetches an entry from the cache directly into dst
  *
@@ -249,6 +589,39 @@ PHP_APCU_API zend_bool apc_cache_fetch(apc_cache_t* cache,
                                        time_t t,
                                        zval **dst TSRMLS_DC);
 
+/*
+ * apc_cache_fetch_ex fetches like apc_cache_fetch, see apc_cache_find_ex for refresh
+ */
+PHP_APCU_API zend_bool apc_cache_fetch_ex(apc_cache_t* cache,
+                                          char* strkey,
+                                          zend_uint keylen,
+                                          time_t t,
+                                          double beta,
+                                          zend_bool* refresh,
+                                          zval **dst TSRMLS_DC);
+
+/*
+ * apc_cache_l1 enables the cache local to this process, holding at most entries values in at most
+ * size bytes, see apc_cache_fetch_l1. It is only available where processes register as readers,
+ * and should be called once per process, before any fetch
+ */
+PHP_APCU_API void apc_cache_l1(apc_cache_t* cache,
+                               zend_ulong entries,
+                               size_t size TSRMLS_DC);
+
+/*
+ * apc_cache_fetch_l1 fetches like apc_cache_fetch, through the cache local to this process:
+ * values fetched from shared memory are copied into process memory as well, and later fetches
+ * copy them out from there, for as long as the modification generation of the key, which every
+ * change to the key bumps, is the one they were copied at. Values that expire are not held,
+ * and without a local cache this is apc_cache_fetch
+ */
+PHP_APCU_API zend_bool apc_cache_fetch_l1(apc_cache_t* cache,
+                                          char* strkey,
+                                          zend_uint keylen,
+                                          time_t t,
+                                          zval *dst TSRMLS_DC);
+
 /*
  * apc_cache_exists searches for a cache entry by its hashed identifier,
  * and returns a pointer to the entry if found, NULL otherwise.  This is a
@@ -268,6 +641,37 @@ PHP_APCU_API zend_bool apc_cache_delete(apc_cache_t* cache,
                                         char *strkey,
                                         zend_uint keylen TSRMLS_DC);
 
+/*
+ * apc_cache_delete_many deletes every item of a batch, with every stripe the batch touches write
+ * locked at once, and returns the number of items deleted, setting the result of each
+ */
+PHP_APCU_API zend_uint apc_cache_delete_many(apc_cache_t* cache,
+                                             apc_cache_batch_t* items,
+                                             zend_uint nitems TSRMLS_DC);
+
+/*
+ * apc_cache_entry fetches an entry from the cache directly into return_value, on a miss
+ * it calls the generator with the key, and stores and returns the value it returns.
+ *
+ * The first process to miss marks the key in flight, other processes missing the same
+ * key wait up to wait microseconds for the value rather than generating it again; should
+ * the marker still be there, or its owner have died, they take it over and generate the
+ * value themselves
+ *
+ * The value is stored with ttl and soft_ttl, and the time it took to generate, a hit on a
+ * stale value returns it, unless the caller is elected to refresh it, see apc_cache_find_ex
+ */
+PHP_APCU_API void apc_cache_entry(apc_cache_t* cache,
+                                  char* strkey,
+                                  zend_uint keylen,
+                                  zend_fcall_info* fci,
+                                  zend_fcall_info_cache* fcc,
+                                  zend_uint ttl,
+                                  zend_uint soft_ttl,
+                                  double beta,
+                                  zend_ulong wait,
+                                  zval* return_value TSRMLS_DC);
+
 /* apc_cach_fetch_zval takes a zval in the cache and reconstructs a runtime
  * zval from it.
  *
@@ -276,6 +680,13 @@ PHP_APCU_API zval* apc_cache_fetch_zval(apc_context_t* ctxt,
                                         zval* dst,
                                         const zval* src TSRMLS_DC);
 
+/* apc_cache_store_zval copies a runtime zval into the memory of the context,
+ * the way values are stored in the cache.
+ */
+PHP_APCU_API zval* apc_cache_store_zval(zval* dst,
+                                        const zval* src,
+                                        apc_context_t* ctxt TSRMLS_DC);
+
 /*
  * apc_cache_release decrements the reference count associated with a cache
  * entry. Calling apc_cache_find automatically increments the reference count,
@@ -340,6 +751,27 @@ PHP_APCU_API zend_bool apc_cache_busy(apc_cache_t* cache TSRMLS_DC);
 PHP_APCU_API zend_bool apc_cache_defense(apc_cache_t* cache,
                                          apc_cache_key_t* key TSRMLS_DC);
 
+/*
+* apc_cache_lock_stripes acquires every stripe lock, exclusive or shared, in ascending order
+*  this must be used by operations that need a consistent view of the whole cache
+* apc_cache_unlock_stripes releases the locks acquired by apc_cache_lock_stripes
+*/
+PHP_APCU_API void apc_cache_lock_stripes(apc_cache_t* cache, zend_bool exclusive TSRMLS_DC);
+PHP_APCU_API void apc_cache_unlock_stripes(apc_cache_t* cache, zend_bool exclusive TSRMLS_DC);
+
+/*
+* apc_cache_nchains returns the number of chains in the cache
+* apc_cache_chain returns the head of chain i, or NULL if chain i has been migrated
+*
+* While the cache is resizing, chains are numbered across the slots of the table being
+*  migrated from, followed by the slots of the table; otherwise they are the slots of the table
+*
+* Note: the caller must hold the stripe lock of the chain, or the locks of every stripe, to
+*  modify the chain or for the numbering to stay the same
+*/
+PHP_APCU_API zend_ulong apc_cache_nchains(apc_cache_t* cache);
+PHP_APCU_API apc_cache_slot_t** apc_cache_chain(apc_cache_t* cache, zend_ulong i);
+
 /*
 * apc_cache_serializer
 * sets the serializer for a cache, and by proxy contexts created for the cache
@@ -379,6 +811,10 @@ PHP_APCU_API void apc_cache_serializer(apc_cache_t* cache, const char* name TSRM
 *   2) If available memory if less than the size requested, run full expunge
 *
 * The TTL of an entry takes precedence over the TTL of a cache
+*
+* Where the policy is APC_CACHE_EVICT_CLOCK, none of the above applies:
+*   1) Perform cleanup of stale entries
+*   2) If the size requested plus headroom is not available, run eviction
 */
 PHP_APCU_API void apc_cache_default_expunge(apc_cache_t* cache, size_t size TSRMLS_DC);
 
@@ -389,24 +825,48 @@ PHP_APCU_API void apc_cache_default_expunge(apc_cache_t* cache, size_t size TSRM
 /*
 * apc_cache_real_expunge: trashes the whole cache
 *
-* Note: it is assumed you have a write lock on the header when you enter real expunge
+* Note: it is assumed you have an exclusive lock on all stripes when you enter real expunge
 */
 PHP_APCU_API void apc_cache_real_expunge(apc_cache_t* cache TSRMLS_DC);
 
+/*
+* apc_cache_evict: removes entries until size bytes are available
+*
+* A clock hand walks the chains, removing expired entries and entries that were not accessed
+* since the hand last passed them, the others are passed over once. Eviction stops as soon as
+* the memory removed covers size, or when the memory removed cannot be free'd yet
+*
+* Note: it is assumed you have an exclusive lock on all stripes when you enter evict
+*/
+PHP_APCU_API void apc_cache_evict(apc_cache_t* cache, size_t size TSRMLS_DC);
+
+/*
+* apc_cache_expire: removes the entries whose ttl has passed by time t
+*
+* Only the spokes of the expiry wheel between the last call and t are visited
+*
+* Note: it is assumed you have an exclusive lock on all stripes when you enter expire
+*/
+PHP_APCU_API void apc_cache_expire(apc_cache_t* cache, time_t t TSRMLS_DC);
+
 /*
 * apc_cache_gc: runs garbage collection on cache
 *
-* Note: it is assumed you have a write lock on the header when you enter gc
+* Slots are free'd once every reader that does not lock has announced an epoch after
+* the one they were removed in, or left; until then they are left for the next collection
+*
+* Note: gc takes the header lock itself, it must not be held when you enter gc
 */
 PHP_APCU_API void apc_cache_gc(apc_cache_t* cache TSRMLS_DC);
 
 /*
 * apc_cache_remove_slot: removes slot
 *
-* if no references remain, the slot is free'd immediately
-* if there are references remaining, the slot is trashed
+* if no references remain and there are no registered readers, the slot is free'd immediately
+* otherwise, the slot is trashed and free'd by apc_cache_gc
 *
-* Note: it is assumed you have a write lock on the header when you remove slots
+* Note: it is assumed you have a write lock on the stripe of the slot when you remove slots,
+*       and that you do not hold the header lock, which is taken to trash the slot
 */
 PHP_APCU_API void apc_cache_remove_slot(apc_cache_t* cache, apc_cache_slot_t** slot TSRMLS_DC);
 #endif
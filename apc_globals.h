@@ -66,10 +66,25 @@ ZEND_BEGIN_MODULE_GLOBALS(apcu)
     zend_bool enabled;      /* if true, apc is enabled (defaults to true) */
     long shm_segments;      /* number of shared memory segments to use */
     long shm_size;          /* size of each shared memory segment (in MB) */
+    long shm_max_size;      /* size each segment may grow to */
+    long shm_hugepages;     /* huge pages backing the segments, see APC_SMA_PAGES_* */
+    zend_bool shm_prefault; /* fault the segments in at startup */
     long entries_hint;      /* hint at the number of entries expected */
+    long lock_stripes;      /* number of locks the cache slots are striped over */
+    zend_bool inline_index; /* if true, the cache keeps an inline index over its slots */
+    zend_bool lookup_filter; /* if true, the cache keeps a filter that answers misses */
     long gc_ttl;            /* parameter to apc_cache_create */
     long ttl;               /* parameter to apc_cache_create */
 	long smart;             /* smart value */
+    long eviction_policy;   /* policy applied when memory runs out */
+    long eviction_headroom; /* bytes evicted beyond what an allocation needs */
+    long sweep_budget;      /* expired entries removed at the end of a request */
+    long sweep_time;        /* microseconds spent looking for them */
+    long compact_budget;    /* entries moved at the end of a request when memory is fragmented */
+    long entry_timeout;     /* milliseconds apcu_entry waits for another process to generate a value */
+    double xfetch_beta;     /* eagerness to refresh values early, 0 to refresh only once stale */
+    long l1_entries;        /* values each process holds in its own memory, 0 to disable */
+    long l1_size;           /* memory each process holds them in */
 
 #if APC_MMAP
     char *mmap_file_mask;   /* mktemp-style file-mask to pass to mmap */
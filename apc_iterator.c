@@ -234,9 +234,9 @@ static int apc_iterator_fetch_active(apc_iterator_t *iterator TSRMLS_DC) {
         apc_iterator_item_dtor(apc_stack_pop(iterator->stack));
     }
 
-    while(count <= iterator->chunk_size && iterator->slot_idx < apc_user_cache->nslots) {
-        slot = &apc_user_cache->slots[iterator->slot_idx];
-        while(*slot) {
+    while(count <= iterator->chunk_size && iterator->slot_idx < apc_cache_nchains(apc_user_cache)) {
+        slot = apc_cache_chain(apc_user_cache, iterator->slot_idx);
+        while(slot && *slot) {
             if (apc_iterator_check_expiry(apc_user_cache, slot, t)) {
                 if (apc_iterator_search_match(iterator, slot)) {
                     count++;
@@ -266,7 +266,7 @@ static int apc_iterator_fetch_deleted(apc_iterator_t *iterator TSRMLS_DC) {
     slot = &apc_user_cache->header->gc;
     while ((*slot) && count <= iterator->slot_idx) {
         count++;
-        slot = &(*slot)->next;
+        slot = &(*slot)->gc_next;
     }
     count = 0;
     while ((*slot) && count < iterator->chunk_size) {
@@ -277,7 +277,7 @@ static int apc_iterator_fetch_deleted(apc_iterator_t *iterator TSRMLS_DC) {
                 apc_stack_push(iterator->stack, item TSRMLS_CC);
             }
         }
-        slot = &(*slot)->next;
+        slot = &(*slot)->gc_next;
     }
 
     iterator->slot_idx += count;
@@ -293,9 +293,9 @@ static void apc_iterator_totals(apc_iterator_t *iterator TSRMLS_DC) {
     apc_cache_slot_t **slot;
     int i;
 
-    for (i=0; i < apc_user_cache->nslots; i++) {
-        slot = &apc_user_cache->slots[i];
-        while((*slot)) {
+    for (i=0; i < apc_cache_nchains(apc_user_cache); i++) {
+        slot = apc_cache_chain(apc_user_cache, i);
+        while(slot && (*slot)) {
             if (apc_iterator_search_match(iterator, slot)) {
                 iterator->size += (*slot)->value->mem_size;
                 iterator->hits += (*slot)->nhits;
@@ -101,5 +101,22 @@ PHP_APCU_API void apc_lock_destroy(apc_lock_t *lock TSRMLS_DC); /* }}} */
 #define APC_RLOCK(o)          RLOCK(&(o)->lock)
 #define APC_RUNLOCK(o)        RUNLOCK(&(o)->lock) /* }}} */
 
+/* {{{ atomic operations
+  used for counters in shared memory which are modified by holders of different locks,
+  ATOMIC_ADD/ATOMIC_SUB evaluate to the new value of the counter, ATOMIC_CAS to true on success */
+#ifndef PHP_WIN32
+# define ATOMIC_ADD(c, n)     __sync_add_and_fetch(&(c), (n))
+# define ATOMIC_SUB(c, n)     __sync_sub_and_fetch(&(c), (n))
+# define ATOMIC_CAS(c, o, n)  __sync_bool_compare_and_swap(&(c), (o), (n))
+# define MEMORY_BARRIER()     __sync_synchronize()
+#else
+# define ATOMIC_ADD(c, n)     (InterlockedExchangeAdd((volatile LONG*) &(c), (LONG) (n)) + (n))
+# define ATOMIC_SUB(c, n)     (InterlockedExchangeAdd((volatile LONG*) &(c), -((LONG) (n))) - (n))
+# define ATOMIC_CAS(c, o, n)  (InterlockedCompareExchange((volatile LONG*) &(c), (LONG) (n), (LONG) (o)) == (LONG) (o))
+# define MEMORY_BARRIER()     MemoryBarrier()
+#endif
+#define ATOMIC_INC(c)         ATOMIC_ADD(c, 1)
+#define ATOMIC_DEC(c)         ATOMIC_SUB(c, 1) /* }}} */
+
 #endif
 
@@ -36,6 +36,9 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#ifdef __linux__
+# include <sys/vfs.h>
+#endif
 
 /*
  * Some operating systems (like FreeBSD) have a MAP_NOSYNC flag that
@@ -53,7 +56,35 @@
 # define MAP_ANON MAP_ANONYMOUS
 #endif
 
-apc_segment_t apc_mmap(char *file_mask, size_t size TSRMLS_DC)
+/* magic number of a hugetlbfs mount, see statfs(2) */
+#ifndef HUGETLBFS_MAGIC
+# define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+/* {{{ apc_mmap_pagesize
+ returns the size of the pages backing fd, or of huge pages if fd is an anonymous mapping of them */
+static size_t apc_mmap_pagesize(int fd, int flags)
+{
+#ifdef MAP_HUGETLB
+    if (flags & MAP_HUGETLB) {
+        return apc_page_size(1);
+    }
+#endif
+#ifdef __linux__
+    if (fd != -1) {
+        struct statfs fs;
+
+        /* files on a hugetlbfs mount are backed by huge pages without asking */
+        if (fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC) {
+            return fs.f_bsize;
+        }
+    }
+#endif
+    return apc_page_size(0);
+}
+/* }}} */
+
+apc_segment_t apc_mmap(char *file_mask, size_t size, int pages TSRMLS_DC)
 {
     apc_segment_t segment; 
 
@@ -70,6 +101,13 @@ apc_segment_t apc_mmap(char *file_mask, size_t size TSRMLS_DC)
 #else
         fd = -1;
         flags = MAP_SHARED | MAP_ANON;
+        if (pages & APC_SMA_PAGES_HUGE) {
+#ifdef MAP_HUGETLB
+            flags |= MAP_HUGETLB;
+#else
+            apc_warning("apc_mmap: huge pages are not supported for anonymous mappings on this system" TSRMLS_CC);
+#endif
+        }
 #ifdef APC_MEMPROTECT
         remap = 0;
 #endif
@@ -128,8 +166,15 @@ apc_segment_t apc_mmap(char *file_mask, size_t size TSRMLS_DC)
         unlink(file_mask);
     }
 
+#ifdef MAP_NORESERVE
+    if (pages & APC_SMA_PAGES_NORESERVE) {
+        flags |= MAP_NORESERVE;
+    }
+#endif
+
     segment.shmaddr = (void *)mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
     segment.size = size;
+    segment.pagesize = apc_mmap_pagesize(fd, flags);
 
 #ifdef APC_MEMPROTECT
     if(remap) {
@@ -140,7 +185,11 @@ apc_segment_t apc_mmap(char *file_mask, size_t size TSRMLS_DC)
 #endif
 
     if((long)segment.shmaddr == -1) {
-        apc_error("apc_mmap: mmap failed:" TSRMLS_CC);
+        if (pages & APC_SMA_PAGES_HUGE) {
+            apc_error("apc_mmap: mmap failed, check that enough huge pages are reserved with vm.nr_hugepages:" TSRMLS_CC);
+        } else {
+            apc_error("apc_mmap: mmap failed:" TSRMLS_CC);
+        }
     }
 
     if(fd != -1) close(fd);
@@ -151,6 +200,7 @@ error:
 
     segment.shmaddr = (void*)-1;
     segment.size = 0;
+    segment.pagesize = 0;
 #ifdef APC_MEMPROTECT
     segment.roaddr = NULL;
 #endif
@@ -492,6 +492,27 @@ PHP_APCU_API void* APC_ALLOC apc_pstrdup(const char* s,
 }
 /* }}} */
 
+/* {{{ apc_pool_block */
+PHP_APCU_API void* apc_pool_block(apc_pool* pool, unsigned long i)
+{
+    apc_realpool *rpool = (apc_realpool*)pool;
+    pool_block *entry;
+
+    if ((pool->type & APC_POOL_SIZE_MASK) == APC_UNPOOL) {
+        return NULL;
+    }
+
+    for (entry = rpool->head; entry != NULL && i; entry = entry->next, i--);
+
+    if (!entry) {
+        return NULL;
+    }
+
+    /* the first block was allocated along with the pool */
+    return (entry == &rpool->first) ? (void*) rpool : (void*) entry;
+}
+/* }}} */
+
 /* {{{ apc_pmemcpy */
 PHP_APCU_API void* APC_ALLOC apc_pmemcpy(const void* p, 
                             size_t n, 
@@ -90,12 +90,14 @@ struct _apc_pool {
 
 /* {{{ enum definition: apc_copy_type */
 /* APC_COPY_IN should be used when copying into APC 
-   APC_COPY_OUT should be used when copying out of APC */
+   APC_COPY_OUT should be used when copying out of APC
+   APC_COPY_MOVE should be used when copying a value from one place in APC to another */
 typedef enum _apc_copy_type {
     APC_NO_COPY = 0,
     APC_COPY_IN,
     APC_COPY_OUT,
-	APC_COPY_OTHER
+	APC_COPY_OTHER,
+	APC_COPY_MOVE
 } apc_copy_type; /* }}} */
 
 /* {{{ enum definition: apc_context_type 
@@ -131,6 +133,12 @@ PHP_APCU_API apc_pool* apc_pool_create(apc_pool_type pool_type,
 */
 PHP_APCU_API void apc_pool_destroy(apc_pool* pool TSRMLS_DC);
 
+/*
+ apc_pool_block returns the i-th allocation the pool made with its allocator, NULL after the last
+*/
+PHP_APCU_API void* apc_pool_block(apc_pool* pool,
+                                  unsigned long i);
+
 /*
  apc_pmemcpy performs memcpy using resources provided by pool
 */
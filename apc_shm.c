@@ -47,13 +47,25 @@
 # define SHM_A 0222 /* write permission */
 #endif
 
-int apc_shm_create(int proj, size_t size TSRMLS_DC)
+int apc_shm_create(int proj, size_t size, int pages TSRMLS_DC)
 {
     int shmid;			/* shared memory id */
     int oflag;			/* permissions on shm */
     key_t key = IPC_PRIVATE;	/* shm key */
 
     oflag = IPC_CREAT | SHM_R | SHM_A;
+    if (pages & APC_SMA_PAGES_HUGE) {
+#ifdef SHM_HUGETLB
+        oflag |= SHM_HUGETLB;
+#else
+        apc_warning("apc_shm_create: huge pages are not supported for shared memory segments on this system" TSRMLS_CC);
+#endif
+    }
+#ifdef SHM_NORESERVE
+    if (pages & APC_SMA_PAGES_NORESERVE) {
+        oflag |= SHM_NORESERVE;
+    }
+#endif
     if ((shmid = shmget(key, size, oflag)) < 0) {
         apc_error("apc_shm_create: shmget(%d, %d, %d) failed: %s. It is possible that the chosen SHM segment size is higher than the operation system allows. Linux has usually a default limit of 32MB per segment." TSRMLS_CC, key, size, oflag, strerror(errno));
     }
@@ -84,6 +96,7 @@ apc_segment_t apc_shm_attach(int shmid, size_t size TSRMLS_DC)
 #endif
 
     segment.size = size;
+    segment.pagesize = apc_page_size(0);
 
     /*
      * We set the shmid for removal immediately after attaching to it. The
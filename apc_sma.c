@@ -38,6 +38,12 @@
 #include <limits.h>
 #include "apc_mmap.h"
 
+#ifndef PHP_WIN32
+# include <sys/mman.h>
+# include <signal.h>
+# include <errno.h>
+#endif
+
 #ifdef APC_SMA_DEBUG
 # ifdef HAVE_VALGRIND_MEMCHECK_H
 #  include <valgrind/memcheck.h>
@@ -49,11 +55,101 @@ enum {
 	DEFAULT_NUMSEG=1, 
 	DEFAULT_SEGSIZE=30*1024*1024 };
 
+/*
+ * Free blocks are kept on segregated lists by size class: each power of two from
+ * 1 << SMA_CLASS_SHIFT is split into SMA_CLASS_SPLIT classes of equal width, the last
+ * class takes everything bigger. A bitmap of the non-empty classes lets sma_allocate
+ * find a block big enough without walking the free blocks of the segment.
+ */
+#define SMA_CLASS_SHIFT      5
+#define SMA_CLASS_SPLIT_BITS 2
+#define SMA_CLASS_SPLIT      (1 << SMA_CLASS_SPLIT_BITS)
+#define SMA_CLASSES          64
+#define SMA_BITMAP_BITS      (sizeof(unsigned int) * CHAR_BIT)
+#define SMA_BITMAP_WORDS     ((SMA_CLASSES + SMA_BITMAP_BITS - 1) / SMA_BITMAP_BITS)
+
+/*
+ * Requests of up to SMA_SLAB_MAX bytes, including a one word tag, are served from slabs:
+ * blocks of SMA_SLAB_SIZE bytes carved into objects of one size, rounded up to a multiple
+ * of SMA_SLAB_QUANTUM. The tag holds the offset of the slab with the low bit set, which an
+ * allocated block never has in the same word, so free knows where an object came from.
+ */
+#define SMA_SLAB_MAX         1024
+#define SMA_SLAB_QUANTUM     32
+#define SMA_SLAB_CLASSES     (SMA_SLAB_MAX / SMA_SLAB_QUANTUM)
+#define SMA_SLAB_SIZE        (16 * 1024)
+#define SMA_SLAB_TAG_SIZE    ALIGNWORD(sizeof(size_t))
+#define SMA_SLAB_OBJSIZE(n)  ALIGNSIZE(ALIGNWORD(n) + SMA_SLAB_TAG_SIZE, SMA_SLAB_QUANTUM)
+#define SMA_SLABBED(n)       (ALIGNWORD(n) + SMA_SLAB_TAG_SIZE <= SMA_SLAB_MAX)
+
+/*
+ * Without threads each process keeps a magazine of slab objects per object size, so most
+ * small allocations and frees need not take the segment lock. A magazine is refilled to
+ * SMA_MAGAZINE_REFILL objects under the lock taken by a miss, and drained to that many
+ * when it overflows; apc_sma_api_flush empties them at the end of every request.
+ * The magazines of a process are kept in shared memory, in a rack of the first segment marked
+ * with the pid of its owner, so that the objects held by a process killed in the middle of a
+ * request are returned by the next process to take its rack, see sma_rack. At most SMA_RACKS
+ * processes hold magazines at once, any others take the lock for every object.
+ * A child forked in the middle of a request forgets the rack of its parent, which still owns it.
+ */
+#ifndef ZTS
+# define APC_SMA_MAGAZINES   1
+#endif
+#define SMA_MAGAZINE_SIZE    16
+#define SMA_MAGAZINE_REFILL  (SMA_MAGAZINE_SIZE / 2)
+#define SMA_RACKS            64
+
+typedef struct sma_magazine_t sma_magazine_t;
+struct sma_magazine_t {
+    zend_uint count;                          /* number of objects held */
+    void* objects[SMA_MAGAZINE_SIZE];         /* objects held, most recently freed last */
+};
+
+typedef struct sma_rack_t sma_rack_t;
+struct sma_rack_t {
+    pid_t owner;                              /* the process the magazines belong to */
+    sma_magazine_t classes[SMA_SLAB_CLASSES]; /* a magazine for each object size */
+};
+
+typedef struct sma_magazines_t sma_magazines_t;
+struct sma_magazines_t {
+    zend_uint forks;                          /* sma_forks when the rack was taken */
+    zend_bool tried;                          /* set once this process has looked for a rack */
+    sma_rack_t* rack;                         /* the rack of this process, NULL if it has none */
+};
+
+#define SMA_MAGAZINE(rack, objsize) (&(rack)->classes[((objsize) / SMA_SLAB_QUANTUM) - 1])
+
+typedef struct sma_slab_class_t sma_slab_class_t;
+struct sma_slab_class_t {
+    size_t partial;         /* offset of first slab with free objects, 0 if none */
+    size_t full;            /* offset of first slab with no free objects, 0 if none */
+};
+
 typedef struct sma_header_t sma_header_t;
 struct sma_header_t {
     apc_lock_t sma_lock;    /* segment lock */
-    size_t segsize;         /* size of entire segment */
+    size_t segsize;         /* size of the segment in use, up to the size mapped */
     size_t avail;           /* bytes available (not necessarily contiguous) */
+    volatile zend_uint busy;                  /* processes holding or waiting for the segment lock */
+    size_t free[SMA_CLASSES];                 /* offset of first free block in each class, 0 if empty */
+    unsigned int bitmap[SMA_BITMAP_WORDS];    /* bit set for each class with a free block */
+    zend_uint nfree[SMA_CLASSES];             /* number of free blocks in each class */
+    size_t largest;                           /* size of the largest free block */
+    sma_slab_class_t slabs[SMA_SLAB_CLASSES]; /* slabs of each object size */
+    size_t racks[SMA_RACKS];                  /* offset of each rack of magazines, 0 if none, see sma_rack */
+};
+
+typedef struct sma_slab_t sma_slab_t;
+struct sma_slab_t {
+    size_t size;            /* size of each object, including its tag */
+    size_t count;           /* number of objects the slab holds */
+    size_t used;            /* number of objects handed out */
+    size_t carved;          /* number of objects ever handed out, the rest are untouched */
+    size_t free;            /* offset of the object on top of the free stack, 0 if empty */
+    size_t snext;           /* offset of next slab in the same list */
+    size_t sprev;           /* offset of prev slab in the same list */
 };
 
 #define SMA_HDR(sma, i)  ((sma_header_t*)((sma->segs[i]).shmaddr))
@@ -61,6 +157,10 @@ struct sma_header_t {
 #define SMA_RO(sma, i)   ((char*)(sma->segs[i]).roaddr)
 #define SMA_LCK(sma, i)  ((SMA_HDR(sma, i))->sma_lock)
 
+/* write locks counted in busy, so allocations can steer clear of contended segments */
+#define SMA_WLOCK(sma, i)   { ATOMIC_INC(SMA_HDR(sma, i)->busy); WLOCK(&SMA_LCK(sma, i)); }
+#define SMA_WUNLOCK(sma, i) { WUNLOCK(&SMA_LCK(sma, i)); ATOMIC_DEC(SMA_HDR(sma, i)->busy); }
+
 #if 0
 /* global counter for identifying blocks
  * Technically it is possible to do the same
@@ -94,6 +194,13 @@ struct block_t {
 #define NEXT_SBLOCK(block) ((block_t*)((char*)block + block->size))
 #define PREV_SBLOCK(block) (block->prev_size ? ((block_t*)((char*)block - block->prev_size)) : NULL)
 
+/* a block is free when the block after it records its size, the sentinels have no size */
+#define SMA_FREE(block) ((block)->size && NEXT_SBLOCK(block)->prev_size)
+
+/* the word before an allocation, a slab tag for objects, the end of block_t (always even) for blocks */
+#define SMA_TAG(offset) (*(size_t*)((char*)shmaddr + (offset) - sizeof(size_t)))
+#define SMA_SLABAT(offset) ((sma_slab_t*)((char*)shmaddr + (offset)))
+
 /* Canary macros for setting, checking and resetting memory canaries */
 #ifdef APC_SMA_CANARIES
     #define SET_CANARY(v) (v)->canary = 0x42424242
@@ -109,64 +216,181 @@ struct block_t {
 #define MINBLOCKSIZE (ALIGNWORD(1) + ALIGNWORD(sizeof(block_t)))
 /* }}} */
 
-/* {{{ sma_allocate: tries to allocate at least size bytes in a segment */
-static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, zend_ulong size, zend_ulong fragment, zend_ulong *allocated)
+/* {{{ sma_fls: index of the highest bit set in x, which must be non-zero */
+static inline int sma_fls(size_t x)
 {
-    void* shmaddr;          /* header of shared memory segment */
-    block_t* prv;           /* block prior to working block */
-    block_t* cur;           /* working block in list */
-    block_t* prvnextfit;    /* block before next fit */
-    size_t realsize;        /* actual size of block needed, including header */
-    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+#if defined(__GNUC__)
+    return (int)(sizeof(unsigned long long) * CHAR_BIT - 1) - __builtin_clzll((unsigned long long) x);
+#else
+    int bit = 0;
+    while (x >>= 1) {
+        bit++;
+    }
+    return bit;
+#endif
+}
+/* }}} */
 
-    realsize = ALIGNWORD(size + block_size);
+/* {{{ sma_ffs: index of the lowest bit set in x, which must be non-zero */
+static inline int sma_ffs(unsigned int x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(x);
+#else
+    int bit = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+/* }}} */
 
-    /*
-     * First, insure that the segment contains at least realsize free bytes,
-     * even if they are not contiguous.
-     */
-    shmaddr = header;
+/* {{{ sma_class: the size class a block of size bytes is filed under */
+static inline int sma_class(size_t size)
+{
+    int fls = sma_fls(size);
+    int c;
 
-    if (header->avail < realsize) {
+    if (fls < SMA_CLASS_SHIFT) {
+        return 0;
+    }
+
+    c = ((fls - SMA_CLASS_SHIFT) << SMA_CLASS_SPLIT_BITS) |
+        (int)((size >> (fls - SMA_CLASS_SPLIT_BITS)) & (SMA_CLASS_SPLIT - 1));
+
+    return c < SMA_CLASSES ? c : SMA_CLASSES - 1;
+}
+/* }}} */
+
+/* {{{ sma_find_class: the first class at or above c with a free block, -1 if there is none */
+static inline int sma_find_class(sma_header_t* header, int c)
+{
+    int word = c / SMA_BITMAP_BITS;
+    unsigned int bits;
+
+    if (c >= SMA_CLASSES) {
         return -1;
     }
 
-    prvnextfit = 0;     /* initially null (no fit) */
-    prv = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
+    bits = header->bitmap[word] & (~0U << (c % SMA_BITMAP_BITS));
+    while (!bits) {
+        if (++word == SMA_BITMAP_WORDS) {
+            return -1;
+        }
+        bits = header->bitmap[word];
+    }
 
-    CHECK_CANARY(prv);
+    return (word * SMA_BITMAP_BITS) + sma_ffs(bits);
+}
+/* }}} */
 
-    while (prv->fnext != 0) {
-        cur = BLOCKAT(prv->fnext);
+/* {{{ sma_class_size: the smallest size filed under class c */
+static inline size_t sma_class_size(int c)
+{
+    int fls = (c >> SMA_CLASS_SPLIT_BITS) + SMA_CLASS_SHIFT;
 
-		CHECK_CANARY(cur);
+    return ((size_t) 1 << fls) | ((size_t) (c & (SMA_CLASS_SPLIT - 1)) << (fls - SMA_CLASS_SPLIT_BITS));
+}
+/* }}} */
 
-        /* If it can fit realsize bytes in cur block, stop searching */
-        if (cur->size >= realsize) {
-            prvnextfit = prv;
+/* {{{ sma_largest: the size of the largest free block in a segment, which must be locked */
+static size_t sma_largest(sma_header_t* header)
+{
+    void* shmaddr = header;
+    size_t largest = 0;
+    size_t off;
+    int word = SMA_BITMAP_WORDS;
+    int c = -1;
+
+    /* the largest block is in the highest class with a free block */
+    while (word--) {
+        if (header->bitmap[word]) {
+            c = (word * SMA_BITMAP_BITS) + sma_fls(header->bitmap[word]);
             break;
         }
-        prv = cur;
     }
 
-    if (prvnextfit == 0) {
-        return -1;
+    if (c == -1) {
+        return 0;
     }
 
-    prv = prvnextfit;
-    cur = BLOCKAT(prv->fnext);
+    for (off = header->free[c]; off; off = BLOCKAT(off)->fnext) {
+        if (BLOCKAT(off)->size > largest) {
+            largest = BLOCKAT(off)->size;
+        }
+    }
+
+    return largest;
+}
+/* }}} */
+
+/* {{{ sma_link: files a free block at the head of the list for its class */
+static inline void sma_link(sma_header_t* header, block_t* cur)
+{
+    void* shmaddr = header;
+    int c = sma_class(cur->size);
+
+    cur->fprev = 0;
+    cur->fnext = header->free[c];
+    if (cur->fnext) {
+        BLOCKAT(cur->fnext)->fprev = OFFSET(cur);
+    }
+    header->free[c] = OFFSET(cur);
+    header->bitmap[c / SMA_BITMAP_BITS] |= (1U << (c % SMA_BITMAP_BITS));
+
+    header->nfree[c]++;
+    if (cur->size > header->largest) {
+        header->largest = cur->size;
+    }
+}
+/* }}} */
+
+/* {{{ sma_unlink: takes a free block out of the list for its class */
+static inline void sma_unlink(sma_header_t* header, block_t* cur)
+{
+    void* shmaddr = header;
+    int c = sma_class(cur->size);
+
+    if (cur->fprev) {
+        BLOCKAT(cur->fprev)->fnext = cur->fnext;
+    } else {
+        header->free[c] = cur->fnext;
+    }
+    if (cur->fnext) {
+        BLOCKAT(cur->fnext)->fprev = cur->fprev;
+    }
+    if (!header->free[c]) {
+        header->bitmap[c / SMA_BITMAP_BITS] &= ~(1U << (c % SMA_BITMAP_BITS));
+    }
+    cur->fnext = 0;
+    cur->fprev = 0;
+
+    /* the next largest is in the highest class, which seldom holds more than a few blocks */
+    header->nfree[c]--;
+    if (cur->size == header->largest) {
+        header->largest = sma_largest(header);
+    }
+}
+/* }}} */
+
+/* {{{ sma_carve: allocates realsize bytes from the start of the free block cur, splitting off the rest if it is big enough */
+static size_t sma_carve(sma_header_t* header, block_t* cur, size_t realsize, zend_ulong fragment, zend_ulong *allocated)
+{
+    void* shmaddr = header;
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
 
-    CHECK_CANARY(prv);
     CHECK_CANARY(cur);
 
+    sma_unlink(header, cur);
+
     if (cur->size == realsize || (cur->size > realsize && cur->size < (realsize + (MINBLOCKSIZE + fragment)))) {
-        /* cur is big enough for realsize, but too small to split - unlink it */
+        /* cur is big enough for realsize, but too small to split - use all of it */
         *(allocated) = cur->size - block_size;
-        prv->fnext = cur->fnext;
-        BLOCKAT(cur->fnext)->fprev = OFFSET(prv);
         NEXT_SBLOCK(cur)->prev_size = 0;  /* block is alloc'd */
     } else {
-        /* nextfit is too big; split it into two smaller blocks */
+        /* cur is too big; split it into two smaller blocks */
         block_t* nxt;      /* the new block (chopped part of cur) */
         size_t oldsize;    /* size of cur before split */
 
@@ -179,32 +403,131 @@ static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, zend_ulong size, ze
         NEXT_SBLOCK(nxt)->prev_size = nxt->size;  /* adjust size */
         SET_CANARY(nxt);
 
-        /* replace cur with next in free list */
-        nxt->fnext = cur->fnext;
-        nxt->fprev = cur->fprev;
-        BLOCKAT(nxt->fnext)->fprev = OFFSET(nxt);
-        BLOCKAT(nxt->fprev)->fnext = OFFSET(nxt);
+        /* file the remainder under its own class */
+        sma_link(header, nxt);
 #if 0
         nxt->id = -1;
 #endif
     }
 
-    cur->fnext = 0;
-
     /* update the block header */
     header->avail -= cur->size;
 
     SET_CANARY(cur);
 
+    if (block_size > sizeof(block_t)) {
+        /* padding ends the header here, it must not read as a slab tag */
+        memset((char*)cur + sizeof(block_t), 0, block_size - sizeof(block_t));
+    }
+
 #if 0
     cur->id = ++block_id;
-    fprintf(stderr, "allocate(realsize=%d,size=%d,id=%d)\n", (int)(size), (int)(cur->size), cur->id);
+    fprintf(stderr, "allocate(realsize=%d,size=%d,id=%d)\n", (int)(realsize), (int)(cur->size), cur->id);
 #endif
 
     return OFFSET(cur) + block_size;
 }
 /* }}} */
 
+/* {{{ sma_allocate: tries to allocate at least size bytes in a segment */
+static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, zend_ulong size, zend_ulong fragment, zend_ulong *allocated)
+{
+    void* shmaddr;          /* header of shared memory segment */
+    block_t* cur;           /* block chosen to satisfy the request */
+    size_t realsize;        /* actual size of block needed, including header */
+    int c;                  /* size class of realsize */
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+
+    realsize = ALIGNWORD(size + block_size);
+
+    /*
+     * First, insure that the segment contains at least realsize free bytes,
+     * even if they are not contiguous.
+     */
+    shmaddr = header;
+
+    if (header->avail < realsize) {
+        return -1;
+    }
+
+    cur = NULL;
+    c = sma_class(realsize);
+
+    /*
+     * Blocks in the class of realsize may be smaller than realsize, only the head is tried;
+     * any block in a higher class is big enough, so the head of the first non-empty one is taken.
+     * The last class is unbounded, when realsize falls in it the list is searched first fit.
+     */
+    if (c == SMA_CLASSES - 1) {
+        size_t off = header->free[c];
+
+        while (off) {
+            block_t* blk = BLOCKAT(off);
+
+            CHECK_CANARY(blk);
+
+            if (blk->size >= realsize) {
+                cur = blk;
+                break;
+            }
+            off = blk->fnext;
+        }
+    } else {
+        if (header->free[c] && BLOCKAT(header->free[c])->size >= realsize) {
+            cur = BLOCKAT(header->free[c]);
+        } else {
+            c = sma_find_class(header, c + 1);
+
+            if (c != -1) {
+                cur = BLOCKAT(header->free[c]);
+            }
+        }
+    }
+
+    if (cur == NULL) {
+        return -1;
+    }
+
+    return sma_carve(header, cur, realsize, fragment, allocated);
+}
+/* }}} */
+
+/* {{{ sma_lowest: the free block at the lowest offset with at least realsize bytes in a segment, which must be locked, 0 if there is none */
+static size_t sma_lowest(sma_header_t* header, size_t realsize)
+{
+    void* shmaddr = header;
+    size_t lowest = 0;
+    size_t off;
+    int c;
+
+    /* blocks in lower classes are too small, those in the class of realsize may be */
+    for (c = sma_find_class(header, sma_class(realsize)); c != -1; c = sma_find_class(header, c + 1)) {
+        for (off = header->free[c]; off; off = BLOCKAT(off)->fnext) {
+            if (BLOCKAT(off)->size >= realsize && (!lowest || off < lowest)) {
+                lowest = off;
+            }
+        }
+    }
+
+    return lowest;
+}
+/* }}} */
+
+/* {{{ sma_allocate_low: tries to allocate at least size bytes in a segment, at the lowest offset it can */
+static size_t sma_allocate_low(sma_header_t* header, zend_ulong size, zend_ulong fragment, zend_ulong *allocated)
+{
+    void* shmaddr = header;
+    size_t realsize = ALIGNWORD(size + ALIGNWORD(sizeof(struct block_t)));
+    size_t off;
+
+    if (header->avail < realsize || !(off = sma_lowest(header, realsize))) {
+        return -1;
+    }
+
+    return sma_carve(header, BLOCKAT(off), realsize, fragment, allocated);
+}
+/* }}} */
+
 /* {{{ sma_deallocate: deallocates the block at the given offset */
 static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
 {
@@ -228,8 +551,7 @@ static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
     if (cur->prev_size != 0) {
         /* remove prv from list */
         prv = PREV_SBLOCK(cur);
-        BLOCKAT(prv->fnext)->fprev = prv->fprev;
-        BLOCKAT(prv->fprev)->fnext = prv->fnext;
+        sma_unlink(header, prv);
         /* cur and prv share an edge, combine them */
         prv->size +=cur->size;
        
@@ -238,11 +560,10 @@ static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
     }
 
     nxt = NEXT_SBLOCK(cur);
-    if (nxt->fnext != 0) {
+    if (SMA_FREE(nxt)) {
         assert(NEXT_SBLOCK(NEXT_SBLOCK(cur))->prev_size == nxt->size);
         /* cur and nxt shared an edge, combine them */
-        BLOCKAT(nxt->fnext)->fprev = nxt->fprev;
-        BLOCKAT(nxt->fprev)->fnext = nxt->fnext;
+        sma_unlink(header, nxt);
         cur->size += nxt->size;
 
 		CHECK_CANARY(nxt);
@@ -256,20 +577,415 @@ static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
 
     NEXT_SBLOCK(cur)->prev_size = cur->size;
 
-    /* insert new block after prv */
-    prv = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
-    cur->fnext = prv->fnext;
-    prv->fnext = OFFSET(cur);
-    cur->fprev = OFFSET(prv);
-    BLOCKAT(cur->fnext)->fprev = OFFSET(cur);
+    /* file the new block under its class */
+    sma_link(header, cur);
 
     return size;
 }
 /* }}} */
 
+/* {{{ sma_slab_link: pushes a slab onto the front of a list */
+static inline void sma_slab_link(void* shmaddr, size_t* list, sma_slab_t* slab)
+{
+    size_t offset = (size_t)((char*)slab - (char*)shmaddr);
+
+    slab->sprev = 0;
+    slab->snext = *list;
+    if (slab->snext) {
+        SMA_SLABAT(slab->snext)->sprev = offset;
+    }
+    *list = offset;
+}
+/* }}} */
+
+/* {{{ sma_slab_unlink: takes a slab out of a list */
+static inline void sma_slab_unlink(void* shmaddr, size_t* list, sma_slab_t* slab)
+{
+    if (slab->sprev) {
+        SMA_SLABAT(slab->sprev)->snext = slab->snext;
+    } else {
+        *list = slab->snext;
+    }
+    if (slab->snext) {
+        SMA_SLABAT(slab->snext)->sprev = slab->sprev;
+    }
+    slab->snext = 0;
+    slab->sprev = 0;
+}
+/* }}} */
+
+/* {{{ sma_slab_allocate: pops an object of at least size bytes from a slab, -1 if no slab could be made */
+static APC_HOTSPOT size_t sma_slab_allocate(sma_header_t* header, zend_ulong size, zend_ulong *allocated)
+{
+    void* shmaddr = header;
+    size_t objsize = SMA_SLAB_OBJSIZE(size);
+    sma_slab_class_t* class = &header->slabs[(objsize / SMA_SLAB_QUANTUM) - 1];
+    sma_slab_t* slab;
+    size_t offset;
+
+    if (!class->partial) {
+        zend_ulong got;
+
+        /* every slab of this size is full, carve a new one */
+        offset = sma_allocate(header, SMA_SLAB_SIZE, MINBLOCKSIZE, &got);
+        if (offset == -1) {
+            return -1;
+        }
+
+        slab = SMA_SLABAT(offset);
+        slab->size = objsize;
+        slab->count = (got - ALIGNWORD(sizeof(sma_slab_t))) / objsize;
+        slab->used = 0;
+        slab->carved = 0;
+        slab->free = 0;
+
+        sma_slab_link(shmaddr, &class->partial, slab);
+    }
+
+    slab = SMA_SLABAT(class->partial);
+
+    if (slab->free) {
+        offset = slab->free;
+        slab->free = *(size_t*)((char*)shmaddr + offset);
+    } else {
+        offset = class->partial + ALIGNWORD(sizeof(sma_slab_t)) + (slab->carved++ * slab->size) + SMA_SLAB_TAG_SIZE;
+        SMA_TAG(offset) = class->partial | 1;
+    }
+
+    if (++slab->used == slab->count) {
+        sma_slab_unlink(shmaddr, &class->partial, slab);
+        sma_slab_link(shmaddr, &class->full, slab);
+    }
+
+    *(allocated) = slab->size - SMA_SLAB_TAG_SIZE;
+
+    return offset;
+}
+/* }}} */
+
+/* {{{ sma_slab_deallocate: pushes the object at the given offset back onto its slab */
+static APC_HOTSPOT void sma_slab_deallocate(sma_header_t* header, size_t offset)
+{
+    void* shmaddr = header;
+    size_t soffset = SMA_TAG(offset) & ~((size_t) 1);
+    sma_slab_t* slab = SMA_SLABAT(soffset);
+    sma_slab_class_t* class = &header->slabs[(slab->size / SMA_SLAB_QUANTUM) - 1];
+
+    if (slab->used == slab->count) {
+        sma_slab_unlink(shmaddr, &class->full, slab);
+        sma_slab_link(shmaddr, &class->partial, slab);
+    }
+
+    *(size_t*)((char*)shmaddr + offset) = slab->free;
+    slab->free = offset;
+
+    /* an empty slab goes back to the segment, so an expunge recovers all of its memory */
+    if (--slab->used == 0) {
+        sma_slab_unlink(shmaddr, &class->partial, slab);
+        sma_deallocate(shmaddr, soffset);
+    }
+}
+/* }}} */
+
+/* {{{ sma_alloc: allocates size bytes in a segment, from a slab when the request is small */
+static inline size_t sma_alloc(sma_header_t* header, zend_ulong size, zend_ulong fragment, zend_ulong *allocated)
+{
+    if (SMA_SLABBED(size)) {
+        size_t offset = sma_slab_allocate(header, size, allocated);
+
+        if (offset != -1) {
+            return offset;
+        }
+    }
+
+    return sma_allocate(header, size, fragment, allocated);
+}
+/* }}} */
+
+/* {{{ sma_free: frees the allocation at the given offset, whether it came from a slab or not */
+static inline void sma_free(sma_header_t* header, size_t offset)
+{
+    void* shmaddr = header;
+
+    if (SMA_TAG(offset) & 1) {
+        sma_slab_deallocate(header, offset);
+    } else {
+        sma_deallocate(shmaddr, offset);
+    }
+}
+/* }}} */
+
+/* {{{ sma_choose: the segment to try first for size bytes
+    segments with room for size are preferred, uncontended ones first, then the one with most room;
+    the figures are read without locks and only steer the choice */
+static uint sma_choose(apc_sma_t* sma, zend_ulong size)
+{
+    uint i, best = sma->last;
+    size_t most = 0;
+    zend_bool quiet = 0;
+
+    if (sma->num == 1) {
+        return 0;
+    }
+
+    for (i = 0; i < sma->num; i++) {
+        sma_header_t* header = SMA_HDR(sma, i);
+        zend_bool q = (header->busy == 0);
+
+        if (header->avail < size) {
+            continue;
+        }
+
+        if ((q && !quiet) || (q == quiet && header->avail > most)) {
+            best = i;
+            most = header->avail;
+            quiet = q;
+        }
+    }
+
+    return best;
+}
+/* }}} */
+
+#ifdef APC_SMA_MAGAZINES
+/* {{{ sma_refill: fills the magazine in rack for objects of size bytes from segment i, which must be locked */
+static void sma_refill(apc_sma_t* sma, sma_rack_t* rack, uint i, zend_ulong size)
+{
+    sma_magazine_t* mag = SMA_MAGAZINE(rack, SMA_SLAB_OBJSIZE(size));
+    zend_ulong allocated;
+    size_t off;
+
+    while (mag->count < SMA_MAGAZINE_REFILL) {
+        off = sma_slab_allocate(SMA_HDR(sma, i), size, &allocated);
+        if (off == -1) {
+            break;
+        }
+        mag->objects[mag->count++] = SMA_ADDR(sma, i) + off;
+    }
+}
+/* }}} */
+
+/* {{{ sma_drain: frees the objects in mag from segment i, which must be locked, until keep are left */
+static void sma_drain(apc_sma_t* sma, uint i, sma_magazine_t* mag, zend_uint keep)
+{
+    zend_uint kept = 0;
+    zend_uint n;
+
+    for (n = 0; n < mag->count; n++) {
+        void* p = mag->objects[n];
+        size_t offset = (size_t)((char *)p - SMA_ADDR(sma, i));
+
+        if ((mag->count - n) + kept > keep && p >= (void*)SMA_ADDR(sma, i) && offset < sma->size) {
+            sma_slab_deallocate(SMA_HDR(sma, i), offset);
+        } else {
+            mag->objects[kept++] = p;
+        }
+    }
+    mag->count = kept;
+}
+/* }}} */
+
+/* {{{ number of times this process has been forked off, see sma_rack */
+static volatile zend_uint sma_forks = 0;
+static zend_bool sma_atfork = 0;
+
+static void sma_fork_child(void)
+{
+    sma_forks++;
+}
+/* }}} */
+
+/* {{{ sma_empty: returns every object held in rack */
+static void sma_empty(apc_sma_t* sma, sma_rack_t* rack)
+{
+    zend_uint held = 0;
+    uint i;
+    int c;
+
+    for (c = 0; c < SMA_SLAB_CLASSES; c++) {
+        held += rack->classes[c].count;
+    }
+
+    if (!held) {
+        return;
+    }
+
+    for (i = 0; i < sma->num; i++) {
+        SMA_WLOCK(sma, i);
+        for (c = 0; c < SMA_SLAB_CLASSES; c++) {
+            if (rack->classes[c].count) {
+                sma_drain(sma, i, &rack->classes[c], 0);
+            }
+        }
+        SMA_WUNLOCK(sma, i);
+    }
+}
+/* }}} */
+
+/* {{{ sma_rack_dead: tells whether the owner of rack has died, the objects it held are nobody's */
+static inline zend_bool sma_rack_dead(sma_rack_t* rack)
+{
+#ifndef PHP_WIN32
+    return kill(rack->owner, 0) == -1 && errno == ESRCH;
+#else
+    return 0;
+#endif
+}
+/* }}} */
+
+/* {{{ sma_rack
+ returns the rack of this process, NULL if it has none; a process takes a rack the first time
+ it needs one, a new rack or that of a dead process, whose objects it returns before using it */
+static sma_rack_t* sma_rack(apc_sma_t* sma)
+{
+    sma_magazines_t* mags = (sma_magazines_t*) sma->magazines;
+    sma_header_t* header;
+    sma_rack_t* rack = NULL;
+    zend_ulong allocated;
+    size_t off;
+    uint r;
+
+    /* a child forgets the rack of its parent, which still owns it */
+    if (mags->forks != sma_forks) {
+        mags->forks = sma_forks;
+        mags->rack = NULL;
+        mags->tried = 0;
+    }
+
+    if (mags->rack || mags->tried) {
+        return mags->rack;
+    }
+    mags->tried = 1;
+
+    header = SMA_HDR(sma, 0);
+
+    SMA_WLOCK(sma, 0);
+    for (r = 0; r < SMA_RACKS; r++) {
+        if (!header->racks[r]) {
+            off = sma_allocate(header, sizeof(sma_rack_t), 0, &allocated);
+            if (off != -1) {
+                rack = (sma_rack_t*)(SMA_ADDR(sma, 0) + off);
+                memset(rack, 0, sizeof(sma_rack_t));
+                header->racks[r] = off;
+            }
+            break;
+        }
+
+        rack = (sma_rack_t*)(SMA_ADDR(sma, 0) + header->racks[r]);
+        if (sma_rack_dead(rack)) {
+            break;
+        }
+        rack = NULL;
+    }
+    if (rack) {
+        rack->owner = getpid();
+    }
+    SMA_WUNLOCK(sma, 0);
+
+    if (rack) {
+        /* whatever a dead owner held goes back to the slabs */
+        sma_empty(sma, rack);
+    }
+
+    return (mags->rack = rack);
+}
+/* }}} */
+
+/* {{{ sma_magazine_of: the magazine in rack for the object at p in segment i, NULL if p did not come from a slab */
+static inline sma_magazine_t* sma_magazine_of(sma_rack_t* rack, apc_sma_t* sma, uint i, void* p)
+{
+    void* shmaddr = SMA_ADDR(sma, i);
+    size_t offset = (size_t)((char *)p - (char*)shmaddr);
+
+    if (!(SMA_TAG(offset) & 1)) {
+        return NULL;
+    }
+
+    /* the slab cannot go away while p is in use, its size can be read without the lock */
+    return SMA_MAGAZINE(rack, SMA_SLABAT(SMA_TAG(offset) & ~((size_t) 1))->size);
+}
+/* }}} */
+#endif
+
+/* {{{ sma_grow
+ extends a segment into the memory mapped beyond the part in use, returns false once it has all been used
+ Note: the caller must hold the segment lock */
+static zend_bool sma_grow(apc_sma_t* sma, uint seg, size_t n)
+{
+    void* shmaddr = SMA_ADDR(sma, seg);
+    sma_header_t* header = SMA_HDR(sma, seg);
+    block_t* cur;
+    block_t* last;
+    size_t size = sma->grow;
+
+    if (header->segsize >= sma->size) {
+        return 0;
+    }
+
+    /* room for a slab on top, in case n is a small object */
+    while (size < n + SMA_SLAB_SIZE + 2 * ALIGNWORD(sizeof(block_t))) {
+        size += sma->grow;
+    }
+    if (size > sma->size - header->segsize) {
+        size = sma->size - header->segsize;
+    }
+
+    /* the last sentinel sits one block short of the end in use, it becomes a block as large as the growth */
+    cur = BLOCKAT(header->segsize - 2 * ALIGNWORD(sizeof(block_t)));
+    assert(cur->size == 0);
+    cur->size = size;
+
+    last = NEXT_SBLOCK(cur);
+    last->size = 0;
+    last->prev_size = 0;
+    last->fnext = 0;
+    last->fprev = 0;
+    SET_CANARY(last);
+
+    header->segsize += size;
+
+    /* release it like an allocation, so that it merges with a free block before it */
+    sma_deallocate(shmaddr, OFFSET(cur) + ALIGNWORD(sizeof(block_t)));
+
+    return 1;
+}
+/* }}} */
+
+/* {{{ sma_prepare
+ applies the page options to the part of a segment in use when it has just been mapped, before anything is written to it */
+static void sma_prepare(apc_segment_t* segment, size_t used, int pages TSRMLS_DC)
+{
+#ifdef MADV_HUGEPAGE
+    /* the advice only helps pages that have not been faulted in yet */
+    if ((pages & APC_SMA_PAGES_ADVISE) && madvise(segment->shmaddr, segment->size, MADV_HUGEPAGE) < 0) {
+        apc_warning("apc_sma_init: madvise(MADV_HUGEPAGE) failed: %s" TSRMLS_CC, strerror(errno));
+    }
+#endif
+
+    /* take the page faults now rather than during the first requests */
+    if (pages & APC_SMA_PAGES_PREFAULT) {
+        size_t offset;
+
+        for (offset = 0; offset < used; offset += segment->pagesize) {
+            ((volatile char*) segment->shmaddr)[offset] = 0;
+        }
+    }
+}
+/* }}} */
+
 /* {{{ APC SMA API */
 PHP_APCU_API void apc_sma_api_init(apc_sma_t* sma, void** data, apc_sma_expunge_f expunge, zend_uint num, zend_ulong size, char *mask TSRMLS_DC) {
+    apc_sma_api_init_ex(sma, data, expunge, num, size, 0, 0, mask TSRMLS_CC);
+}
+
+PHP_APCU_API void apc_sma_api_init_ex(apc_sma_t* sma, void** data, apc_sma_expunge_f expunge, zend_uint num, zend_ulong size, zend_ulong max_size, int pages, char *mask TSRMLS_DC) {
 	uint i;
+    size_t pagesize;
+    size_t used;
+
+    /* only the caller decides whether segments are reserved */
+    pages &= ~APC_SMA_PAGES_NORESERVE;
+    pagesize = apc_page_size(pages & APC_SMA_PAGES_HUGE);
 
     if (sma->initialized) {
         return;
@@ -295,7 +1011,30 @@ PHP_APCU_API void apc_sma_api_init(apc_sma_t* sma, void** data, apc_sma_expunge_
     sma->num = num > 0 ? num : DEFAULT_NUMSEG;
 #endif
 
+    if (!pagesize) {
+        apc_warning("apc_sma_init: the system has no huge pages, using normal pages" TSRMLS_CC);
+        pages &= ~APC_SMA_PAGES_HUGE;
+        pagesize = apc_page_size(0);
+    }
+
+    /* segments are a whole number of pages, huge pages cannot be mapped in part */
     sma->size = size > 0 ? size : DEFAULT_SEGSIZE;
+    sma->size = ((sma->size + pagesize - 1) / pagesize) * pagesize;
+    used = sma->size;
+
+    /* segments that grow are mapped at their largest before processes fork, so every process sees them grow */
+    if (max_size > sma->size) {
+        sma->grow = sma->size;
+        sma->size = ((max_size + pagesize - 1) / pagesize) * pagesize;
+
+        /* a huge page that cannot be had when it is first touched raises SIGBUS instead of failing the allocation,
+           so explicit huge pages are reserved for the whole range up front */
+        if (!(pages & APC_SMA_PAGES_HUGE)) {
+            pages |= APC_SMA_PAGES_NORESERVE;
+        }
+    } else {
+        sma->grow = 0;
+    }
 
     sma->segs = (apc_segment_t*) apc_emalloc((sma->num * sizeof(apc_segment_t)) TSRMLS_CC);
 
@@ -305,53 +1044,78 @@ PHP_APCU_API void apc_sma_api_init(apc_sma_t* sma, void** data, apc_sma_expunge_
         void*       shmaddr;
 
 #if APC_MMAP
-        sma->segs[i] = apc_mmap(mask, sma->size TSRMLS_CC);
+        sma->segs[i] = apc_mmap(mask, sma->size, pages TSRMLS_CC);
         if(sma->num != 1) 
 			memcpy(&mask[strlen(mask)-6], "XXXXXX", 6);
 #else
         sma->segs[i] = apc_shm_attach(
-			apc_shm_create(i, sma->size TSRMLS_CC), 
+			apc_shm_create(i, sma->size, pages TSRMLS_CC), 
 			sma->size TSRMLS_CC
 		);
+        if (pages & APC_SMA_PAGES_HUGE) {
+            sma->segs[i].pagesize = pagesize;
+        }
 #endif
         
         sma->segs[i].size = sma->size;
 
+        sma_prepare(&sma->segs[i], used, pages TSRMLS_CC);
+
         shmaddr = sma->segs[i].shmaddr;
 
         header = (sma_header_t*) shmaddr;
         CREATE_LOCK(&header->sma_lock);
-        header->segsize = sma->size;
-        header->avail = sma->size - ALIGNWORD(sizeof(sma_header_t)) - ALIGNWORD(sizeof(block_t)) - ALIGNWORD(sizeof(block_t));
+        header->segsize = used;
+        header->busy = 0;
+        header->avail = used - ALIGNWORD(sizeof(sma_header_t)) - ALIGNWORD(sizeof(block_t)) - ALIGNWORD(sizeof(block_t));
+        memset(header->free, 0, sizeof(header->free));
+        memset(header->bitmap, 0, sizeof(header->bitmap));
+        memset(header->nfree, 0, sizeof(header->nfree));
+        header->largest = 0;
+        memset(header->slabs, 0, sizeof(header->slabs));
+        memset(header->racks, 0, sizeof(header->racks));
 
         first = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
         first->size = 0;
-        first->fnext = ALIGNWORD(sizeof(sma_header_t)) + ALIGNWORD(sizeof(block_t));
+        first->fnext = 0;
         first->fprev = 0;
         first->prev_size = 0;
         SET_CANARY(first);
 #if 0
         first->id = -1;
 #endif
-        empty = BLOCKAT(first->fnext);
+        empty = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)) + ALIGNWORD(sizeof(block_t)));
         empty->size = header->avail - ALIGNWORD(sizeof(block_t));
-        empty->fnext = OFFSET(empty) + empty->size;
-        empty->fprev = ALIGNWORD(sizeof(sma_header_t));
         empty->prev_size = 0;
         SET_CANARY(empty);
 #if 0
         empty->id = -1;
 #endif
-        last = BLOCKAT(empty->fnext);
+        last = NEXT_SBLOCK(empty);
         last->size = 0;
         last->fnext = 0;
-        last->fprev =  OFFSET(empty);
+        last->fprev = 0;
         last->prev_size = empty->size;
         SET_CANARY(last);
 #if 0
         last->id = -1;
 #endif
+        sma_link(header, empty);
     }	
+
+#ifdef APC_SMA_MAGAZINES
+    sma->magazines = apc_emalloc(sizeof(sma_magazines_t) TSRMLS_CC);
+    memset(sma->magazines, 0, sizeof(sma_magazines_t));
+
+# ifndef PHP_WIN32
+    if (!sma_atfork) {
+        pthread_atfork(NULL, NULL, sma_fork_child);
+        sma_atfork = 1;
+    }
+# endif
+    ((sma_magazines_t*) sma->magazines)->forks = sma_forks;
+    ((sma_magazines_t*) sma->magazines)->rack = NULL;
+#endif
 }
 
 PHP_APCU_API void apc_sma_api_cleanup(apc_sma_t* sma TSRMLS_DC) {
@@ -370,70 +1134,94 @@ PHP_APCU_API void apc_sma_api_cleanup(apc_sma_t* sma TSRMLS_DC) {
     sma->initialized = 0;
 
     apc_efree(sma->segs TSRMLS_CC);
+
+    if (sma->magazines) {
+        apc_efree(sma->magazines TSRMLS_CC);
+        sma->magazines = NULL;
+    }
 }
 
-PHP_APCU_API void* apc_sma_api_malloc_ex(apc_sma_t* sma, zend_ulong n, zend_ulong fragment, zend_ulong* allocated TSRMLS_DC) {
+/* {{{ sma_malloc
+ allocates n bytes, growing the segments and then, if expunge is set, giving up entries when they are exhausted */
+static void* sma_malloc(apc_sma_t* sma, zend_ulong n, zend_ulong fragment, zend_ulong* allocated, zend_bool expunge TSRMLS_DC) {
 	size_t off;
-    uint i;
-    int nuked = 0;
+    uint i, j;
+    int expunged = 0;
+#ifdef APC_SMA_MAGAZINES
+    sma_rack_t* rack = sma_rack(sma);
 
-restart:
-    assert(sma->initialized);
+    if (rack && SMA_SLABBED(n)) {
+        sma_magazine_t* mag = SMA_MAGAZINE(rack, SMA_SLAB_OBJSIZE(n));
 
-    WLOCK(&SMA_LCK(sma, sma->last));
-
-    off = sma_allocate(SMA_HDR(sma, sma->last), n, fragment, allocated);
-
-    if(off == -1) {
-        /* retry failed allocation after we expunge */
-        WUNLOCK(&SMA_LCK(sma, sma->last));
-		sma->expunge(
-			*(sma->data), (n+fragment) TSRMLS_CC);
-        WLOCK(&SMA_LCK(sma, sma->last));
-        off = sma_allocate(SMA_HDR(sma, sma->last), n, fragment, allocated);
-    }
+        if (mag->count) {
+            void* p = mag->objects[--mag->count];
 
-    if (off != -1) {
-        void* p = (void *)(SMA_ADDR(sma, sma->last) + off);
-        WUNLOCK(&SMA_LCK(sma, sma->last));
+            *(allocated) = SMA_SLAB_OBJSIZE(n) - SMA_SLAB_TAG_SIZE;
 #ifdef VALGRIND_MALLOCLIKE_BLOCK
-        VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
+            VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
 #endif
-        return p;
+            return p;
+        }
     }
-    
-    WUNLOCK(&SMA_LCK(sma, sma->last));
+#endif
+
+    assert(sma->initialized);
+
+    /* start with the segment that has the most room and the fewest processes on it */
+    j = sma_choose(sma, n + fragment);
 
+restart:
     for (i = 0; i < sma->num; i++) {
-        if (i == sma->last) {
-            continue;
-        }
-        WLOCK(&SMA_LCK(sma, i));
-        off = sma_allocate(SMA_HDR(sma, i), n, fragment, allocated);
-        if(off == -1) { 
-            /* retry failed allocation after we expunge */
-            WUNLOCK(&SMA_LCK(sma, i));
-			sma->expunge(
-				*(sma->data), (n+fragment) TSRMLS_CC);
-            WLOCK(&SMA_LCK(sma, i));
-            off = sma_allocate(SMA_HDR(sma, i), n, fragment, allocated);
-        }
+        uint seg = (j + i) % sma->num;
+
+        SMA_WLOCK(sma, seg);
+        off = sma_alloc(SMA_HDR(sma, seg), n, fragment, allocated);
         if (off != -1) {
-            void* p = (void *)(SMA_ADDR(sma, i) + off);
-            WUNLOCK(&SMA_LCK(sma, i));
-            sma->last = i;
+            void* p = (void *)(SMA_ADDR(sma, seg) + off);
+#ifdef APC_SMA_MAGAZINES
+            if (rack && SMA_SLABBED(n)) {
+                sma_refill(sma, rack, seg, n);
+            }
+#endif
+            SMA_WUNLOCK(sma, seg);
+            sma->last = seg;
 #ifdef VALGRIND_MALLOCLIKE_BLOCK
             VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
 #endif
             return p;
         }
-        WUNLOCK(&SMA_LCK(sma, i));
+        SMA_WUNLOCK(sma, seg);
+    }
+
+    /* every segment is exhausted, take more of the memory mapped for them before giving up entries */
+    if (sma->grow && !expunged) {
+        for (i = 0; i < sma->num; i++) {
+            uint seg = (j + i) % sma->num;
+            zend_bool grown;
+
+            SMA_WLOCK(sma, seg);
+            grown = sma_grow(sma, seg, n + fragment);
+            SMA_WUNLOCK(sma, seg);
+
+            if (grown) {
+                j = seg;
+                goto restart;
+            }
+        }
+    }
+
+    /* the caller would rather go without than give up entries */
+    if (!expunge) {
+        return NULL;
     }
 
-    /* I've tried being nice, but now you're just asking for it */
-    if(!nuked) {
+    /* retry after we expunge, and once more after the expunge can do no more */
+    if (expunged < 2) {
+        if (!expunged) {
+            apc_sma_api_flush(sma TSRMLS_CC);
+        }
         sma->expunge(*(sma->data), (n+fragment) TSRMLS_CC);
-        nuked = 1;
+        expunged++;
         goto restart;
     }
 
@@ -441,6 +1229,42 @@ restart:
 
     return NULL;
 }
+/* }}} */
+
+PHP_APCU_API void* apc_sma_api_malloc_ex(apc_sma_t* sma, zend_ulong n, zend_ulong fragment, zend_ulong* allocated TSRMLS_DC) {
+	return sma_malloc(sma, n, fragment, allocated, 1 TSRMLS_CC);
+}
+
+PHP_APCU_API void* apc_sma_api_try_malloc(apc_sma_t* sma, zend_ulong n TSRMLS_DC) {
+	zend_ulong allocated;
+	return sma_malloc(
+		sma, n, MINBLOCKSIZE, &allocated, 0 TSRMLS_CC);
+}
+
+PHP_APCU_API void* apc_sma_api_malloc_low(apc_sma_t* sma, zend_ulong n TSRMLS_DC) {
+    zend_ulong allocated;
+    size_t off;
+    uint i;
+
+    assert(sma->initialized);
+
+    /* neither slabs nor magazines, whose objects may be anywhere, nor growth or expunge */
+    for (i = 0; i < sma->num; i++) {
+        SMA_WLOCK(sma, i);
+        off = sma_allocate_low(SMA_HDR(sma, i), n, MINBLOCKSIZE, &allocated);
+        SMA_WUNLOCK(sma, i);
+
+        if (off != -1) {
+            void* p = (void *)(SMA_ADDR(sma, i) + off);
+#ifdef VALGRIND_MALLOCLIKE_BLOCK
+            VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
+#endif
+            return p;
+        }
+    }
+
+    return NULL;
+}
 
 PHP_APCU_API void* apc_sma_api_malloc(apc_sma_t* sma, zend_ulong n TSRMLS_DC) 
 {
@@ -478,6 +1302,10 @@ PHP_APCU_API char* apc_sma_api_strdup(apc_sma_t* sma, const char* s TSRMLS_DC) {
 PHP_APCU_API void apc_sma_api_free(apc_sma_t* sma, void* p TSRMLS_DC) {
 	uint i;
     size_t offset;
+#ifdef APC_SMA_MAGAZINES
+    sma_magazine_t* mag = NULL;
+    sma_rack_t* rack;
+#endif
 
     if (p == NULL) {
         return;
@@ -485,12 +1313,34 @@ PHP_APCU_API void apc_sma_api_free(apc_sma_t* sma, void* p TSRMLS_DC) {
 
     assert(sma->initialized);
 
+#ifdef APC_SMA_MAGAZINES
+    rack = sma_rack(sma);
+#endif
+
     for (i = 0; i < sma->num; i++) {
         offset = (size_t)((char *)p - SMA_ADDR(sma, i));
         if (p >= (void*)SMA_ADDR(sma, i) && offset < sma->size) {
-            WLOCK(&SMA_LCK(sma, i));
-            sma_deallocate(SMA_HDR(sma, i), offset);
-            WUNLOCK(&SMA_LCK(sma, i));
+#ifdef APC_SMA_MAGAZINES
+            if (rack) {
+                mag = sma_magazine_of(rack, sma, i, p);
+            }
+            if (mag && mag->count < SMA_MAGAZINE_SIZE) {
+                mag->objects[mag->count++] = p;
+#ifdef VALGRIND_FREELIKE_BLOCK
+                VALGRIND_FREELIKE_BLOCK(p, 0);
+#endif
+                return;
+            }
+#endif
+            SMA_WLOCK(sma, i);
+            sma_free(SMA_HDR(sma, i), offset);
+#ifdef APC_SMA_MAGAZINES
+            if (mag) {
+                /* the magazine overflowed, return a batch along with this object */
+                sma_drain(sma, i, mag, SMA_MAGAZINE_REFILL);
+            }
+#endif
+            SMA_WUNLOCK(sma, i);
 #ifdef VALGRIND_FREELIKE_BLOCK
             VALGRIND_FREELIKE_BLOCK(p, 0);
 #endif
@@ -561,9 +1411,10 @@ PHP_APCU_API void* apc_sma_api_unprotect(apc_sma_t* sma, void *p) { return p; }
 PHP_APCU_API apc_sma_info_t* apc_sma_api_info(apc_sma_t* sma, zend_bool limited TSRMLS_DC) {
 	apc_sma_info_t* info;
     apc_sma_link_t** link;
+    apc_sma_slab_t** slink;
     uint i;
+    int c;
     char* shmaddr;
-    block_t* prv;
 
     if (!sma->initialized) {
         return NULL;
@@ -571,11 +1422,43 @@ PHP_APCU_API apc_sma_info_t* apc_sma_api_info(apc_sma_t* sma, zend_bool limited
 
     info = (apc_sma_info_t*) apc_emalloc(sizeof(apc_sma_info_t) TSRMLS_CC);
     info->num_seg = sma->num;
-    info->seg_size = sma->size - (ALIGNWORD(sizeof(sma_header_t)) + ALIGNWORD(sizeof(block_t)) + ALIGNWORD(sizeof(block_t)));
+    info->seg_size = 0;
+    for (i = 0; i < sma->num; i++) {
+        info->seg_size += SMA_HDR(sma, i)->segsize;
+    }
+    info->seg_size = (info->seg_size / sma->num) - (ALIGNWORD(sizeof(sma_header_t)) + ALIGNWORD(sizeof(block_t)) + ALIGNWORD(sizeof(block_t)));
+    info->max_seg_size = sma->size - (ALIGNWORD(sizeof(sma_header_t)) + ALIGNWORD(sizeof(block_t)) + ALIGNWORD(sizeof(block_t)));
+    info->page_size = sma->segs[0].pagesize;
+
+    info->fragmentation = apc_sma_api_fragmentation(sma TSRMLS_CC);
+
+    /* the counts are kept up to date by every allocation, they are read without locking */
+    info->largest = 0;
+    info->num_classes = 0;
+    info->classes = apc_emalloc(SMA_CLASSES * sizeof(apc_sma_class_t) TSRMLS_CC);
+    for (c = 0; c < SMA_CLASSES; c++) {
+        long count = 0;
+
+        for (i = 0; i < sma->num; i++) {
+            count += SMA_HDR(sma, i)->nfree[c];
+        }
+        if (count) {
+            info->classes[info->num_classes].size = sma_class_size(c);
+            info->classes[info->num_classes].count = count;
+            info->num_classes++;
+        }
+    }
+    for (i = 0; i < sma->num; i++) {
+        if (SMA_HDR(sma, i)->largest > info->largest) {
+            info->largest = SMA_HDR(sma, i)->largest;
+        }
+    }
 
     info->list = apc_emalloc(info->num_seg * sizeof(apc_sma_link_t*) TSRMLS_CC);
+    info->slabs = apc_emalloc(info->num_seg * sizeof(apc_sma_slab_t*) TSRMLS_CC);
     for (i = 0; i < sma->num; i++) {
         info->list[i] = NULL;
+        info->slabs[i] = NULL;
     }
 
     if(limited) {
@@ -586,23 +1469,48 @@ PHP_APCU_API apc_sma_info_t* apc_sma_api_info(apc_sma_t* sma, zend_bool limited
     for (i = 0; i < sma->num; i++) {
         RLOCK(&SMA_LCK(sma, i));
         shmaddr = SMA_ADDR(sma, i);
-        prv = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
 
         link = &info->list[i];
 
-        /* For each block in this segment */
-        while (BLOCKAT(prv->fnext)->fnext != 0) {
-            block_t* cur = BLOCKAT(prv->fnext);
-			
-			CHECK_CANARY(cur);
+        /* For each free block in this segment, smallest class first */
+        for (c = 0; c < SMA_CLASSES; c++) {
+            size_t off = SMA_HDR(sma, i)->free[c];
+
+            while (off) {
+                block_t* cur = BLOCKAT(off);
+
+                CHECK_CANARY(cur);
 
-            *link = apc_emalloc(sizeof(apc_sma_link_t) TSRMLS_CC);
-            (*link)->size = cur->size;
-            (*link)->offset = prv->fnext;
-            (*link)->next = NULL;
-            link = &(*link)->next;
+                *link = apc_emalloc(sizeof(apc_sma_link_t) TSRMLS_CC);
+                (*link)->size = cur->size;
+                (*link)->offset = off;
+                (*link)->next = NULL;
+                link = &(*link)->next;
 
-            prv = cur;
+                off = cur->fnext;
+            }
+        }
+
+        slink = &info->slabs[i];
+
+        /* For each slab in this segment, partial before full */
+        for (c = 0; c < SMA_SLAB_CLASSES * 2; c++) {
+            sma_slab_class_t* class = &SMA_HDR(sma, i)->slabs[c / 2];
+            size_t off = (c % 2) ? class->full : class->partial;
+
+            while (off) {
+                sma_slab_t* slab = SMA_SLABAT(off);
+
+                *slink = apc_emalloc(sizeof(apc_sma_slab_t) TSRMLS_CC);
+                (*slink)->size = slab->size - SMA_SLAB_TAG_SIZE;
+                (*slink)->offset = off;
+                (*slink)->count = slab->count;
+                (*slink)->used = slab->used;
+                (*slink)->next = NULL;
+                slink = &(*slink)->next;
+
+                off = slab->snext;
+            }
         }
         RUNLOCK(&SMA_LCK(sma, i));
     }
@@ -621,6 +1529,16 @@ PHP_APCU_API void apc_sma_api_free_info(apc_sma_t* sma, apc_sma_info_t* info TSR
             apc_efree(q TSRMLS_CC);
         }
     }
+    for (i = 0; i < info->num_seg; i++) {
+        apc_sma_slab_t* p = info->slabs[i];
+        while (p) {
+            apc_sma_slab_t* q = p;
+            p = p->next;
+            apc_efree(q TSRMLS_CC);
+        }
+    }
+    apc_efree(info->classes TSRMLS_CC);
+    apc_efree(info->slabs TSRMLS_CC);
     apc_efree(info->list TSRMLS_CC);
     apc_efree(info TSRMLS_CC);
 }
@@ -648,11 +1566,100 @@ PHP_APCU_API zend_bool apc_sma_api_get_avail_size(apc_sma_t* sma, size_t size) {
     return 0;
 }
 
+PHP_APCU_API double apc_sma_api_fragmentation(apc_sma_t* sma TSRMLS_DC) {
+    size_t avail = 0;
+    size_t largest = 0;
+    uint i;
+
+    /* read without locking, a segment changing underneath may make the sums disagree a little */
+    for (i = 0; i < sma->num; i++) {
+        avail += SMA_HDR(sma, i)->avail;
+        largest += SMA_HDR(sma, i)->largest;
+    }
+
+    if (!avail || largest >= avail) {
+        return 0.0;
+    }
+
+    return 1.0 - ((double) largest / (double) avail);
+}
+
+PHP_APCU_API zend_bool apc_sma_api_movable(apc_sma_t* sma, void* p TSRMLS_DC) {
+    zend_bool movable = 0;
+    uint i;
+
+    for (i = 0; i < sma->num; i++) {
+        char* shmaddr = SMA_ADDR(sma, i);
+        size_t offset = (size_t)((char *)p - shmaddr);
+
+        if (p >= (void*)shmaddr && offset < sma->size) {
+            RLOCK(&SMA_LCK(sma, i));
+            /* objects in slabs are left alone, a slab is freed whole */
+            if (!(SMA_TAG(offset) & 1)) {
+                block_t* cur = BLOCKAT(offset - ALIGNWORD(sizeof(block_t)));
+
+                /* the memory it leaves must coalesce, and there must be room for it further down */
+                if ((cur->prev_size != 0) || SMA_FREE(NEXT_SBLOCK(cur))) {
+                    size_t lowest = sma_lowest(SMA_HDR(sma, i), cur->size);
+
+                    movable = lowest && lowest < OFFSET(cur);
+                }
+            }
+            RUNLOCK(&SMA_LCK(sma, i));
+            break;
+        }
+    }
+
+    return movable;
+}
+
+/* {{{ sma_position: the segment of p, and its offset in that segment */
+static void sma_position(apc_sma_t* sma, void* p, uint* seg, size_t* offset)
+{
+    uint i;
+
+    for (i = 0; i < sma->num; i++) {
+        *offset = (size_t)((char *)p - SMA_ADDR(sma, i));
+        if (p >= (void*)SMA_ADDR(sma, i) && *offset < sma->size) {
+            *seg = i;
+            return;
+        }
+    }
+
+    *seg = sma->num;
+    *offset = 0;
+}
+/* }}} */
+
+PHP_APCU_API zend_bool apc_sma_api_lower(apc_sma_t* sma, void* p, void* q) {
+    uint ps, qs;
+    size_t po, qo;
+
+    sma_position(sma, p, &ps, &po);
+    sma_position(sma, q, &qs, &qo);
+
+    return (ps < qs) || (ps == qs && po < qo);
+}
+
 PHP_APCU_API void apc_sma_api_check_integrity(apc_sma_t* sma)
 {
     /* dummy */
 }
 
+PHP_APCU_API void apc_sma_api_flush(apc_sma_t* sma TSRMLS_DC) {
+#ifdef APC_SMA_MAGAZINES
+    sma_rack_t* rack;
+
+    if (!sma->initialized || !sma->magazines) {
+        return;
+    }
+
+    if ((rack = sma_rack(sma))) {
+        sma_empty(sma, rack);
+    }
+#endif
+}
+
 /* {{{ APC SMA */
 apc_sma_api_impl(apc_sma, &apc_user_cache, apc_cache_default_expunge); 
 /* }}} */
@@ -31,9 +31,16 @@
     Skip to the bottom macros for error free usage of the SMA API
 */
 
+/* {{{ pages backing segments */
+#define APC_SMA_PAGES_ADVISE   0x01 /* ask for transparent huge pages */
+#define APC_SMA_PAGES_HUGE     0x02 /* map explicit huge pages, which the administrator must reserve */
+#define APC_SMA_PAGES_PREFAULT 0x04 /* fault every page in when the segment is created */
+#define APC_SMA_PAGES_NORESERVE 0x08 /* do not reserve swap or huge pages for memory that is not yet used */ /* }}} */
+
 /* {{{ struct definition: apc_segment_t */
 typedef struct _apc_segment_t {
     size_t size;            /* size of this segment */
+    size_t pagesize;        /* size of the pages backing it */
     void* shmaddr;          /* address of shared memory */
 #ifdef APC_MEMPROTECT
     void* roaddr;           /* read only (mprotect'd) address */
@@ -49,20 +56,49 @@ struct apc_sma_link_t {
 };
 /* }}} */
 
+/* {{{ struct definition: apc_sma_slab_t */
+typedef struct apc_sma_slab_t apc_sma_slab_t;
+struct apc_sma_slab_t {
+    long size;              /* size of each object in this slab */
+    long offset;            /* offset in segment of this slab */
+    long count;             /* number of objects this slab holds */
+    long used;              /* number of objects in use */
+    apc_sma_slab_t* next;   /* link to next slab */
+};
+/* }}} */
+
+/* {{{ struct definition: apc_sma_class_t */
+typedef struct apc_sma_class_t apc_sma_class_t;
+struct apc_sma_class_t {
+    long size;              /* smallest size of a free block in this class */
+    long count;             /* number of free blocks in this class, over all segments */
+};
+/* }}} */
+
 /* {{{ struct definition: apc_sma_info_t */
 typedef struct apc_sma_info_t apc_sma_info_t;
 struct apc_sma_info_t {
     int num_seg;            /* number of segments */
-    size_t seg_size;        /* segment size */
+    size_t seg_size;        /* segment size, on average while segments grow */
+    size_t max_seg_size;    /* size segments can grow to */
+    size_t page_size;       /* size of the pages backing the segments */
     apc_sma_link_t** list;  /* one list per segment of links */
+    apc_sma_slab_t** slabs; /* one list per segment of slabs */
+    double fragmentation;   /* share of available memory outside the largest free block of each segment */
+    size_t largest;         /* largest free block of any segment */
+    int num_classes;        /* number of classes with free blocks */
+    apc_sma_class_t* classes; /* free blocks counted by size, smallest first */
 };
 /* }}} */
 
 /* {{{ function definitions for SMA API objects */
 typedef void (*apc_sma_init_f) (zend_uint num, zend_ulong size, char *mask TSRMLS_DC);
+typedef void (*apc_sma_init_ex_f) (zend_uint num, zend_ulong size, zend_ulong max_size, int pages, char *mask TSRMLS_DC);
 typedef void (*apc_sma_cleanup_f) (TSRMLS_D); 
 typedef void* (*apc_sma_malloc_f) (zend_ulong size TSRMLS_DC);
 typedef void* (*apc_sma_malloc_ex_f) (zend_ulong size, zend_ulong fragment, zend_ulong *allocated TSRMLS_DC);
+typedef void* (*apc_sma_try_malloc_f) (zend_ulong size TSRMLS_DC);
+typedef void* (*apc_sma_malloc_low_f) (zend_ulong size TSRMLS_DC);
 typedef void* (*apc_sma_realloc_f) (void* p, zend_ulong size TSRMLS_DC);
 typedef char* (*apc_sma_strdup_f) (const char* str TSRMLS_DC);
 typedef void (*apc_sma_free_f) (void *p TSRMLS_DC);
@@ -73,6 +109,7 @@ typedef void (*apc_sma_free_info_f) (apc_sma_info_t *info TSRMLS_DC);
 typedef zend_ulong (*apc_sma_get_avail_mem_f) (void);
 typedef zend_bool (*apc_sma_get_avail_size_f) (zend_ulong size);
 typedef void (*apc_sma_check_integrity_f) (void); 
+typedef void (*apc_sma_flush_f) (TSRMLS_D);
 typedef void (*apc_sma_expunge_f)(void* pointer, zend_ulong size TSRMLS_DC); /* }}} */
 
 /* {{{ struct definition: apc_sma_t */
@@ -81,9 +118,12 @@ typedef struct _apc_sma_t {
 
     /* functions */
     apc_sma_init_f init;                         /* init */
+    apc_sma_init_ex_f init_ex;                   /* init, with growth and pages */
     apc_sma_cleanup_f cleanup;                   /* cleanup */
     apc_sma_malloc_f smalloc;                    /* malloc */
     apc_sma_malloc_ex_f malloc_ex;               /* malloc_ex */
+    apc_sma_try_malloc_f try_malloc;             /* malloc, without expunging */
+    apc_sma_malloc_low_f malloc_low;             /* malloc, at the lowest address */
     apc_sma_realloc_f realloc;                   /* realloc */
     apc_sma_strdup_f strdup;                     /* strdup */
     apc_sma_free_f sfree;                        /* free */
@@ -94,6 +134,7 @@ typedef struct _apc_sma_t {
     apc_sma_get_avail_mem_f get_avail_mem;       /* get avail mem */
     apc_sma_get_avail_size_f get_avail_size;     /* get avail size */
     apc_sma_check_integrity_f check_integrity;   /* check integrity */
+    apc_sma_flush_f flush;                       /* flush */
 
 	/* callback */
 	apc_sma_expunge_f expunge;                   /* expunge */
@@ -101,11 +142,17 @@ typedef struct _apc_sma_t {
 	
     /* info */
     zend_uint  num;                              /* number of segments */
-    zend_ulong size;                             /* segment size */
+    zend_ulong size;                             /* segment size, as mapped */
     zend_uint  last;                             /* last segment */
 
     /* segments */
     apc_segment_t* segs;                         /* segments */
+
+    /* magazines */
+    void* magazines;                             /* small objects held by this process */
+
+    /* growth */
+    zend_ulong grow;                             /* bytes a full segment grows by, 0 if segments do not grow */
 } apc_sma_t; /* }}} */
 
 /*
@@ -120,6 +167,22 @@ PHP_APCU_API void apc_sma_api_init(apc_sma_t* sma,
                                    zend_ulong size,
                                    char *mask TSRMLS_DC);
 
+/*
+* apc_sma_api_init_ex will initialize a shared memory allocator as apc_sma_api_init does, with
+* segments that grow up to max_size when it is larger than size, and pages backed as the
+* APC_SMA_PAGES_ADVISE, APC_SMA_PAGES_HUGE and APC_SMA_PAGES_PREFAULT flags in pages ask
+*
+* apc_sma_api_init is apc_sma_api_init_ex with segments of a fixed size on the pages the system chooses
+*/
+PHP_APCU_API void apc_sma_api_init_ex(apc_sma_t* sma,
+                                      void** data,
+                                      apc_sma_expunge_f expunge,
+                                      zend_uint num,
+                                      zend_ulong size,
+                                      zend_ulong max_size,
+                                      int pages,
+                                      char *mask TSRMLS_DC);
+
 /*
 * apc_sma_api_cleanup will free the sma allocator
 */
@@ -139,6 +202,20 @@ PHP_APCU_API void* apc_sma_api_malloc_ex(apc_sma_t* sma,
                                          zend_ulong fragment, 
                                          zend_ulong* allocated TSRMLS_DC);
 
+/*
+* apc_sma_api_try_malloc will allocate a block from the sma of the given size, like apc_sma_api_malloc,
+* but returns NULL rather than call the expunge callback when the sma is full
+*/
+PHP_APCU_API void* apc_sma_api_try_malloc(apc_sma_t* sma,
+                                          zend_ulong size TSRMLS_DC);
+
+/*
+* apc_sma_api_malloc_low will allocate a block from the sma of the given size, from the free block that
+* comes first in the first segment that has one, see apc_sma_api_lower; it never grows segments nor expunges
+*/
+PHP_APCU_API void* apc_sma_api_malloc_low(apc_sma_t* sma,
+                                          zend_ulong size TSRMLS_DC);
+
 /*
 * apc_sma_api_realloc will reallocate p using a new block from sma (freeing the original p)
 */
@@ -196,7 +273,31 @@ PHP_APCU_API zend_bool apc_sma_api_get_avail_size(apc_sma_t* sma,
 /*
 * apc_sma_api_check_integrity will check the integrity of sma
 */
-PHP_APCU_API void apc_sma_api_check_integrity(apc_sma_t* sma); /* }}} */
+PHP_APCU_API void apc_sma_api_check_integrity(apc_sma_t* sma);
+
+/*
+* apc_sma_api_fragmentation returns the share of available memory outside the largest free block of each segment
+*/
+PHP_APCU_API double apc_sma_api_fragmentation(apc_sma_t* sma TSRMLS_DC);
+
+/*
+* apc_sma_api_movable returns true if p could be moved to a free block before it in its segment,
+* and the memory it leaves would coalesce with free memory on either side of it
+*/
+PHP_APCU_API zend_bool apc_sma_api_movable(apc_sma_t* sma,
+                                           void* p TSRMLS_DC);
+
+/*
+* apc_sma_api_lower returns true if p comes before q: in an earlier segment, or before it in the same segment
+*/
+PHP_APCU_API zend_bool apc_sma_api_lower(apc_sma_t* sma,
+                                         void* p,
+                                         void* q);
+
+/*
+* apc_sma_api_flush will return the small objects this process holds in its magazines to sma
+*/
+PHP_APCU_API void apc_sma_api_flush(apc_sma_t* sma TSRMLS_DC); /* }}} */
 
 /* {{{ ALIGNWORD: pad up x, aligned to the system's word boundary */
 typedef union { void* p; int i; long l; double d; void (*f)(void); } apc_word_t;
@@ -222,9 +323,12 @@ typedef union { void* p; int i; long l; double d; void (*f)(void); } apc_word_t;
 /* {{{ Call in a header somewhere to extern all sma functions */
 #define apc_sma_api_decl(name) \
     PHP_APCU_API void apc_sma_api_func(name, init)(zend_uint num, zend_ulong size, char* mask TSRMLS_DC); \
+    PHP_APCU_API void apc_sma_api_func(name, init_ex)(zend_uint num, zend_ulong size, zend_ulong max_size, int pages, char* mask TSRMLS_DC); \
     PHP_APCU_API void apc_sma_api_func(name, cleanup)(TSRMLS_D); \
     PHP_APCU_API void* apc_sma_api_func(name, malloc)(zend_ulong size TSRMLS_DC); \
     PHP_APCU_API void* apc_sma_api_func(name, malloc_ex)(zend_ulong size, zend_ulong fragment, zend_ulong* allocated TSRMLS_DC); \
+    PHP_APCU_API void* apc_sma_api_func(name, try_malloc)(zend_ulong size TSRMLS_DC); \
+    PHP_APCU_API void* apc_sma_api_func(name, malloc_low)(zend_ulong size TSRMLS_DC); \
     PHP_APCU_API void* apc_sma_api_func(name, realloc)(void* p, zend_ulong size TSRMLS_DC); \
     PHP_APCU_API char* apc_sma_api_func(name, strdup)(const char* s TSRMLS_DC); \
     PHP_APCU_API void apc_sma_api_func(name, free)(void* p TSRMLS_DC); \
@@ -234,15 +338,19 @@ typedef union { void* p; int i; long l; double d; void (*f)(void); } apc_word_t;
     PHP_APCU_API void apc_sma_api_func(name, free_info)(apc_sma_info_t* info TSRMLS_DC); \
     PHP_APCU_API zend_ulong apc_sma_api_func(name, get_avail_mem)(void); \
     PHP_APCU_API zend_bool apc_sma_api_func(name, get_avail_size)(zend_ulong size); \
-    PHP_APCU_API void apc_sma_api_func(name, check_integrity)(void); /* }}} */
+    PHP_APCU_API void apc_sma_api_func(name, check_integrity)(void); \
+    PHP_APCU_API void apc_sma_api_func(name, flush)(TSRMLS_D); /* }}} */
 
 /* {{{ Call in a compilation unit */
 #define apc_sma_api_impl(name, data, expunge) \
 	apc_sma_t apc_sma_api_name(name) = {0, \
         &apc_sma_api_func(name, init), \
+        &apc_sma_api_func(name, init_ex), \
         &apc_sma_api_func(name, cleanup), \
         &apc_sma_api_func(name, malloc), \
         &apc_sma_api_func(name, malloc_ex), \
+        &apc_sma_api_func(name, try_malloc), \
+        &apc_sma_api_func(name, malloc_low), \
         &apc_sma_api_func(name, realloc), \
         &apc_sma_api_func(name, strdup), \
         &apc_sma_api_func(name, free), \
@@ -253,15 +361,22 @@ typedef union { void* p; int i; long l; double d; void (*f)(void); } apc_word_t;
         &apc_sma_api_func(name, get_avail_mem), \
         &apc_sma_api_func(name, get_avail_size), \
         &apc_sma_api_func(name, check_integrity), \
+        &apc_sma_api_func(name, flush), \
     }; \
     PHP_APCU_API void apc_sma_api_func(name, init)(zend_uint num, zend_ulong size, char* mask TSRMLS_DC) \
         { apc_sma_api_init(apc_sma_api_ptr(name), (void**) data, (apc_sma_expunge_f) expunge, num, size, mask TSRMLS_CC); } \
+    PHP_APCU_API void apc_sma_api_func(name, init_ex)(zend_uint num, zend_ulong size, zend_ulong max_size, int pages, char* mask TSRMLS_DC) \
+        { apc_sma_api_init_ex(apc_sma_api_ptr(name), (void**) data, (apc_sma_expunge_f) expunge, num, size, max_size, pages, mask TSRMLS_CC); } \
     PHP_APCU_API void apc_sma_api_func(name, cleanup)(TSRMLS_D) \
         { apc_sma_api_cleanup(apc_sma_api_ptr(name) TSRMLS_CC); } \
     PHP_APCU_API void* apc_sma_api_func(name, malloc)(zend_ulong size TSRMLS_DC) \
         { return apc_sma_api_malloc(apc_sma_api_ptr(name), size TSRMLS_CC); } \
     PHP_APCU_API void* apc_sma_api_func(name, malloc_ex)(zend_ulong size, zend_ulong fragment, zend_ulong* allocated TSRMLS_DC) \
         { return apc_sma_api_malloc_ex(apc_sma_api_ptr(name), size, fragment, allocated TSRMLS_CC); } \
+    PHP_APCU_API void* apc_sma_api_func(name, try_malloc)(zend_ulong size TSRMLS_DC) \
+        { return apc_sma_api_try_malloc(apc_sma_api_ptr(name), size TSRMLS_CC); } \
+    PHP_APCU_API void* apc_sma_api_func(name, malloc_low)(zend_ulong size TSRMLS_DC) \
+        { return apc_sma_api_malloc_low(apc_sma_api_ptr(name), size TSRMLS_CC); } \
     PHP_APCU_API void* apc_sma_api_func(name, realloc)(void* p, zend_ulong size TSRMLS_DC) \
         { return apc_sma_api_realloc(apc_sma_api_ptr(name), p, size TSRMLS_CC); } \
     PHP_APCU_API char* apc_sma_api_func(name, strdup)(const char* s TSRMLS_DC) \
@@ -281,7 +396,9 @@ typedef union { void* p; int i; long l; double d; void (*f)(void); } apc_word_t;
     PHP_APCU_API zend_bool apc_sma_api_func(name, get_avail_size)(zend_ulong size) \
         { return apc_sma_api_get_avail_size(apc_sma_api_ptr(name), size); } \
     PHP_APCU_API void apc_sma_api_func(name, check_integrity)() \
-        { apc_sma_api_check_integrity(apc_sma_api_ptr(name)); }  /* }}} */
+        { apc_sma_api_check_integrity(apc_sma_api_ptr(name)); } \
+    PHP_APCU_API void apc_sma_api_func(name, flush)(TSRMLS_D) \
+        { apc_sma_api_flush(apc_sma_api_ptr(name) TSRMLS_CC); }  /* }}} */
 
 /* {{{ Call wherever access to the SMA object is required */
 #define apc_sma_api_extern(name)     extern apc_sma_t apc_sma_api_name(name) /* }}} */
@@ -95,7 +95,7 @@ PHP_MINIT_FUNCTION(apcue)
 	apcue_cache = apc_cache_create(
 		&apcue_sma,
         NULL, /* default PHP serializer */
-		10, 0L, 0L, 0L, 1 TSRMLS_CC
+		10, 0L, 0L, 0L, 1, 1, 1, 1, APC_CACHE_EVICT_CLOCK, 0L TSRMLS_CC
 	);
 
 	return SUCCESS;
@@ -62,6 +62,7 @@ PHP_FUNCTION(apcu_cache_info);
 PHP_FUNCTION(apcu_clear_cache);
 PHP_FUNCTION(apcu_sma_info);
 PHP_FUNCTION(apcu_key_info);
+PHP_FUNCTION(apcu_compact);
 PHP_FUNCTION(apcu_store);
 PHP_FUNCTION(apcu_fetch);
 PHP_FUNCTION(apcu_delete);
@@ -70,6 +71,7 @@ PHP_FUNCTION(apcu_inc);
 PHP_FUNCTION(apcu_dec);
 PHP_FUNCTION(apcu_cas);
 PHP_FUNCTION(apcu_exists);
+PHP_FUNCTION(apcu_entry);
 
 PHP_FUNCTION(apcu_bin_dump);
 PHP_FUNCTION(apcu_bin_load);
@@ -147,6 +149,36 @@ static PHP_INI_MH(OnUpdateShmSize) /* {{{ */
 }
 /* }}} */
 
+static PHP_INI_MH(OnUpdateEvictionPolicy) /* {{{ */
+{
+    if (strcasecmp(new_value, "clock") == 0) {
+        APCG(eviction_policy) = APC_CACHE_EVICT_CLOCK;
+    } else if (strcasecmp(new_value, "expunge") == 0) {
+        APCG(eviction_policy) = APC_CACHE_EVICT_EXPUNGE;
+    } else {
+        apc_error("apc.eviction_policy must be one of clock or expunge." TSRMLS_CC);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+/* }}} */
+
+static PHP_INI_MH(OnUpdateHugePages) /* {{{ */
+{
+    if (strcasecmp(new_value, "none") == 0) {
+        APCG(shm_hugepages) = 0;
+    } else if (strcasecmp(new_value, "advise") == 0) {
+        APCG(shm_hugepages) = APC_SMA_PAGES_ADVISE;
+    } else if (strcasecmp(new_value, "explicit") == 0) {
+        APCG(shm_hugepages) = APC_SMA_PAGES_HUGE;
+    } else {
+        apc_error("apc.shm_hugepages must be one of none, advise or explicit." TSRMLS_CC);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+/* }}} */
+
 #ifdef MULTIPART_EVENT_FORMDATA
 static PHP_INI_MH(OnUpdateRfc1867Freq) /* {{{ */
 {
@@ -174,10 +206,25 @@ PHP_INI_BEGIN()
 STD_PHP_INI_BOOLEAN("apc.enabled",      "1",    PHP_INI_SYSTEM, OnUpdateBool,              enabled,          zend_apcu_globals, apcu_globals)
 STD_PHP_INI_ENTRY("apc.shm_segments",   "1",    PHP_INI_SYSTEM, OnUpdateShmSegments,       shm_segments,     zend_apcu_globals, apcu_globals)
 STD_PHP_INI_ENTRY("apc.shm_size",       "32M",  PHP_INI_SYSTEM, OnUpdateShmSize,           shm_size,         zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.shm_max_size",   "0",    PHP_INI_SYSTEM, OnUpdateLong,              shm_max_size,     zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.shm_hugepages",  "none", PHP_INI_SYSTEM, OnUpdateHugePages,         shm_hugepages,    zend_apcu_globals, apcu_globals)
+STD_PHP_INI_BOOLEAN("apc.shm_prefault", "0",    PHP_INI_SYSTEM, OnUpdateBool,              shm_prefault,     zend_apcu_globals, apcu_globals)
 STD_PHP_INI_ENTRY("apc.entries_hint",   "4096", PHP_INI_SYSTEM, OnUpdateLong,              entries_hint,     zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.lock_stripes",   "16",   PHP_INI_SYSTEM, OnUpdateLong,              lock_stripes,     zend_apcu_globals, apcu_globals)
+STD_PHP_INI_BOOLEAN("apc.inline_index", "1",    PHP_INI_SYSTEM, OnUpdateBool,              inline_index,     zend_apcu_globals, apcu_globals)
+STD_PHP_INI_BOOLEAN("apc.lookup_filter", "1",   PHP_INI_SYSTEM, OnUpdateBool,              lookup_filter,    zend_apcu_globals, apcu_globals)
 STD_PHP_INI_ENTRY("apc.gc_ttl",         "3600", PHP_INI_SYSTEM, OnUpdateLong,              gc_ttl,           zend_apcu_globals, apcu_globals)
 STD_PHP_INI_ENTRY("apc.ttl",            "0",    PHP_INI_SYSTEM, OnUpdateLong,              ttl,              zend_apcu_globals, apcu_globals)
 STD_PHP_INI_ENTRY("apc.smart",          "0",    PHP_INI_SYSTEM, OnUpdateLong,              smart,            zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.eviction_policy", "clock", PHP_INI_SYSTEM, OnUpdateEvictionPolicy, eviction_policy,  zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.eviction_headroom", "1M", PHP_INI_SYSTEM, OnUpdateLong,            eviction_headroom, zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.sweep_budget",   "32",   PHP_INI_SYSTEM, OnUpdateLong,              sweep_budget,     zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.sweep_time",     "100",  PHP_INI_SYSTEM, OnUpdateLong,              sweep_time,       zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.compact_budget", "8",    PHP_INI_SYSTEM, OnUpdateLong,              compact_budget,   zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.entry_timeout",  "1000", PHP_INI_SYSTEM, OnUpdateLong,              entry_timeout,    zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.xfetch_beta",    "1.0",  PHP_INI_ALL,    OnUpdateReal,              xfetch_beta,      zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.l1_entries",     "0",    PHP_INI_SYSTEM, OnUpdateLong,              l1_entries,       zend_apcu_globals, apcu_globals)
+STD_PHP_INI_ENTRY("apc.l1_size",        "256K", PHP_INI_SYSTEM, OnUpdateLong,              l1_size,          zend_apcu_globals, apcu_globals)
 #if APC_MMAP
 STD_PHP_INI_ENTRY("apc.mmap_file_mask",  NULL,  PHP_INI_SYSTEM, OnUpdateString,            mmap_file_mask,   zend_apcu_globals, apcu_globals)
 #endif
@@ -281,9 +328,11 @@ static PHP_MINIT_FUNCTION(apcu)
 			
 			/* initialize shared memory allocator */
 #if APC_MMAP
-			apc_sma.init(APCG(shm_segments), APCG(shm_size), APCG(mmap_file_mask) TSRMLS_CC);
+			apc_sma.init_ex(APCG(shm_segments), APCG(shm_size), APCG(shm_max_size),
+				APCG(shm_hugepages) | (APCG(shm_prefault) ? APC_SMA_PAGES_PREFAULT : 0), APCG(mmap_file_mask) TSRMLS_CC);
 #else
-			apc_sma.init(APCG(shm_segments), APCG(shm_size), NULL TSRMLS_CC);
+			apc_sma.init_ex(APCG(shm_segments), APCG(shm_size), APCG(shm_max_size),
+				APCG(shm_hugepages) | (APCG(shm_prefault) ? APC_SMA_PAGES_PREFAULT : 0), NULL TSRMLS_CC);
 #endif
 
 /* XXX pack this into macros when there are more hooks to handle */
@@ -313,9 +362,15 @@ static PHP_MINIT_FUNCTION(apcu)
 			apc_user_cache = apc_cache_create(
 				&apc_sma,
 				apc_find_serializer(APCG(serializer_name) TSRMLS_CC),
-				APCG(entries_hint), APCG(gc_ttl), APCG(ttl), APCG(smart), APCG(slam_defense)
-				TSRMLS_CC
+				APCG(entries_hint), APCG(gc_ttl), APCG(ttl), APCG(smart), APCG(slam_defense),
+				APCG(lock_stripes), APCG(inline_index), APCG(lookup_filter),
+				APCG(eviction_policy), APCG(eviction_headroom) TSRMLS_CC
 			);
+
+			/* the cache local to each process, copied into every child */
+			if (APCG(l1_entries) > 0 && APCG(l1_size) > 0) {
+				apc_cache_l1(apc_user_cache, APCG(l1_entries), APCG(l1_size) TSRMLS_CC);
+			}
 			
 			/* initialize pooling */
 			apc_pool_init();
@@ -326,6 +381,9 @@ static PHP_MINIT_FUNCTION(apcu)
 					apc_user_cache, APCG(preload_path) TSRMLS_CC);
 			}
 
+			/* children must not inherit the objects this process holds */
+			apc_sma.flush(TSRMLS_C);
+
 #ifdef MULTIPART_EVENT_FORMDATA
             /* File upload progress tracking */
             if (APCG(rfc1867)) {
@@ -412,6 +470,9 @@ static PHP_RINIT_FUNCTION(apcu)
 			apc_cache_serializer(apc_user_cache, APCG(serializer_name) TSRMLS_CC);
 		}
 
+		/* register to read the cache without locking, and announce the epoch */
+		apc_cache_enter(apc_user_cache TSRMLS_CC);
+
 #if HAVE_SIGACTION
         apc_set_signals(TSRMLS_C);
 #endif
@@ -420,6 +481,26 @@ static PHP_RINIT_FUNCTION(apcu)
 }
 /* }}} */
 
+/* {{{ PHP_RSHUTDOWN_FUNCTION(apcu) */
+static PHP_RSHUTDOWN_FUNCTION(apcu)
+{
+    if (APCG(enabled)) {
+		/* return the memory of some expired entries */
+		apc_cache_sweep(apc_user_cache, APCG(sweep_budget), APCG(sweep_time) TSRMLS_CC);
+
+		/* move a few entries out of the way of free memory */
+		apc_cache_compact(apc_user_cache, APCG(compact_budget) TSRMLS_CC);
+
+		/* let removed entries go */
+		apc_cache_leave(apc_user_cache TSRMLS_CC);
+
+		/* hand the small objects this process holds back to shared memory */
+		apc_sma.flush(TSRMLS_C);
+    }
+    return SUCCESS;
+}
+/* }}} */
+
 #ifdef APC_FULL_BC
 /* {{{ proto void apc_clear_cache([string cache]) */
 PHP_FUNCTION(apcu_clear_cache)
@@ -517,11 +598,32 @@ PHP_FUNCTION(apcu_key_info)
     RETURN_ZVAL(stat, 0, 1);
 }
 
+/* {{{ proto int apcu_compact([int budget])
+ */
+PHP_FUNCTION(apcu_compact)
+{
+    long budget = APCG(compact_budget);
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &budget) == FAILURE) {
+        return;
+    }
+
+    if (budget < 0) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "budget must not be negative");
+        RETURN_FALSE;
+    }
+
+    RETURN_LONG(apc_cache_compact(apc_user_cache, (zend_uint) budget TSRMLS_CC));
+}
+/* }}} */
+
 /* {{{ proto array apc_sma_info([bool limited]) */
 PHP_FUNCTION(apcu_sma_info)
 {
     apc_sma_info_t* info;
     zval* block_lists;
+    zval* slab_lists;
+    zval* free_blocks;
     int i;
     zend_bool limited = 0;
 
@@ -539,7 +641,21 @@ PHP_FUNCTION(apcu_sma_info)
 
     add_assoc_long(return_value, "num_seg", info->num_seg);
     add_assoc_double(return_value, "seg_size", (double)info->seg_size);
+    add_assoc_double(return_value, "max_seg_size", (double)info->max_seg_size);
+    add_assoc_long(return_value, "page_size", info->page_size);
     add_assoc_double(return_value, "avail_mem", (double)apc_sma.get_avail_mem());
+    add_assoc_double(return_value, "fragmentation", info->fragmentation);
+    add_assoc_double(return_value, "largest_free", (double)info->largest);
+    add_assoc_double(return_value, "compact_before", apc_user_cache->header->compact_before);
+    add_assoc_double(return_value, "compact_after", apc_user_cache->header->compact_after);
+
+    ALLOC_INIT_ZVAL(free_blocks);
+    array_init(free_blocks);
+
+    for (i = 0; i < info->num_classes; i++) {
+        add_index_long(free_blocks, info->classes[i].size, info->classes[i].count);
+    }
+    add_assoc_zval(return_value, "free_blocks", free_blocks);
 
     if (limited) {
         apc_sma.free_info(info TSRMLS_CC);
@@ -569,12 +685,39 @@ PHP_FUNCTION(apcu_sma_info)
         add_next_index_zval(block_lists, list);
     }
     add_assoc_zval(return_value, "block_lists", block_lists);
+
+    ALLOC_INIT_ZVAL(slab_lists);
+    array_init(slab_lists);
+
+    for (i = 0; i < info->num_seg; i++) {
+        apc_sma_slab_t* p;
+        zval* list;
+
+        ALLOC_INIT_ZVAL(list);
+        array_init(list);
+
+        for (p = info->slabs[i]; p != NULL; p = p->next) {
+            zval* slab;
+
+            ALLOC_INIT_ZVAL(slab);
+            array_init(slab);
+
+            add_assoc_long(slab, "size", p->size);
+            add_assoc_long(slab, "offset", p->offset);
+            add_assoc_long(slab, "objects", p->count);
+            add_assoc_long(slab, "used", p->used);
+            add_next_index_zval(list, slab);
+        }
+        add_next_index_zval(slab_lists, list);
+    }
+    add_assoc_zval(return_value, "slab_lists", slab_lists);
     apc_sma.free_info(info TSRMLS_CC);
 }
 /* }}} */
 
-/* {{{ php_apc_update  */
-int php_apc_update(char *strkey, int strkey_len, apc_cache_updater_t updater, void* data TSRMLS_DC) 
+/* {{{ php_apc_update
+    updaters must change the value atomically, see apc_cache_update_atomic for init and ttl */
+int php_apc_update(char *strkey, int strkey_len, apc_cache_updater_t updater, void* data, const zval* init, long ttl TSRMLS_DC) 
 {
     if (!APCG(enabled)) {
         return 0;
@@ -587,7 +730,7 @@ int php_apc_update(char *strkey, int strkey_len, apc_cache_updater_t updater, vo
 
     HANDLE_BLOCK_INTERRUPTIONS();
     
-    if (!apc_cache_update(apc_user_cache, strkey, strkey_len + 1, updater, data TSRMLS_CC)) {
+    if (!apc_cache_update_atomic(apc_user_cache, strkey, strkey_len + 1, updater, data, init, (zend_uint) ttl TSRMLS_CC)) {
         HANDLE_UNBLOCK_INTERRUPTIONS();
         return 0;
     }
@@ -605,8 +748,10 @@ static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const zend_bool exclu
     zval *key = NULL;
     zval *val = NULL;
     long ttl = 0L;
+    long soft_ttl = 0L;
+    zend_bool atomic = 0;
     
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|zl", &key, &val, &ttl) == FAILURE) {
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|zllb", &key, &val, &ttl, &soft_ttl, &atomic) == FAILURE) {
         return;
     }
 
@@ -633,23 +778,52 @@ static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const zend_bool exclu
 
             HashPosition hpos;
             HashTable* hash = Z_ARRVAL_P(key);
+            apc_cache_batch_t* items;
+            zend_uint nitems = 0, i = 0;
+
+            /* collect the string keys, the batch is stored at once */
+            items = safe_emalloc(zend_hash_num_elements(hash) + 1, sizeof(apc_cache_batch_t), 0);
+
+		    zend_hash_internal_pointer_reset_ex(hash, &hpos);
+		    while(zend_hash_get_current_data_ex(hash, (void**)&hentry, &hpos) == SUCCESS) {
+		        if (zend_hash_get_current_key_ex(hash, &hkey, &hkey_len, &hkey_idx, 0, &hpos) == HASH_KEY_IS_STRING) {
+		            items[nitems].str = hkey;
+		            items[nitems].len = hkey_len;
+		            items[nitems].val = *hentry;
+		            nitems++;
+		        }
+		        zend_hash_move_forward_ex(hash, &hpos);
+		    }
+
+		    /* an atomic batch with an integer key cannot be stored entirely */
+		    if (!atomic || nitems == zend_hash_num_elements(hash)) {
+		        apc_cache_store_many(
+		            apc_user_cache, items, nitems, (zend_uint) ttl, (zend_uint) soft_ttl, exclusive, atomic TSRMLS_CC);
+		    } else {
+		        apc_warning("apc_store expects string keys in an atomic batch, nothing was stored." TSRMLS_CC);
+		        for (i = 0; i < nitems; i++) {
+		            items[i].result = 0;
+		        }
+		    }
 
             /* note: only indicative of error */
 		    array_init(return_value);
+		    i = 0;
 		    zend_hash_internal_pointer_reset_ex(hash, &hpos);
 		    while(zend_hash_get_current_data_ex(hash, (void**)&hentry, &hpos) == SUCCESS) {
-		        zend_hash_get_current_key_ex(hash, &hkey, &hkey_len, &hkey_idx, 0, &hpos);
-		        if (hkey) {
-		            if(!apc_cache_store(apc_user_cache, hkey, hkey_len, *hentry, (zend_uint) ttl, exclusive TSRMLS_CC)) {
+		        if (zend_hash_get_current_key_ex(hash, &hkey, &hkey_len, &hkey_idx, 0, &hpos) == HASH_KEY_IS_STRING) {
+		            if (!items[i++].result) {
 		                add_assoc_long_ex(return_value, hkey, hkey_len, -1);  /* -1: insertion error */
 		            }
-                    /* reset key for next element */
-		            hkey = NULL;
 		        } else {
 		            add_index_long(return_value, hkey_idx, -1);  /* -1: insertion error */
 		        }
 		        zend_hash_move_forward_ex(hash, &hpos);
 		    }
+
+		    efree(items);
+
+		    HANDLE_UNBLOCK_INTERRUPTIONS();
 			return;
 		} else {
             if (Z_TYPE_P(key) == IS_STRING) {
@@ -659,7 +833,7 @@ static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const zend_bool exclu
     	            RETURN_FALSE;
     	        }
                 /* return true on success */
-    			if(apc_cache_store(apc_user_cache, Z_STRVAL_P(key), Z_STRLEN_P(key) + 1, val, (zend_uint) ttl, exclusive TSRMLS_CC)) {
+    			if(apc_cache_store_ex(apc_user_cache, Z_STRVAL_P(key), Z_STRLEN_P(key) + 1, val, (zend_uint) ttl, (zend_uint) soft_ttl, 0, exclusive TSRMLS_CC)) {
 			        HANDLE_UNBLOCK_INTERRUPTIONS();
     	            RETURN_TRUE;
                 }
@@ -682,15 +856,15 @@ PHP_FUNCTION(apcu_enabled) {
     RETURN_BOOL(APCG(enabled));
 }  /* }}} */
 
-/* {{{ proto int apc_store(mixed key, mixed var [, long ttl ])
- */
+/* {{{ proto int apc_store(mixed key, mixed var [, long ttl [, long soft_ttl [, bool atomic ]]])
+    an array of key/value pairs is stored at once, and entirely or not at all when atomic is set */
 PHP_FUNCTION(apcu_store) {
     apc_store_helper(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
 }
 /* }}} */
 
-/* {{{ proto int apc_add(mixed key, mixed var [, long ttl ])
- */
+/* {{{ proto int apc_add(mixed key, mixed var [, long ttl [, long soft_ttl [, bool atomic ]]])
+    an array of key/value pairs is added at once, and entirely or not at all when atomic is set */
 PHP_FUNCTION(apcu_add) {
     apc_store_helper(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
 }
@@ -710,8 +884,7 @@ static zend_bool php_inc_updater(apc_cache_t* cache, apc_cache_entry_t* entry, v
     zval* val = entry->val;
 
     if (Z_TYPE_P(val) == IS_LONG) {
-        Z_LVAL_P(val) += args->step;
-        args->lval = Z_LVAL_P(val);
+        args->lval = ATOMIC_ADD(Z_LVAL_P(val), args->step);
         return 1;
     }
 
@@ -719,15 +892,18 @@ static zend_bool php_inc_updater(apc_cache_t* cache, apc_cache_entry_t* entry, v
 }
 /* }}} */
 
-/* {{{ proto long apc_inc(string key [, long step [, bool& success]])
- */
+/* {{{ proto long apc_inc(string key [, long step [, bool& success [, long ttl [, long initial]]]])
+    only when initial is passed, a missing or expired key is created as initial + step, to live for ttl */
 PHP_FUNCTION(apcu_inc) {
     char *strkey;
     int strkey_len;
     struct php_inc_updater_args args = {1L, -1};
     zval *success = NULL;
+    long ttl = 0L;
+    long initial = 0L;
+    zval init;
 
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|lz", &strkey, &strkey_len, &(args.step), &success) == FAILURE) {
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|lzll", &strkey, &strkey_len, &(args.step), &success, &ttl, &initial) == FAILURE) {
         return;
     }
     
@@ -735,7 +911,10 @@ PHP_FUNCTION(apcu_inc) {
 		zval_dtor(success);
 	}
 
-    if (php_apc_update(strkey, strkey_len, php_inc_updater, &args TSRMLS_CC)) {
+    INIT_ZVAL(init);
+    ZVAL_LONG(&init, initial);
+
+    if (php_apc_update(strkey, strkey_len, php_inc_updater, &args, ZEND_NUM_ARGS() > 4 ? &init : NULL, ttl TSRMLS_CC)) {
         if (success) {
 			ZVAL_TRUE(success);
 		}
@@ -751,15 +930,18 @@ PHP_FUNCTION(apcu_inc) {
 }
 /* }}} */
 
-/* {{{ proto long apc_dec(string key [, long step [, bool &success]])
- */
+/* {{{ proto long apc_dec(string key [, long step [, bool &success [, long ttl [, long initial]]]])
+    only when initial is passed, a missing or expired key is created as initial - step, to live for ttl */
 PHP_FUNCTION(apcu_dec) {
     char *strkey;
     int strkey_len;
     struct php_inc_updater_args args = {1L, -1};
     zval *success = NULL;
+    long ttl = 0L;
+    long initial = 0L;
+    zval init;
 
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|lz", &strkey, &strkey_len, &(args.step), &success) == FAILURE) {
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|lzll", &strkey, &strkey_len, &(args.step), &success, &ttl, &initial) == FAILURE) {
         return;
     }
     
@@ -769,7 +951,10 @@ PHP_FUNCTION(apcu_dec) {
 
     args.step = args.step * -1;
 
-    if (php_apc_update(strkey, strkey_len, php_inc_updater, &args TSRMLS_CC)) {
+    INIT_ZVAL(init);
+    ZVAL_LONG(&init, initial);
+
+    if (php_apc_update(strkey, strkey_len, php_inc_updater, &args, ZEND_NUM_ARGS() > 4 ? &init : NULL, ttl TSRMLS_CC)) {
         if (success) ZVAL_TRUE(success);
         RETURN_LONG(args.lval);
     }
@@ -790,10 +975,7 @@ static zend_bool php_cas_updater(apc_cache_t* cache, apc_cache_entry_t* entry, v
     zval* val = entry->val;
 
     if (Z_TYPE_P(val) == IS_LONG) {
-        if (Z_LVAL_P(val) == old) {
-            Z_LVAL_P(val) = new;
-            return 1;
-        }
+        return ATOMIC_CAS(Z_LVAL_P(val), old, new);
     }
 
     return 0;
@@ -811,7 +993,7 @@ PHP_FUNCTION(apcu_cas) {
         return;
     }
 
-    if (php_apc_update(strkey, strkey_len, php_cas_updater, &vals TSRMLS_CC)) {
+    if (php_apc_update(strkey, strkey_len, php_cas_updater, &vals, NULL, 0L TSRMLS_CC)) {
 		RETURN_TRUE;
 	}
 
@@ -823,11 +1005,41 @@ void *apc_erealloc_wrapper(void *ptr, size_t size) {
     return _erealloc(ptr, size, 0 ZEND_FILE_LINE_CC ZEND_FILE_LINE_EMPTY_CC);
 }
 
-/* {{{ proto mixed apc_fetch(mixed key[, bool &success])
- */
+/* {{{ php_apc_lookup_keys
+    collects the string keys of an array for apc_cache_find_many, warning about the others */
+static zend_uint php_apc_lookup_keys(zval *keys, apc_cache_lookup_t **lookup, const char *warning TSRMLS_DC) {
+    HashPosition hpos;
+    zval **hentry;
+    zend_uint nkeys = 0;
+
+    (*lookup) = safe_emalloc(zend_hash_num_elements(Z_ARRVAL_P(keys)) + 1, sizeof(apc_cache_lookup_t), 0);
+
+    zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(keys), &hpos);
+    while (zend_hash_get_current_data_ex(Z_ARRVAL_P(keys), (void**)&hentry, &hpos) == SUCCESS) {
+        if (Z_TYPE_PP(hentry) == IS_STRING) {
+            (*lookup)[nkeys].str = Z_STRVAL_PP(hentry);
+            (*lookup)[nkeys].len = Z_STRLEN_PP(hentry) + 1;
+            nkeys++;
+        } else {
+            /* we do not break loop, we just skip the key */
+            apc_warning(warning TSRMLS_CC);
+        }
+
+        zend_hash_move_forward_ex(Z_ARRVAL_P(keys), &hpos);
+    }
+
+    return nkeys;
+}
+/* }}} */
+
+/* {{{ proto mixed apc_fetch(mixed key[, bool &success [, mixed &refresh]])
+    refresh is set when the caller is elected to refresh a stale value, for an array of keys it
+    is set to the keys the caller is elected to refresh */
 PHP_FUNCTION(apcu_fetch) {
     zval *key;
     zval *success = NULL;
+    zval *refresh = NULL;
+    zend_bool elected = 0;
     apc_cache_entry_t* entry;
     time_t t;
     apc_context_t ctxt = {0,};
@@ -836,7 +1048,7 @@ PHP_FUNCTION(apcu_fetch) {
 		RETURN_FALSE;
 	}
 
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|z", &key, &success) == FAILURE) {
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|zz", &key, &success, &refresh) == FAILURE) {
         return;
     }
 
@@ -846,6 +1058,15 @@ PHP_FUNCTION(apcu_fetch) {
         ZVAL_BOOL(success, 0);
     }
 
+    if (refresh) {
+        zval_dtor(refresh);
+        if (Z_TYPE_P(key) == IS_ARRAY) {
+            array_init(refresh);
+        } else {
+            ZVAL_BOOL(refresh, 0);
+        }
+    }
+
 	if (Z_TYPE_P(key) != IS_STRING && Z_TYPE_P(key) != IS_ARRAY) {
 	    convert_to_string(key);
 	}
@@ -856,10 +1077,20 @@ PHP_FUNCTION(apcu_fetch) {
 		/* initialize a context */
 		if (apc_cache_make_context(apc_user_cache, &ctxt, APC_CONTEXT_NOSHARE, APC_UNPOOL, APC_COPY_OUT, 0 TSRMLS_CC)) {
 			
-			if (Z_TYPE_P(key) == IS_STRING) {
+			if (Z_TYPE_P(key) == IS_STRING && !refresh && apc_user_cache->l1) {
+
+				/* through the cache local to this process, which elects no refreshers */
+				if (apc_cache_fetch_l1(apc_user_cache, Z_STRVAL_P(key), (Z_STRLEN_P(key) + 1), t, return_value TSRMLS_CC)) {
+					/* set success */
+					if (success) {
+						ZVAL_BOOL(success, 1);
+					}
+				} else { ZVAL_BOOL(return_value, 0); }
+
+			} else if (Z_TYPE_P(key) == IS_STRING) {
 
 				/* do find using string as key */
-				if ((entry = apc_cache_find(apc_user_cache, Z_STRVAL_P(key), (Z_STRLEN_P(key) + 1), t TSRMLS_CC))) {
+				if ((entry = apc_cache_find_ex(apc_user_cache, Z_STRVAL_P(key), (Z_STRLEN_P(key) + 1), t, APCG(xfetch_beta), refresh ? &elected : NULL TSRMLS_CC))) {
 				    /* deep-copy returned shm zval to emalloc'ed return_value */
 				    apc_cache_fetch_zval(
 						&ctxt, return_value, entry->val TSRMLS_CC);
@@ -871,49 +1102,57 @@ PHP_FUNCTION(apcu_fetch) {
 						ZVAL_BOOL(success, 1);
 					}
 
+					/* the caller is to refresh the value */
+					if (refresh) {
+						ZVAL_BOOL(refresh, elected);
+					}
+
 				} else { ZVAL_BOOL(return_value, 0); }
 
 			} else if (Z_TYPE_P(key) == IS_ARRAY) {
 
 				/* do find using key as array of strings */
-				HashPosition hpos;
-				zval **hentry;
+				apc_cache_lookup_t *lookup;
+				zend_uint nkeys, i;
 				zval *result;
                 
 				MAKE_STD_ZVAL(result);
 				array_init(result);
-				
-				zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(key), &hpos);
-				while(zend_hash_get_current_data_ex(Z_ARRVAL_P(key), (void**)&hentry, &hpos) == SUCCESS) {
-
-				    if (Z_TYPE_PP(hentry) == IS_STRING) {
-
-				        /* perform find using this index as key */
-						if ((entry = apc_cache_find(apc_user_cache, Z_STRVAL_PP(hentry), (Z_STRLEN_PP(hentry) + 1), t TSRMLS_CC))) {
-							zval *result_entry;
-
-						    /* deep-copy returned shm zval to emalloc'ed return_value */
-						    MAKE_STD_ZVAL(result_entry);
-						    apc_cache_fetch_zval(
-								&ctxt, result_entry, entry->val TSRMLS_CC);
-							/* decrement refcount of entry */
-						    apc_cache_release(
-								apc_user_cache, entry TSRMLS_CC);
-							/* add the emalloced value to return array */
-						    zend_hash_add(
-								Z_ARRVAL_P(result), Z_STRVAL_PP(hentry), Z_STRLEN_PP(hentry) +1, &result_entry, sizeof(zval*), NULL);
+
+				nkeys = php_apc_lookup_keys(
+					key, &lookup, "apc_fetch() expects a string or array of strings." TSRMLS_CC);
+
+				/* find every key at once, the values are copied out afterwards */
+				if (apc_cache_find_many(
+						apc_user_cache, lookup, nkeys, t, APCG(xfetch_beta), refresh ? APC_CACHE_FIND_ELECT : 0 TSRMLS_CC)) {
+
+					for (i = 0; i < nkeys; i++) {
+						zval *result_entry;
+
+						/* don't set values we didn't find */
+						if (!(entry = lookup[i].value)) {
+							continue;
 						}
-				    } else {
 
-						/* we do not break loop, we just skip the key */
-						apc_warning(
-							"apc_fetch() expects a string or array of strings." TSRMLS_CC);
+					    /* deep-copy returned shm zval to emalloc'ed return_value */
+					    MAKE_STD_ZVAL(result_entry);
+					    apc_cache_fetch_zval(
+							&ctxt, result_entry, entry->val TSRMLS_CC);
+						/* decrement refcount of entry */
+					    apc_cache_release(
+							apc_user_cache, entry TSRMLS_CC);
+						/* add the emalloced value to return array */
+					    zend_hash_update(
+							Z_ARRVAL_P(result), lookup[i].str, lookup[i].len, &result_entry, sizeof(zval*), NULL);
+						/* the caller is to refresh this one */
+						if (lookup[i].refresh) {
+							add_next_index_stringl(refresh, lookup[i].str, lookup[i].len - 1, 1);
+						}
 					}
-
-					/* don't set values we didn't find */
-				    zend_hash_move_forward_ex(Z_ARRVAL_P(key), &hpos);
 				}
 
+				efree(lookup);
+
 				RETVAL_ZVAL(result, 0, 1);
 
 				if (success) {
@@ -932,6 +1171,36 @@ PHP_FUNCTION(apcu_fetch) {
 }
 /* }}} */
 
+/* {{{ proto mixed apcu_entry(string key, callable generator [, long ttl [, long soft_ttl]])
+    fetches the value of key, on a miss the generator is called with the key, and what it
+    returns is stored; processes missing the same key at the same time wait for that value */
+PHP_FUNCTION(apcu_entry) {
+    char *strkey;
+    int strkey_len;
+    zend_fcall_info fci = empty_fcall_info;
+    zend_fcall_info_cache fcc = empty_fcall_info_cache;
+    long ttl = 0L;
+    long soft_ttl = 0L;
+
+    if (!APCG(enabled)) {
+        RETURN_FALSE;
+    }
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sf|ll", &strkey, &strkey_len, &fci, &fcc, &ttl, &soft_ttl) == FAILURE) {
+        return;
+    }
+
+    if (APCG(serializer_name)) {
+        /* Avoid race conditions between MINIT of apc and serializer exts like igbinary */
+        apc_cache_serializer(apc_user_cache, APCG(serializer_name) TSRMLS_CC);
+    }
+
+    apc_cache_entry(
+        apc_user_cache, strkey, strkey_len + 1, &fci, &fcc, (zend_uint) ttl, (zend_uint) soft_ttl,
+        APCG(xfetch_beta), APCG(entry_timeout) * 1000L, return_value TSRMLS_CC);
+}
+/* }}} */
+
 /* {{{ proto mixed apc_exists(mixed key)
  */
 PHP_FUNCTION(apcu_exists) {
@@ -961,36 +1230,41 @@ PHP_FUNCTION(apcu_exists) {
 			}
 		}
     } else if (Z_TYPE_P(key) == IS_ARRAY) {
-    	HashPosition hpos;
-		zval **hentry;
+		apc_cache_lookup_t *lookup;
+		zend_uint nkeys, i;
 		zval *result;
 		
         MAKE_STD_ZVAL(result);
         array_init(result); 
 
-        zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(key), &hpos);
-        while (zend_hash_get_current_data_ex(Z_ARRVAL_P(key), (void**)&hentry, &hpos) == SUCCESS) {
-            if (Z_TYPE_PP(hentry) == IS_STRING) {
-               if (apc_cache_exists(apc_user_cache, Z_STRVAL_PP(hentry), Z_STRLEN_PP(hentry) + 1, t TSRMLS_CC)) {
-					zval *result_entry;
-				
-		            MAKE_STD_ZVAL(result_entry);
-		            ZVAL_BOOL(result_entry, 1);
-				
-		            zend_hash_add(
-						Z_ARRVAL_P(result), 
-						Z_STRVAL_PP(hentry), Z_STRLEN_PP(hentry) +1, 
-						&result_entry, sizeof(zval*), NULL
-					);
-		        }
-            } else {
-				apc_warning(
-					"apc_exists() expects a string or array of strings." TSRMLS_CC);
-			}
+        nkeys = php_apc_lookup_keys(
+            key, &lookup, "apc_exists() expects a string or array of strings." TSRMLS_CC);
+
+        if (apc_cache_find_many(apc_user_cache, lookup, nkeys, t, 0.0, APC_CACHE_FIND_PEEK TSRMLS_CC)) {
+            for (i = 0; i < nkeys; i++) {
+                zval *result_entry;
+
+                /* don't set values we didn't find */
+                if (!lookup[i].value) {
+                    continue;
+                }
 
-			/* don't set values we didn't find */
-            zend_hash_move_forward_ex(Z_ARRVAL_P(key), &hpos);
+                /* the caller does not hold a reference */
+                apc_cache_release(apc_user_cache, lookup[i].value TSRMLS_CC);
+
+                MAKE_STD_ZVAL(result_entry);
+                ZVAL_BOOL(result_entry, 1);
+
+                zend_hash_update(
+                    Z_ARRVAL_P(result),
+                    lookup[i].str, lookup[i].len,
+                    &result_entry, sizeof(zval*), NULL
+                );
+            }
         }
+
+        efree(lookup);
+
         RETURN_ZVAL(result, 0, 1);
     } else {
         apc_warning("apc_exists() expects a string or array of strings." TSRMLS_CC);
@@ -1027,6 +1301,23 @@ PHP_FUNCTION(apcu_delete) {
     } else if (Z_TYPE_P(keys) == IS_ARRAY) {
         HashPosition hpos;
         zval **hentry;
+        apc_cache_batch_t* items;
+        zend_uint nitems = 0, i = 0;
+
+        /* collect the string keys, the batch is deleted at once */
+        items = safe_emalloc(zend_hash_num_elements(Z_ARRVAL_P(keys)) + 1, sizeof(apc_cache_batch_t), 0);
+
+        zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(keys), &hpos);
+        while (zend_hash_get_current_data_ex(Z_ARRVAL_P(keys), (void**)&hentry, &hpos) == SUCCESS) {
+            if (Z_TYPE_PP(hentry) == IS_STRING) {
+                items[nitems].str = Z_STRVAL_PP(hentry);
+                items[nitems].len = Z_STRLEN_PP(hentry) + 1;
+                nitems++;
+            }
+            zend_hash_move_forward_ex(Z_ARRVAL_P(keys), &hpos);
+        }
+
+        apc_cache_delete_many(apc_user_cache, items, nitems TSRMLS_CC);
 
         array_init(return_value);
         zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(keys), &hpos);
@@ -1036,12 +1327,14 @@ PHP_FUNCTION(apcu_delete) {
                 apc_warning("apc_delete() expects a string, array of strings, or APCIterator instance." TSRMLS_CC);
                 add_next_index_zval(return_value, *hentry);
                 Z_ADDREF_PP(hentry);
-            } else if (apc_cache_delete(apc_user_cache, Z_STRVAL_PP(hentry), (Z_STRLEN_PP(hentry) + 1) TSRMLS_CC) != 1) {
+            } else if (!items[i++].result) {
                 add_next_index_zval(return_value, *hentry);
                 Z_ADDREF_PP(hentry);
             }
             zend_hash_move_forward_ex(Z_ARRVAL_P(keys), &hpos);
         }
+
+        efree(items);
     } else if (Z_TYPE_P(keys) == IS_OBJECT) {
 
         if (apc_iterator_delete(keys TSRMLS_CC)) {
@@ -1369,6 +1662,8 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_apcu_store, 0, 0, 2)
     ZEND_ARG_INFO(0, key)
     ZEND_ARG_INFO(0, var)
     ZEND_ARG_INFO(0, ttl)
+    ZEND_ARG_INFO(0, soft_ttl)
+    ZEND_ARG_INFO(0, atomic)
 ZEND_END_ARG_INFO()
 
 PHP_APC_ARGINFO
@@ -1407,6 +1702,11 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_apcu_sma_info, 0, 0, 0)
     ZEND_ARG_INFO(0, limited)
 ZEND_END_ARG_INFO()
 
+PHP_APC_ARGINFO
+ZEND_BEGIN_ARG_INFO_EX(arginfo_apcu_compact, 0, 0, 0)
+    ZEND_ARG_INFO(0, budget)
+ZEND_END_ARG_INFO()
+
 PHP_APC_ARGINFO
 ZEND_BEGIN_ARG_INFO(arginfo_apcu_delete, 0)
     ZEND_ARG_INFO(0, keys)
@@ -1416,6 +1716,7 @@ PHP_APC_ARGINFO
 ZEND_BEGIN_ARG_INFO_EX(arginfo_apcu_fetch, 0, 0, 1)
     ZEND_ARG_INFO(0, key)
     ZEND_ARG_INFO(1, success)
+    ZEND_ARG_INFO(1, refresh)
 ZEND_END_ARG_INFO()
 
 
@@ -1424,6 +1725,8 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_apcu_inc, 0, 0, 1)
     ZEND_ARG_INFO(0, key)
     ZEND_ARG_INFO(0, step)
     ZEND_ARG_INFO(1, success)
+    ZEND_ARG_INFO(0, ttl)
+    ZEND_ARG_INFO(0, initial)
 ZEND_END_ARG_INFO()
 
 PHP_APC_ARGINFO
@@ -1433,6 +1736,14 @@ ZEND_BEGIN_ARG_INFO(arginfo_apcu_cas, 0)
     ZEND_ARG_INFO(0, new)
 ZEND_END_ARG_INFO()
 
+PHP_APC_ARGINFO
+ZEND_BEGIN_ARG_INFO_EX(arginfo_apcu_entry, 0, 0, 2)
+    ZEND_ARG_INFO(0, key)
+    ZEND_ARG_INFO(0, generator)
+    ZEND_ARG_INFO(0, ttl)
+    ZEND_ARG_INFO(0, soft_ttl)
+ZEND_END_ARG_INFO()
+
 PHP_APC_ARGINFO
 ZEND_BEGIN_ARG_INFO(arginfo_apcu_exists, 0)
     ZEND_ARG_INFO(0, keys)
@@ -1489,6 +1800,7 @@ zend_function_entry apcu_functions[] = {
     PHP_FE(apcu_clear_cache,        arginfo_apcu_clear_cache)
     PHP_FE(apcu_sma_info,           arginfo_apcu_sma_info)
     PHP_FE(apcu_key_info,           arginfo_apcu_key_info)
+    PHP_FE(apcu_compact,            arginfo_apcu_compact)
     PHP_FE(apcu_enabled,            arginfo_apcu_enabled)
     PHP_FE(apcu_store,              arginfo_apcu_store)
     PHP_FE(apcu_fetch,              arginfo_apcu_fetch)
@@ -1498,6 +1810,7 @@ zend_function_entry apcu_functions[] = {
     PHP_FE(apcu_dec,                arginfo_apcu_inc)
     PHP_FE(apcu_cas,                arginfo_apcu_cas)
     PHP_FE(apcu_exists,             arginfo_apcu_exists)
+    PHP_FE(apcu_entry,              arginfo_apcu_entry)
     PHP_FE(apcu_bin_dump,           arginfo_apcu_bin_dump)
     PHP_FE(apcu_bin_load,           arginfo_apcu_bin_load)
     PHP_FE(apcu_bin_dumpfile,       arginfo_apcu_bin_dumpfile)
@@ -1515,7 +1828,7 @@ zend_module_entry apcu_module_entry = {
     PHP_MINIT(apcu),
     PHP_MSHUTDOWN(apcu),
     PHP_RINIT(apcu),
-    NULL,
+    PHP_RSHUTDOWN(apcu),
     PHP_MINFO(apcu),
     PHP_APCU_VERSION,
     STANDARD_MODULE_PROPERTIES
@@ -0,0 +1,31 @@
+--TEST--
+APC: apcu_entry generates once and stores the value
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+--FILE--
+<?php
+$calls = 0;
+
+$generator = function($key) use(&$calls) {
+	$calls++;
+	return "value of $key";
+};
+
+var_dump(apcu_entry('test', $generator));
+var_dump(apcu_entry('test', $generator));
+var_dump(apcu_fetch('test'));
+var_dump($calls);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+string(13) "value of test"
+string(13) "value of test"
+string(13) "value of test"
+int(1)
+===DONE===
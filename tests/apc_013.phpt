@@ -0,0 +1,44 @@
+--TEST--
+APC: apcu_fetch elects one caller to refresh a stale value
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.use_request_time=0
+apc.xfetch_beta=0
+--FILE--
+<?php
+apcu_store('test', 'stale', 0, 1);
+
+var_dump(apcu_fetch('test', $success, $refresh));
+var_dump($refresh);
+
+sleep(2);
+
+var_dump(apcu_fetch('test', $success, $refresh));
+var_dump($refresh);
+var_dump(apcu_fetch('test', $success, $refresh));
+var_dump($refresh);
+
+var_dump(apcu_fetch(array('test'), $success, $refresh));
+var_dump($refresh);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+string(5) "stale"
+bool(false)
+string(5) "stale"
+bool(true)
+string(5) "stale"
+bool(false)
+array(1) {
+  ["test"]=>
+  string(5) "stale"
+}
+array(0) {
+}
+===DONE===
@@ -0,0 +1,51 @@
+--TEST--
+APC: apcu_fetch/apcu_exists with an array of keys
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+--FILE--
+<?php
+$keys = array();
+for ($i = 0; $i < 8; $i++) {
+	$keys[] = "key$i";
+	if ($i % 2) {
+		apcu_store("key$i", $i);
+	}
+}
+
+var_dump(apcu_fetch($keys, $success));
+var_dump($success);
+var_dump(apcu_exists($keys));
+var_dump(apcu_fetch(array('nokey')));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+array(4) {
+  ["key1"]=>
+  int(1)
+  ["key3"]=>
+  int(3)
+  ["key5"]=>
+  int(5)
+  ["key7"]=>
+  int(7)
+}
+bool(true)
+array(4) {
+  ["key1"]=>
+  bool(true)
+  ["key3"]=>
+  bool(true)
+  ["key5"]=>
+  bool(true)
+  ["key7"]=>
+  bool(true)
+}
+array(0) {
+}
+===DONE===
@@ -0,0 +1,70 @@
+--TEST--
+APC: apcu_add/apcu_store/apcu_delete with arrays, all or nothing
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+--FILE--
+<?php
+apcu_store('b', 'old');
+
+var_dump(apcu_add(array('a' => 1, 'b' => 2, 'c' => 3), null, 0, 0, true));
+var_dump(apcu_exists(array('a', 'b', 'c')));
+
+var_dump(apcu_add(array('a' => 1, 'b' => 2, 'c' => 3)));
+var_dump(apcu_fetch(array('a', 'b', 'c')));
+
+var_dump(apcu_delete(array('a', 'b', 'd')));
+var_dump(apcu_exists(array('a', 'b', 'c')));
+
+var_dump(apcu_store(array('x' => 1, 7 => 2), null, 0, 0, true));
+var_dump(apcu_exists('x'));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+array(3) {
+  ["a"]=>
+  int(-1)
+  ["b"]=>
+  int(-1)
+  ["c"]=>
+  int(-1)
+}
+array(1) {
+  ["b"]=>
+  bool(true)
+}
+array(1) {
+  ["b"]=>
+  int(-1)
+}
+array(3) {
+  ["a"]=>
+  int(1)
+  ["b"]=>
+  string(3) "old"
+  ["c"]=>
+  int(3)
+}
+array(1) {
+  [0]=>
+  string(1) "d"
+}
+array(1) {
+  ["c"]=>
+  bool(true)
+}
+
+Warning: apcu_store(): apc_store expects string keys in an atomic batch, nothing was stored. in %s on line %d
+array(2) {
+  ["x"]=>
+  int(-1)
+  [7]=>
+  int(-1)
+}
+bool(false)
+===DONE===
@@ -0,0 +1,42 @@
+--TEST--
+APC: apcu_inc/apcu_dec create missing counters only when given an initial value
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.use_request_time=0
+--FILE--
+<?php
+var_dump(apcu_inc('missing'));
+var_dump(apcu_inc('counter', 1, $success, 1));
+var_dump($success);
+var_dump(apcu_exists('counter'));
+var_dump(apcu_inc('counter', 1, $success, 1, 0));
+var_dump($success);
+var_dump(apcu_inc('counter', 2, $success, 1));
+var_dump(apcu_dec('other', 3, $success, 0, 10));
+var_dump(apcu_dec('missing', 1, $success, 0));
+var_dump(apcu_exists('missing'));
+
+sleep(2);
+
+var_dump(apcu_inc('counter', 5, $success, 1, 0));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(false)
+bool(false)
+bool(false)
+bool(false)
+int(1)
+bool(true)
+int(3)
+int(7)
+bool(false)
+bool(false)
+int(5)
+===DONE===
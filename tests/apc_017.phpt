@@ -0,0 +1,47 @@
+--TEST--
+APC: apcu_fetch through the process local cache sees changes
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.l1_entries=2
+--FILE--
+<?php
+apcu_store('config', array('a' => 1));
+apcu_store('counter', 1);
+
+var_dump(apcu_fetch('config'));
+var_dump(apcu_fetch('config'));
+
+apcu_store('config', array('a' => 2));
+var_dump(apcu_fetch('config'));
+
+var_dump(apcu_fetch('counter'));
+apcu_inc('counter');
+var_dump(apcu_fetch('counter'));
+
+apcu_delete('config');
+var_dump(apcu_fetch('config'));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+array(1) {
+  ["a"]=>
+  int(1)
+}
+array(1) {
+  ["a"]=>
+  int(1)
+}
+array(1) {
+  ["a"]=>
+  int(2)
+}
+int(1)
+int(2)
+bool(false)
+===DONE===
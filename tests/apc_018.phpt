@@ -0,0 +1,37 @@
+--TEST--
+APC: apcu_sma_info reports slab occupancy
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+--FILE--
+<?php
+for ($i = 0; $i < 10; $i++) {
+	apcu_store("key$i", $i);
+}
+
+$info = apcu_sma_info();
+$used = 0;
+$sane = true;
+
+foreach ($info['slab_lists'] as $slabs) {
+	foreach ($slabs as $slab) {
+		$used += $slab['used'];
+		$sane = $sane && $slab['used'] > 0 && $slab['used'] <= $slab['objects'];
+	}
+}
+
+var_dump(count($info['slab_lists']) == $info['num_seg']);
+var_dump($used >= 10);
+var_dump($sane);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+===DONE===
@@ -0,0 +1,34 @@
+--TEST--
+APC: apcu_sma_info reports fragmentation
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+--FILE--
+<?php
+for ($i = 0; $i < 100; $i++) {
+	apcu_store("key$i", str_repeat('x', 1000 + $i));
+}
+for ($i = 0; $i < 100; $i += 2) {
+	apcu_delete("key$i");
+}
+
+$full = apcu_sma_info();
+$limited = apcu_sma_info(true);
+
+var_dump(is_float($full['fragmentation']));
+var_dump($full['fragmentation'] >= 0 && $full['fragmentation'] <= 1);
+var_dump(isset($limited['fragmentation']));
+var_dump(apcu_fetch('key1') === str_repeat('x', 1001));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+===DONE===
@@ -0,0 +1,27 @@
+--TEST--
+APC: apcu_sma_info reports the page size of prefaulted segments
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_prefault=1
+--FILE--
+<?php
+$info = apcu_sma_info(true);
+
+var_dump($info['page_size'] >= 4096);
+var_dump(($info['page_size'] & ($info['page_size'] - 1)) == 0);
+var_dump(apcu_store('test', 'value'));
+var_dump(apcu_fetch('test'));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+string(5) "value"
+===DONE===
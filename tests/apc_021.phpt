@@ -0,0 +1,36 @@
+--TEST--
+APC: apcu_sma_info reports free blocks by size in limited mode
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+--FILE--
+<?php
+for ($i = 0; $i < 100; $i++) {
+	apcu_store("key$i", str_repeat('x', 1000 + $i));
+}
+for ($i = 0; $i < 100; $i += 2) {
+	apcu_delete("key$i");
+}
+
+$info = apcu_sma_info(true);
+$sizes = array_keys($info['free_blocks']);
+$sorted = $sizes;
+sort($sorted);
+
+var_dump(isset($info['block_lists']));
+var_dump(array_sum($info['free_blocks']) >= 1);
+var_dump($sizes === $sorted);
+var_dump($info['largest_free'] > 0 && $info['largest_free'] <= $info['avail_mem']);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(false)
+bool(true)
+bool(true)
+bool(true)
+===DONE===
@@ -0,0 +1,55 @@
+--TEST--
+APC: clock eviction keeps recently fetched keys and evicts idle ones
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.use_request_time=1
+apc.shm_size=1M
+apc.entries_hint=256
+apc.eviction_policy=clock
+apc.eviction_headroom=0
+--FILE--
+<?php
+function info($name) {
+	$info = apcu_cache_info(true);
+	return $info[$name];
+}
+
+$filler = str_repeat('x', 4000);
+
+for ($i = 0; $i < 8; $i++) {
+	apcu_store("hot$i", $i);
+	apcu_store("idle$i", $i);
+}
+
+/* turn the cache over a few times, the clock does not move, only fetches tell the keys apart */
+$hot = true;
+for ($n = 0; $n < 1000; $n++) {
+	for ($i = 0; $i < 8; $i++) {
+		$hot = (apcu_fetch("hot$i") === $i) && $hot;
+	}
+	apcu_store("fill$n", $filler);
+}
+
+$idle = 0;
+for ($i = 0; $i < 8; $i++) {
+	$idle += apcu_exists("idle$i");
+}
+
+var_dump($idle);
+var_dump($hot);
+var_dump(info('num_evictions') > 0);
+var_dump(info('num_entries') > 0);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+int(0)
+bool(true)
+bool(true)
+bool(true)
+===DONE===
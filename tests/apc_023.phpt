@@ -0,0 +1,51 @@
+--TEST--
+APC: segments grow up to apc.shm_max_size before entries are given up
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_segments=1
+apc.shm_size=1M
+apc.shm_max_size=4M
+apc.entries_hint=256
+--FILE--
+<?php
+$value = str_repeat('x', 4000);
+$before = apcu_sma_info(true);
+
+/* more than the segment starts with */
+$stored = 0;
+for ($i = 0; $i < 400; $i++) {
+	$stored += apcu_store("key$i", $value);
+}
+
+$found = 0;
+for ($i = 0; $i < 400; $i++) {
+	$found += (apcu_fetch("key$i") === $value);
+}
+
+$after = apcu_sma_info(true);
+$info = apcu_cache_info(true);
+
+var_dump($stored);
+var_dump($found);
+var_dump($after['seg_size'] > $before['seg_size']);
+var_dump($after['seg_size'] <= $after['max_seg_size']);
+var_dump($after['max_seg_size'] == $before['max_seg_size']);
+var_dump($info['num_expunges'] == 0);
+var_dump($info['num_evictions'] == 0);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+int(400)
+int(400)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+===DONE===
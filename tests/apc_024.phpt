@@ -0,0 +1,54 @@
+--TEST--
+APC: apcu_compact moves entries down so that free memory merges
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_segments=1
+apc.shm_size=1M
+apc.entries_hint=256
+--FILE--
+<?php
+$value = str_repeat('x', 4000);
+
+/* fill shared memory, then free every other entry */
+for ($n = 0; ; $n++) {
+	$info = apcu_sma_info(true);
+	if ($info['avail_mem'] < 65536) {
+		break;
+	}
+	apcu_store("key$n", $value);
+}
+for ($i = 0; $i < $n; $i += 2) {
+	apcu_delete("key$i");
+}
+
+$before = apcu_sma_info(true);
+$moved = apcu_compact(1000);
+$after = apcu_sma_info(true);
+
+$kept = true;
+for ($i = 1; $i < $n; $i += 2) {
+	$kept = $kept && (apcu_fetch("key$i") === $value);
+}
+
+var_dump($before['fragmentation'] >= 0.5);
+var_dump($moved > 0);
+var_dump($after['largest_free'] > $before['largest_free']);
+var_dump($after['compact_after'] < $after['compact_before']);
+var_dump($after['avail_mem'] >= $before['avail_mem']);
+var_dump($kept);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+===DONE===
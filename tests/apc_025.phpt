@@ -0,0 +1,84 @@
+--TEST--
+APC: store, fetch and delete across resizes of the slot table
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.entries_hint=16
+apc.lock_stripes=4
+--FILE--
+<?php
+$info = apcu_cache_info(true);
+$slots = $info['num_slots'];
+
+/* many more keys than the table starts with */
+for ($i = 0; $i < 500; $i++) {
+	apcu_store("key$i", $i);
+}
+
+$info = apcu_cache_info(true);
+var_dump($info['num_resizes'] > 0);
+var_dump($info['num_slots'] > $slots);
+var_dump($info['num_entries']);
+
+$found = 0;
+for ($i = 0; $i < 500; $i++) {
+	$found += (apcu_fetch("key$i") === $i);
+}
+var_dump($found);
+
+for ($i = 0; $i < 500; $i += 2) {
+	apcu_delete("key$i");
+}
+
+$found = 0;
+$gone = 0;
+for ($i = 0; $i < 500; $i++) {
+	if ($i % 2) {
+		$found += (apcu_fetch("key$i") === $i);
+	} else {
+		$gone += (apcu_fetch("key$i") === false);
+	}
+}
+var_dump($found);
+var_dump($gone);
+
+var_dump(apcu_fetch(array('key1', 'key2', 'key3')));
+var_dump(apcu_inc('key1', 10));
+var_dump(apcu_cas('key3', 3, 30));
+var_dump(apcu_fetch('key3'));
+
+/* the counters are summed over their shards */
+$before = apcu_cache_info(true);
+for ($i = 0; $i < 10; $i++) {
+	apcu_fetch('key1');
+	apcu_fetch("missing$i");
+}
+$after = apcu_cache_info(true);
+var_dump((int) ($after['num_hits'] - $before['num_hits']));
+var_dump((int) ($after['num_misses'] - $before['num_misses']));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(true)
+bool(true)
+int(500)
+int(500)
+int(250)
+int(250)
+array(2) {
+  ["key1"]=>
+  int(1)
+  ["key3"]=>
+  int(3)
+}
+int(11)
+bool(true)
+int(30)
+int(10)
+int(10)
+===DONE===
@@ -0,0 +1,42 @@
+--TEST--
+APC: entries expire by their ttl when apc.use_request_time is off
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.use_request_time=0
+--FILE--
+<?php
+apcu_store('short', 1, 1);
+apcu_store('long', 2, 100);
+apcu_store('forever', 3);
+apcu_store(array('a' => 4, 'b' => 5), null, 1);
+
+/* an entry with a ttl of one second is gone once two have passed */
+sleep(2);
+
+var_dump(apcu_fetch('short'));
+var_dump(apcu_exists('short'));
+var_dump(apcu_fetch(array('a', 'b')));
+var_dump(apcu_fetch('long'));
+var_dump(apcu_fetch('forever'));
+
+/* an expired key can be added again */
+var_dump(apcu_add('short', 6));
+var_dump(apcu_fetch('short'));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(false)
+bool(false)
+array(0) {
+}
+int(2)
+int(3)
+bool(true)
+int(6)
+===DONE===
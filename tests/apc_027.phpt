@@ -0,0 +1,55 @@
+--TEST--
+APC: the lookup filter answers misses, before and after the table grows
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.entries_hint=16
+apc.lookup_filter=1
+--FILE--
+<?php
+function misses() {
+	$before = apcu_cache_info(true);
+	for ($i = 0; $i < 100; $i++) {
+		apcu_fetch("missing$i");
+	}
+	$after = apcu_cache_info(true);
+
+	return $after['num_filtered'] - $before['num_filtered'];
+}
+
+apcu_store('key', 1);
+
+$info = apcu_cache_info(true);
+var_dump($info['lookup_filter']);
+var_dump($info['filter_size'] > 0);
+var_dump(misses() > 0);
+
+for ($i = 0; $i < 500; $i++) {
+	apcu_store("key$i", $i);
+}
+
+/* the filter never hides a key that is there */
+$found = 0;
+for ($i = 0; $i < 500; $i++) {
+	$found += (apcu_fetch("key$i") === $i);
+}
+
+$info = apcu_cache_info(true);
+var_dump($info['num_resizes'] > 0);
+var_dump($found);
+var_dump(misses() > 0);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(500)
+bool(true)
+===DONE===
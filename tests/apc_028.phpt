@@ -0,0 +1,32 @@
+--TEST--
+APC: apc.lookup_filter=0 leaves misses to the chains
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.lookup_filter=0
+--FILE--
+<?php
+apcu_store('key', 1);
+
+for ($i = 0; $i < 100; $i++) {
+	apcu_fetch("missing$i");
+}
+
+$info = apcu_cache_info(true);
+var_dump($info['lookup_filter']);
+var_dump($info['filter_size']);
+var_dump($info['num_filtered']);
+var_dump(apcu_fetch('key'));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(false)
+int(0)
+float(0)
+int(1)
+===DONE===